@@ -0,0 +1,125 @@
+// The flat table of the Se and Sr indexes against the map they replaced: vector
+// keys and values hashed byte by byte (VectorHash). Inserts, then finds of present
+// and absent keys in random order, with Se-sized entries (64-byte keys, 136-byte values).
+//
+// flat_table_bench [entries...] (default: 1M and 10M)
+#include "flat_table.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using Key = std::array<uint8_t, 64>;
+using Value = std::array<uint8_t, 136>;
+
+// The hash of the replaced map
+struct VectorHash {
+    std::size_t operator()(const std::vector<uint8_t>& vec) const {
+        std::size_t hash = 0;
+        for (uint8_t byte : vec) hash = (hash * 31) + byte;
+        return hash;
+    }
+};
+
+constexpr size_t FINDS = 2000000;
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Uniformly random keys, like the Addrw of Se: key i of the set (0: present, 1: absent)
+static Key make_key(uint64_t i, uint64_t set) {
+    Key key;
+    uint64_t state = i * 2 + set;
+    for (size_t j = 0; j < key.size(); j += sizeof(state)) {
+        // splitmix64
+        state += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        std::memcpy(&key[j], &z, sizeof(z));
+    }
+    return key;
+}
+
+struct Result {
+    double insert, hit, miss;  // ns per operation
+};
+
+static Result bench_flat(size_t n, const std::vector<uint64_t>& order, size_t& found, size_t& memory) {
+    flat::FlatMap<Key, Value> map;
+    Value value{};
+    Result result;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) map.try_emplace(make_key(i, 0), value);
+    result.insert = seconds_since(start) / n * 1e9;
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i : order) found += map.find(make_key(i, 0)) != nullptr;
+    result.hit = seconds_since(start) / order.size() * 1e9;
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i : order) found += map.find(make_key(i, 1)) != nullptr;
+    result.miss = seconds_since(start) / order.size() * 1e9;
+
+    memory = map.memory_usage();
+    return result;
+}
+
+static Result bench_vector_map(size_t n, const std::vector<uint64_t>& order, size_t& found) {
+    std::unordered_map<std::vector<uint8_t>, std::vector<uint8_t>, VectorHash> map;
+    std::vector<uint8_t> value(sizeof(Value));
+    Result result;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        Key key = make_key(i, 0);
+        map.emplace(std::vector<uint8_t>(key.begin(), key.end()), value);
+    }
+    result.insert = seconds_since(start) / n * 1e9;
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i : order) {
+        Key key = make_key(i, 0);
+        found += map.count(std::vector<uint8_t>(key.begin(), key.end()));
+    }
+    result.hit = seconds_since(start) / order.size() * 1e9;
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i : order) {
+        Key key = make_key(i, 1);
+        found += map.count(std::vector<uint8_t>(key.begin(), key.end()));
+    }
+    result.miss = seconds_since(start) / order.size() * 1e9;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; ++i) sizes.push_back(std::stoull(argv[i]));
+    if (sizes.empty()) sizes = {1000000, 10000000};
+
+    for (size_t n : sizes) {
+        std::vector<uint64_t> order(FINDS);
+        std::mt19937_64 rng(1);
+        for (uint64_t& i : order) i = rng() % n;
+
+        size_t found = 0, memory = 0;
+        Result flat = bench_flat(n, order, found, memory);
+        Result vector_map = bench_vector_map(n, order, found);
+        if (found != 2 * FINDS) {
+            std::fprintf(stderr, "Wrong number of keys found: %zu\n", found);
+            return 1;
+        }
+        std::printf("%zu entries (ns/op)  insert  hit  miss\n", n);
+        std::printf("  FlatMap             %6.0f %4.0f %5.0f  (%zu MiB)\n", flat.insert, flat.hit, flat.miss, memory >> 20);
+        std::printf("  unordered_map       %6.0f %4.0f %5.0f\n", vector_map.insert, vector_map.hit, vector_map.miss);
+    }
+}
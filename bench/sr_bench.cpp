@@ -0,0 +1,193 @@
+// Sr stored as posting lists of ordinals (Sr.log + Sr.ids) against the legacy Sr.enc,
+// whose values are Con || UUIDs: size of the files, open and read of every keyword
+// with the page cache warm and cold, rewrite of every keyword with its WAL record
+// (as the finalizations do). Keywords follow a Zipf-like document frequency.
+//
+// sr_bench [documents] [keywords] [exponent] [directory]
+#include "sr_log.hpp"
+#include "uuid_dictionary.hpp"
+#include "user_index.hpp"
+#include "posting_list.hpp"
+#include "wal.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CHECK(x) do { if (!(x)) { std::fprintf(stderr, "FAIL %s:%d %s\n", __FILE__, __LINE__, #x); std::exit(1); } } while (0)
+
+using Clock = std::chrono::steady_clock;
+static double ms(Clock::time_point t) { return std::chrono::duration<double, std::milli>(Clock::now() - t).count(); }
+
+constexpr int RUNS = 7;
+
+static double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+// Evicts the (synced) pages of a file from the page cache
+static void drop_cache(const fs::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    CHECK(fd != -1);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+// Open and read of every keyword, in ms
+struct Load {
+    double open, read;
+};
+
+static Load load_legacy(const fs::path& dir, bool cold) {
+    if (cold) drop_cache(dir / "Sr.enc");
+    Load load;
+    auto start = Clock::now();
+    SrLog sr;
+    CHECK(sr.open(dir / "Sr.enc"));
+    load.open = ms(start);
+
+    std::vector<uint8_t> value;
+    start = Clock::now();
+    for (const auto& tw : sr.keys()) CHECK(sr.get(tw.data(), value));
+    load.read = ms(start);
+    return load;
+}
+
+// The read decodes the posting lists and expands them to UUIDs, as a search does.
+static Load load_lists(const fs::path& dir, bool cold) {
+    if (cold) {
+        drop_cache(dir / "Sr.log");
+        drop_cache(dir / "Sr.ids");
+    }
+    Load load;
+    auto start = Clock::now();
+    UserIndex index;
+    CHECK(index.ids.open(dir / "Sr.ids") && index.sr.open(dir / "Sr.log"));
+    load.open = ms(start);
+
+    std::vector<uint8_t> value, uuids;
+    std::vector<uint32_t> ordinals;
+    uint64_t con;
+    start = Clock::now();
+    for (const auto& tw : index.sr.keys()) {
+        CHECK(index.sr.get(tw.data(), value) && UserIndex::parse_sr_value(value, con, ordinals));
+        uuids.clear();
+        index.ids.expand(ordinals, uuids);
+    }
+    load.read = ms(start);
+    return load;
+}
+
+static std::vector<uint8_t> record(const SrLog::Key& tw, const std::vector<uint8_t>& value) {
+    std::vector<uint8_t> rec(tw.begin(), tw.end());
+    rec.insert(rec.end(), value.begin(), value.end());
+    return rec;
+}
+
+int main(int argc, char** argv) {
+    size_t documents = argc > 1 ? std::stoul(argv[1]) : 100000;
+    size_t keywords = argc > 2 ? std::stoul(argv[2]) : 5000;
+    double exponent = argc > 3 ? std::stod(argv[3]) : 1.0;
+    fs::path dir = argc > 4 ? argv[4] : "/tmp/sr_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    Logger::instance().configure(LogLevel::off, 0);
+
+    std::mt19937_64 rng(1);
+    std::vector<DocStore::Uuid> uuids(documents);
+    for (auto& uuid : uuids)
+        for (auto& b : uuid) b = rng();
+
+    // The same lists in both formats: the keyword of rank r has documents / 2 / r^exponent documents
+    size_t postings = 0;
+    {
+        SrLog legacy;
+        UserIndex index;
+        CHECK(legacy.open(dir / "Sr.enc") && index.ids.open(dir / "Sr.ids") && index.sr.open(dir / "Sr.log"));
+        std::vector<size_t> order(documents);
+        for (size_t i = 0; i < documents; ++i) order[i] = i;
+        for (size_t k = 0; k < keywords; ++k) {
+            size_t n = std::max<size_t>(1, documents / 2 / std::pow(k + 1, exponent));
+            std::vector<uint8_t> value(8, 0);  // Con
+            for (size_t i = 0; i < n; ++i) {
+                std::swap(order[i], order[i + rng() % (documents - i)]);
+                value.insert(value.end(), uuids[order[i]].begin(), uuids[order[i]].end());
+            }
+            postings += n;
+            SrLog::Key tw;
+            for (auto& b : tw) b = rng();
+            CHECK(legacy.put(tw.data(), value) && index.put_sr_uuids(tw.data(), value.data(), value.size()));
+        }
+        CHECK(legacy.sync() && index.ids.sync() && index.sr.sync());
+
+        size_t lists = index.sr.file_size() + index.ids.file_size();
+        std::printf("%zu documents, %zu keywords, %zu postings\n", documents, keywords, postings);
+        std::printf("size      Sr.enc %10zu B  Sr.log + Sr.ids %10zu B (%zu + %zu, %.1f%%)\n", legacy.file_size(), lists,
+                    index.sr.file_size(), index.ids.file_size(), 100.0 * lists / legacy.file_size());
+    }
+
+    for (bool cold : {false, true}) {
+        std::vector<double> legacy_open, legacy_read, lists_open, lists_read;
+        for (int run = 0; run < RUNS; ++run) {
+            Load legacy = load_legacy(dir, cold), lists = load_lists(dir, cold);
+            legacy_open.push_back(legacy.open);
+            legacy_read.push_back(legacy.read);
+            lists_open.push_back(lists.open);
+            lists_read.push_back(lists.read);
+        }
+        std::printf("%s open   Sr.enc %8.2f ms    Sr.log + Sr.ids %8.2f ms\n", cold ? "cold" : "warm",
+                    median(legacy_open), median(lists_open));
+        std::printf("%s read   Sr.enc %8.2f ms    Sr.log + Sr.ids %8.2f ms (decoded, expanded)\n", cold ? "cold" : "warm",
+                    median(legacy_read), median(lists_read));
+    }
+
+    // Every keyword put again with its WAL record, as the finalization of a search
+    // does: the legacy value as is, the new one assigned, sorted and encoded.
+    {
+        SrLog legacy;
+        UserIndex index;
+        CHECK(legacy.open(dir / "Sr.enc") && index.ids.open(dir / "Sr.ids") && index.sr.open(dir / "Sr.log"));
+        std::vector<std::pair<SrLog::Key, std::vector<uint8_t>>> lists;
+        for (const auto& tw : legacy.keys()) {
+            lists.emplace_back(tw, std::vector<uint8_t>());
+            CHECK(legacy.get(tw.data(), lists.back().second));
+        }
+        std::vector<uint32_t> ordinals;
+        index.ids.find(nullptr, 0, ordinals);  // The map, built by the first finalization
+
+        Wal legacy_wal, lists_wal;
+        CHECK(legacy_wal.open(dir / "legacy.wal", std::chrono::microseconds(0)) &&
+              lists_wal.open(dir / "lists.wal", std::chrono::microseconds(0)));
+
+        auto start = Clock::now();
+        for (const auto& [tw, value] : lists) {
+            auto rec = record(tw, value);
+            CHECK(legacy.put(tw.data(), value) && legacy_wal.append(Wal::Type::sr_put, rec.data(), rec.size()));
+        }
+        CHECK(legacy_wal.commit());
+        double legacy_rewrite = ms(start);
+
+        start = Clock::now();
+        for (const auto& [tw, value] : lists) {
+            ordinals.clear();
+            CHECK(index.ids.assign(value.data() + 8, (value.size() - 8) / UuidDictionary::UUID_SIZE, ordinals));
+            posting_list::sort(ordinals, index.ids.size());
+            auto encoded = UserIndex::sr_value(0, ordinals);
+            auto rec = record(tw, encoded);
+            CHECK(index.sr.put(tw.data(), encoded) && lists_wal.append(Wal::Type::sr_list, rec.data(), rec.size()));
+        }
+        CHECK(lists_wal.commit());
+        double lists_rewrite = ms(start);
+
+        std::printf("rewrite  Sr.enc %8.2f ms    Sr.log + Sr.ids %8.2f ms\n", legacy_rewrite, lists_rewrite);
+        std::printf("WAL      Sr.enc %10zu B  Sr.log + Sr.ids %10zu B\n", legacy_wal.size(), lists_wal.size());
+    }
+    fs::remove_all(dir);
+}
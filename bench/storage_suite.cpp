@@ -0,0 +1,218 @@
+// Conformance and benchmark suite of the storage engines: the same operations and
+// scenarios run against every engine, which must give the same results.
+//
+// storage_suite [operations] [directory]
+#include "storage_engine.hpp"
+#include "se_table.hpp"
+#include "sr_log.hpp"
+#include "doc_store.hpp"
+#include "uuid_dictionary.hpp"
+#include "wal.hpp"
+#include "file_io.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+#define CHECK(x) do { if (!(x)) { std::fprintf(stderr, "FAIL %s:%d %s\n", __FILE__, __LINE__, #x); std::exit(1); } } while (0)
+
+using Clock = std::chrono::steady_clock;
+static double ms(Clock::time_point t) { return std::chrono::duration<double, std::milli>(Clock::now() - t).count(); }
+
+static std::mt19937_64 rng(1);
+static void fill(uint8_t* p, size_t n) { for (size_t i = 0; i < n; ++i) p[i] = rng(); }
+
+// The file operations of the engine interface
+static void engine_ops(StorageEngine& e, const fs::path& dir) {
+    std::error_code ec;
+    CHECK(e.create_directories(dir / "sub", ec) || !ec);
+    errno = 0;
+    CHECK(e.open(dir / "missing", 0) == -1 && errno == ENOENT);
+    CHECK(!e.exists(dir / "a", ec));
+
+    int fd = e.open(dir / "a", O_CREAT);
+    CHECK(fd != -1 && write_at(fd, "hello", 5, 0));
+    ::close(fd);
+    CHECK(e.exists(dir / "a", ec));
+    std::vector<uint8_t> c;
+    CHECK(e.read_file(dir / "a", c) && c.size() == 5 && !std::memcmp(c.data(), "hello", 5));
+
+    fd = e.open(dir / "a", O_CREAT | O_TRUNC);
+    CHECK(fd != -1 && lseek(fd, 0, SEEK_END) == 0);
+    CHECK(write_at(fd, "x", 1, 0) && e.sync(fd));
+    ::close(fd);
+
+    // Rename replaces, the descriptors of the replaced file keep it.
+    fd = e.open(dir / "b", O_CREAT);
+    CHECK(write_at(fd, "old", 3, 0));
+    e.rename(dir / "a", dir / "b", ec);
+    CHECK(!ec && !e.exists(dir / "a", ec) && e.exists(dir / "b", ec));
+    char buf[3];
+    CHECK(read_at(fd, buf, 3, 0) && !std::memcmp(buf, "old", 3));
+    ::close(fd);
+    CHECK(e.read_file(dir / "b", c) && c.size() == 1 && c[0] == 'x');
+    e.rename(dir / "a", dir / "c", ec);
+    CHECK(ec);
+
+    // Removal keeps the open descriptors.
+    fd = e.open(dir / "b", 0);
+    CHECK(e.remove(dir / "b", ec) && !e.exists(dir / "b", ec));
+    CHECK(read_at(fd, buf, 1, 0) && buf[0] == 'x');
+    ::close(fd);
+    CHECK(!e.remove(dir / "b", ec));
+
+    // Listing: the files of dir only.
+    ::close(e.open(dir / "l1", O_CREAT));
+    ::close(e.open(dir / "l2", O_CREAT));
+    ::close(e.open(dir / "sub" / "l3", O_CREAT));
+    auto list = e.list(dir, ec);
+    CHECK(list.size() == 2);
+    CHECK(e.list(dir / "sub", ec).size() == 1);
+    CHECK(e.sync_directory(dir));
+
+    // Zero-copy paths: mmap and sendfile.
+    fd = e.open(dir / "l1", O_CREAT);
+    CHECK(ftruncate(fd, 4096) == 0 && write_at(fd, "zz", 2, 100));
+    int p[2];
+    CHECK(pipe(p) == 0);
+    off_t off = 100;
+    CHECK(sendfile(p[1], fd, &off, 2) == 2 && ::read(p[0], buf, 2) == 2 && buf[0] == 'z');
+    ::close(p[0]); ::close(p[1]); ::close(fd);
+}
+
+struct Timings { double se_insert, se_find, se_compact, sr_put, sr_get, doc_put, doc_get, wal_commit, reopen; };
+
+// n entries in Se and Sr, n / 10 documents, written, read back and reopened (ms)
+static Timings scenario(const fs::path& dir, size_t n) {
+    StorageEngine& e = StorageEngine::instance();
+    std::error_code ec;
+    e.create_directories(dir, ec);
+    Timings t{};
+
+    // Se put/get/delete
+    std::vector<uint8_t> keys(n * SeTable::KEY_SIZE), values(n * SeTable::VALUE_SIZE);
+    fill(keys.data(), keys.size()); fill(values.data(), values.size());
+    {
+        SeTable se;
+        CHECK(se.open(dir / "Se.tbl"));
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < n; ++i) CHECK(se.insert(&keys[i * SeTable::KEY_SIZE], &values[i * SeTable::VALUE_SIZE]));
+        CHECK(se.sync());
+        t.se_insert = ms(t0);
+        t0 = Clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            const uint8_t* v = se.find(&keys[i * SeTable::KEY_SIZE]);
+            CHECK(v && !std::memcmp(v, &values[i * SeTable::VALUE_SIZE], SeTable::VALUE_SIZE));
+        }
+        t.se_find = ms(t0);
+        for (size_t i = 0; i < n; i += 2) CHECK(se.erase(&keys[i * SeTable::KEY_SIZE]));
+        t0 = Clock::now();
+        CHECK(se.begin_compaction());
+        while (!se.compaction_step(4096)) {}
+        SeTable::CompactionStats stats;
+        CHECK(se.finish_compaction(stats));
+        t.se_compact = ms(t0);
+    }
+
+    // Sr get/put
+    std::vector<SrLog::Key> tws(n);
+    for (auto& k : tws) fill(k.data(), k.size());
+    {
+        SrLog sr;
+        CHECK(sr.open(dir / "Sr.log"));
+        std::vector<uint8_t> v(40);
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < n; ++i) { std::memcpy(v.data(), &i, sizeof(i)); CHECK(sr.put(tws[i].data(), v)); }
+        CHECK(sr.sync());
+        t.sr_put = ms(t0);
+        t0 = Clock::now();
+        for (size_t i = 0; i < n; ++i) { CHECK(sr.get(tws[i].data(), v)); size_t j; std::memcpy(&j, v.data(), sizeof(j)); CHECK(j == i); }
+        t.sr_get = ms(t0);
+    }
+
+    // Document put/get
+    const size_t docs = n / 10, doc_size = 4096;
+    std::vector<uint8_t> batch(docs * (DocStore::HEADER_SIZE + doc_size));
+    fill(batch.data(), batch.size());
+    for (size_t i = 0; i < docs; ++i) {
+        uint64_t len = doc_size;
+        std::memcpy(&batch[i * (DocStore::HEADER_SIZE + doc_size) + DocStore::UUID_SIZE], &len, sizeof(len));
+    }
+    {
+        DocStore store;
+        CHECK(store.open(dir / "docs"));
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < docs; i += 64) {
+            size_t count = std::min<size_t>(64, docs - i);
+            CHECK(store.put_batch(&batch[i * (DocStore::HEADER_SIZE + doc_size)], count * (DocStore::HEADER_SIZE + doc_size)));
+            CHECK(store.sync());
+        }
+        t.doc_put = ms(t0);
+        std::vector<uint8_t> doc;
+        t0 = Clock::now();
+        for (size_t i = 0; i < docs; ++i) {
+            const uint8_t* rec = &batch[i * (DocStore::HEADER_SIZE + doc_size)];
+            CHECK(store.get(rec, doc) && doc.size() >= doc_size &&
+                  !std::memcmp(doc.data() + doc.size() - doc_size, rec + DocStore::HEADER_SIZE, doc_size));
+        }
+        t.doc_get = ms(t0);
+        CHECK(store.erase_batch(batch.data(), 1) == 1);
+        CHECK(store.sync());
+    }
+
+    // UUID dictionary and write-ahead log
+    {
+        UuidDictionary ids;
+        CHECK(ids.open(dir / "Sr.ids"));
+        std::vector<uint32_t> ords;
+        CHECK(ids.assign(batch.data(), 1, ords) && ords.size() == 1 && ids.sync());
+
+        Wal wal, other;
+        CHECK(wal.open(dir / "wal.log", std::chrono::microseconds(0)));
+        CHECK(!other.open(dir / "wal.log", std::chrono::microseconds(0)));  // Owned by wal
+        uint8_t rec[64] = {};
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < 2000; ++i) CHECK(wal.append(Wal::Type::se_insert, rec, sizeof(rec)) && wal.commit());
+        t.wal_commit = ms(t0);
+    }
+
+    // Everything is found again when reopened.
+    auto t0 = Clock::now();
+    SeTable se; SrLog sr; DocStore store; UuidDictionary ids; Wal wal;
+    CHECK(se.open(dir / "Se.tbl") && sr.open(dir / "Sr.log") && store.open(dir / "docs") && ids.open(dir / "Sr.ids") &&
+          wal.open(dir / "wal.log", std::chrono::microseconds(0)));
+    t.reopen = ms(t0);
+    CHECK(se.size() == n / 2 && !se.find(&keys[0]) && se.find(&keys[SeTable::KEY_SIZE]));
+    CHECK(sr.size() == n);
+    CHECK(store.size() == docs - 1);
+    CHECK(ids.size() == 1);
+    size_t records = 0;
+    CHECK(wal.replay([&](Wal::Type, const uint8_t*, size_t) { ++records; return true; }) && records == 2000);
+    return t;
+}
+
+int main(int argc, char** argv) {
+    size_t n = argc > 1 ? std::stoul(argv[1]) : 100000;
+    fs::path root = argc > 2 ? argv[2] : "/tmp/storage_suite";
+    fs::remove_all(root);
+    Logger::instance().configure(LogLevel::off, 0);
+
+    for (const char* name : {"file", "memory"}) {
+        CHECK(StorageEngine::use(name));
+        engine_ops(StorageEngine::instance(), root / name / "ops");
+        Timings t = scenario(root / name / "user", n);
+        std::printf("%-6s se_insert %7.1f  se_find %6.1f  se_compact %6.1f  sr_put %7.1f  sr_get %6.1f  "
+                    "doc_put %7.1f  doc_get %6.1f  wal_commit(2000) %7.1f  reopen %5.1f ms\n",
+                    name, t.se_insert, t.se_find, t.se_compact, t.sr_put, t.sr_get, t.doc_put, t.doc_get, t.wal_commit, t.reopen);
+    }
+    CHECK(!StorageEngine::use("nope"));
+    CHECK(!fs::exists(root / "memory"));
+    std::printf("STORAGE SUITE OK\n");
+    fs::remove_all(root);
+}
@@ -0,0 +1,109 @@
+# Acceptance benchmark of the multi-threaded server: throughput of concurrent clients
+# as the server threads grow (--workers, --shards, --sync-threads), then a stalled
+# client must not hold back the others.
+# Each client process is a user of its own (its peer uid, set when run as root): the
+# requests of a user run on one shard, the users spread over all of them.
+#
+# python3 workers_bench.py [server binary] [seconds per run]
+import multiprocessing
+import os
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '../tests'))
+from dsse_client import Client, connect
+
+SERVER = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), '../server/server'))
+SECONDS = float(sys.argv[2]) if len(sys.argv) > 2 else 5
+CORES = os.cpu_count() or 1
+CLIENTS = max(8, 2 * CORES)
+FIRST_UID = 20000
+DOCUMENTS = 64
+
+
+def start(storage, threads):
+    server = subprocess.Popen([SERVER, '--workers=%d' % threads, '--shards=%d' % threads,
+                               '--sync-threads=%d' % threads, '--load-report=0', '--log-level=warning'],
+                              cwd=storage, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.5)
+    return server
+
+
+def stop(server):
+    server.send_signal(signal.SIGINT)
+    server.wait()
+
+
+# A user adding its documents, then searching and fetching them until the deadline
+def client(index, ready, go, counts):
+    if os.getuid() == 0:
+        os.setuid(FIRST_UID + index)
+    c = Client()
+    docs = {os.urandom(16): os.urandom(4000) for _ in range(DOCUMENTS)}
+    c.add({'w': set(docs)}, docs)
+    uuids = list(docs)
+    ready.wait()
+    go.wait()
+    deadline = time.monotonic() + SECONDS
+    requests = 0
+    while time.monotonic() < deadline:
+        assert c.search('w') == set(uuids)
+        found = c.fetch(uuids[:16])
+        assert all(found[u] == c.docs[u] for u in uuids[:16])
+        requests += 2
+    counts[index] = requests
+
+
+def throughput(threads):
+    storage = tempfile.mkdtemp(prefix='dsse_bench_')
+    server = start(storage, threads)
+    ready, go = multiprocessing.Barrier(CLIENTS + 1), multiprocessing.Barrier(CLIENTS + 1)
+    counts = multiprocessing.Array('q', CLIENTS)
+    processes = [multiprocessing.Process(target=client, args=(i, ready, go, counts)) for i in range(CLIENTS)]
+    for p in processes:
+        p.start()
+    ready.wait()
+    go.wait()
+    for p in processes:
+        p.join()
+    stop(server)
+    subprocess.run(['rm', '-rf', storage])
+    if any(p.exitcode != 0 for p in processes):
+        sys.exit('A client failed')
+    return sum(counts) / SECONDS
+
+
+# A client that connects and sends nothing holds no thread: another one is served.
+def stalled():
+    storage = tempfile.mkdtemp(prefix='dsse_bench_')
+    server = start(storage, 1)
+    c = Client()
+    u = os.urandom(16)
+    c.add({'w': {u}}, {u: b'x'})
+    s = connect()
+    s.sendall(struct.pack('<I', 3))  # A fetch, without its count
+    start_time = time.monotonic()
+    served = c.fetch([u])[u] == c.docs[u]
+    elapsed = time.monotonic() - start_time
+    s.close()
+    stop(server)
+    subprocess.run(['rm', '-rf', storage])
+    return served, elapsed
+
+
+if __name__ == '__main__':
+    if os.getuid() != 0:
+        print('Not root: every client is the same user, on one shard')
+    thread_counts = sorted({1, 2, 4, CORES} | {t for t in (8, 16, 32, 64) if t <= CORES})
+    base = None
+    print('%d cores, %d clients, %g s per run' % (CORES, CLIENTS, SECONDS))
+    for threads in thread_counts:
+        rate = throughput(threads)
+        base = base or rate
+        print('threads=%-3d %8.0f requests/s  x%.2f' % (threads, rate, rate / base))
+    served, elapsed = stalled()
+    print('stalled client: another request %s' % ('served in %.3f s' % elapsed if served else 'not served'))
@@ -12,7 +12,8 @@ void print_usage(const char *program_name) {
     cerr << "Usage:\n";
     cerr << program_name << " add file...\n";
     cerr << program_name << " remove document_id...\n";
-    cerr << program_name << " search keyword...\n";
+    cerr << program_name << " search keyword... [-a] [-o output_directory]    (-a: the documents with all the keywords)\n";
+    cerr << program_name << " repl    (the commands above from the standard input, one per line)\n";
     cerr.flush();
 }
 
@@ -24,6 +25,8 @@ std::optional<Action> parse_action(const std::string& raw_action) {
         return Action::remove;
     } else if (raw_action == "search") {
         return Action::search;
+    } else if (raw_action == "repl") {
+        return Action::repl;
     }
     return std::nullopt;
 }
@@ -42,14 +45,27 @@ ArgsRemove parse_remove([[maybe_unused]] int argc, [[maybe_unused]] const char *
     return {};
 }
 ArgsSearch parse_search(int argc, const char **argv) {
-    if (argc < 1) {
+    ArgsSearch args{};
+
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "-o") {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("The output directory is needed after -o");
+                abort();
+            }
+            args.output_dir = argv[++i];
+        } else if (std::string(argv[i]) == "-a") {
+            args.conjunctive = true;
+        } else {
+            args.keywords.emplace_back(argv[i]);
+        }
+    }
+    if (args.keywords.empty()) {
         throw std::invalid_argument("The keyword is needed");
         abort();
-    } else if (argc > 1) {
-        std::clog << "[WARN] Too many parameters only the first is considered." << std::endl;
     }
 
-    return {argv[0]};
+    return args;
 }
 
 Args parse_args(const Action& action, int argc, const char **argv) {
@@ -60,8 +76,10 @@ Args parse_args(const Action& action, int argc, const char **argv) {
             return parse_remove(argc, argv);
         case Action::search: 
             return parse_search(argc, argv);
+        case Action::repl:
+            return ArgsRepl{};
         default:
-            throw std::invalid_argument("Invalid action. Choose between add, remove and search.");
+            throw std::invalid_argument("Invalid action. Choose between add, remove, search and repl.");
     }
 }
 
@@ -88,7 +106,7 @@ Args parse_action(int argc, const char **argv) {
         
         return parse_args(action, argc, argv);
     } else {
-        throw std::invalid_argument("Invalid action. Choose between add, remove and search.");
+        throw std::invalid_argument("Invalid action. Choose between add, remove, search and repl.");
         abort();
     }
 
@@ -9,7 +9,7 @@
 #include <Monocypher.hh>
 
 
-enum class Action { add = 0, remove = 1, search = 2 };
+enum class Action { add = 0, remove = 1, search = 2, repl = 3 };
 
 using Path = std::filesystem::path;
 using Keyword = std::string;
@@ -17,9 +17,11 @@ using DocId = monocypher::byte_array<sizeof(uuid_t)>;
 
 struct ArgsAdd { std::vector<Path> paths; };
 struct ArgsRemove { std::vector<DocId> ids; };
-struct ArgsSearch { Keyword keyword; };
+// The results are fetched if output_dir is given. conjunctive: only the documents with all the keywords.
+struct ArgsSearch { std::vector<Keyword> keywords; Path output_dir; bool conjunctive = false; };
+struct ArgsRepl {};  // The commands are read from the standard input
 
-using Args = std::variant<ArgsAdd, ArgsRemove, ArgsSearch>;
+using Args = std::variant<ArgsAdd, ArgsRemove, ArgsSearch, ArgsRepl>;
 
 // Custom implementation for this simple case.
 /// @return a list of arguments (their interpretation depends on the action: paths, ids or keywords).
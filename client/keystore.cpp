@@ -8,6 +8,8 @@
 
 template<size_t lambda>
 void Keystore<lambda>::load_keys() {
+    if (held && loaded) return;
+
     using AE = monocypher::session::encryption_key<monocypher::XChaCha20_Poly1305>;
     using Nonce = monocypher::session::nonce;
     using Mac = monocypher::session::mac;
@@ -54,6 +56,7 @@ void Keystore<lambda>::load_keys() {
 
     // Check then decrypt the keys.
     auto ok = AE(key).unlock(nonce, mac, data, ad, data.data());
+    if (ok && held) file_key.emplace(key, salt);
     key.wipe();
     if (!ok) {
         throw CorruptedKeys();
@@ -66,19 +69,23 @@ void Keystore<lambda>::load_keys() {
     key_t = monocypher::secret_byte_array(data.template range<2*lambda, lambda>());
     key_f = monocypher::secret_byte_array(data.template range<3*lambda, lambda>());
     con = data.template range<4*lambda, 8>();
+    loaded = held;
 
 }
 
 template<size_t lambda>
 void Keystore<lambda>::store_keys() {
-    // Pick a storing password.
+    // Pick a storing password (once while the keys are held).
     // NOTE: it is possible to put a new password in order to change it.
     // On production this would require confirmation.
-    std::array<char, 256> password;
-    obtain_secure_password(password, "Choose password: ");
-    
-    // NOTE: password is internally wiped.
-    auto [key, salt] = derive_key(password);
+    if (!file_key) {
+        std::array<char, 256> password;
+        obtain_secure_password(password, "Choose password: ");
+
+        // NOTE: password is internally wiped.
+        file_key.emplace(derive_key(password));
+    }
+    auto& [key, salt] = *file_key;
 
     using AE = monocypher::session::encryption_key<monocypher::XChaCha20_Poly1305>;
     using Nonce = monocypher::session::nonce;
@@ -89,10 +96,10 @@ void Keystore<lambda>::store_keys() {
     // Random nonce, 24B: can be safely assumed unique.
     Nonce nonce{};
     auto mac = AE(key).lock(nonce, data, ad, data.data());
-    key.wipe();
-    wipe_keys();
-
     auto file_data = salt | mac | nonce | data;
+    // NOTE: key and salt refer to file_key.
+    if (!held) file_key.reset();
+    wipe_keys();
 
     std::filesystem::path key_file("./keys.enc");
     std::ofstream keystream(key_file);
@@ -113,6 +120,8 @@ void Keystore<lambda>::store_keys() {
 
 template<size_t lambda>
 void Keystore<lambda>::wipe_keys() {
+    if (held) return;
+
     key_d.wipe();
     key_g.wipe();
     key_f.wipe();
@@ -127,4 +136,19 @@ void Keystore<lambda>::create_keys() {
     key_f.randomize();
     key_t.randomize();
     con = serialize(-2ULL);
+    loaded = held;
+}
+
+template<size_t lambda>
+void Keystore<lambda>::hold() {
+    held = true;
+}
+
+template<size_t lambda>
+void Keystore<lambda>::release() {
+    held = false;
+    loaded = false;
+    // NOTE: the secret arrays are wiped when destroyed.
+    file_key.reset();
+    wipe_keys();
 }
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <Monocypher.hh>
+#include <optional>
+#include <utility>
 #include "utils.hpp"
+#include "password_utils.hpp"
 
 /// Stores the state theta of the protocol.
 /// The state is loaded on-demand, but the keys are stored in clear.
@@ -36,6 +39,18 @@ public:
     /// Wipes the keys on ram.
     void wipe_keys();
 
+    /// Keeps the keys in memory once loaded or created, until release(): meanwhile
+    /// load_keys and wipe_keys have no effect, and store_keys asks the password only
+    /// if it was not given yet.
+    void hold();
+    void release();
+
+private:
+    bool held = false;
+    bool loaded = false;
+    /// Key (and salt) of the key-file, kept while held.
+    std::optional<std::pair<argon2id::hash, argon2id::salt>> file_key;
+
 };
 
 
@@ -1,13 +1,19 @@
 #include "argparse.hpp"
 #include "protocol.hpp"
+#include "repl.hpp"
 #include "utils.hpp"
 #include <cstdlib>
 #include <utility>
 #include <functional>
+#include <fstream>
+#include "trace.hpp"
 #include <sockpp/unix_stream_socket.h>
 
 #define SOCK_ADDR "\0dsse_apocm"
 
+// Tracing spans kept when DSSE_TRACE is set
+constexpr size_t TRACE_SPANS = 1 << 16;
+
 int main(int argc, const char **argv) {
     sockpp::initialize();
     
@@ -21,15 +27,30 @@ int main(int argc, const char **argv) {
     }
 
 
+    // DSSE_TRACE=<file>: the requests are traced, the spans written there on exit in
+    // the Chrome trace format (see trace.hpp).
+    struct TraceDump {
+        const char* path;
+        ~TraceDump() {
+            if (path) std::ofstream(path) << Tracer::instance().dump();
+        }
+    } trace_dump{std::getenv("DSSE_TRACE")};
+    if (trace_dump.path) Tracer::instance().configure(TRACE_SPANS);
+
     try {
 
-        Protocol<32> dsse(SOCK_ADDR);
+        // The REPL runs all its commands in a single session.
+        const bool session = std::holds_alternative<ArgsRepl>(args);
+        Protocol<32> dsse(SOCK_ADDR, session);
 
+        int status = EXIT_SUCCESS;
         std::visit(overload{
             [&](const ArgsAdd& args) { dsse.add(args); },
             [&](const ArgsRemove& args) { dsse.remove(args); },
             [&](const ArgsSearch& args) { dsse.search(args); },
+            [&](const ArgsRepl&) { status = repl(dsse, argv[0]); },
         }, args);
+        if (status != EXIT_SUCCESS) return status;
 
     } catch (const KeysNotFound& e) {
         std::cerr << "[ERROR]" << e.what() << "." << std::endl;
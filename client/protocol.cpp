@@ -6,10 +6,14 @@
 #include <stdexcept>
 #include <format>
 #include <Monocypher.hh>
+#include "blake2b_batch.hpp"
 #include <filesystem>
 #include <iterator>
+#include <algorithm>
 #include <fstream>
 #include <regex>
+#include <optional>
+#include <cstring>
 
 
 template<size_t lambda>
@@ -30,9 +34,14 @@ void Protocol<lambda>::setup() {
 
 template<size_t lambda>
 void Protocol<lambda>::add(const ArgsAdd& args) {
+    uint64_t request = ++last_request;
+    TraceContext trace = new_trace(request);
+    TraceSpan span("add", trace);
+
     DocMap documents;
 
     std::clog << "[+] Reading documents." << std::endl;
+    TraceSpan read_span("read_documents", trace);
 
     // Read documents.
     for (auto& path : args.paths) {
@@ -57,7 +66,9 @@ void Protocol<lambda>::add(const ArgsAdd& args) {
         }
     }
 
+    read_span.end();
     std::clog << "[+] Generating index." << std::endl;
+    TraceSpan index_span("index", trace);
 
     KTMap index;
 
@@ -74,7 +85,9 @@ void Protocol<lambda>::add(const ArgsAdd& args) {
 
     }
 
+    index_span.end();
     std::clog << "[+] Encrypting." << std::endl;
+    TraceSpan encrypt_span("encrypt", trace);
     
     // The keys are needed to generate the encrypted index and encrypting the documents.
     // NOTE: reading of the documents and sending to the server are not performed while the keys are loaded to avoid IO blocks.
@@ -88,16 +101,25 @@ void Protocol<lambda>::add(const ArgsAdd& args) {
     --keystore.con;
     keystore.store_keys();
     keystore.wipe_keys();
+    encrypt_span.end();
 
     std::clog << "[+] Sending data." << std::endl;
 
-    send(0); // add operation
+    TraceSpan send_span("send", trace);
+    begin_request(OP_UPDATE, 2 * sizeof(uint64_t) + encrypted_index.size() + docs.size(), request);
     send(encrypted_index.size());
     send(encrypted_index);
     send(docs.size());
     send(docs);
-
-    print_response();
+    send_span.end();
+
+    if (in_session) {
+        TraceSpan wait_span("wait_response", trace);
+        wait_response(request);
+        std::clog << "[+] Update stored." << std::endl;
+    } else {
+        print_response();
+    }
 }
 
 template<size_t lambda>
@@ -106,76 +128,71 @@ void Protocol<lambda>::remove([[maybe_unused]] const ArgsRemove& args) {
 }
 
 template<size_t lambda>
-void Protocol<lambda>::search(const ArgsSearch& args) {
-    // The primitives used.
-    using prf = monocypher::hash<monocypher::Blake2b<32>>;
-    using hash = monocypher::hash<monocypher::Blake2b<64>>;
-    using prp = monocypher::session::encryption_key<monocypher::XChaCha20_Poly1305>;
+std::vector<typename Protocol<lambda>::KeywordSearch> Protocol<lambda>::search_keywords(const ArgsSearch& args) {
+    std::vector<KeywordSearch> keywords;
+    std::unordered_set<Keyword> seen;
+    for (const auto& keyword : args.keywords) {
+        if (seen.insert(keyword).second) keywords.push_back({keyword, {}, {}, {}});
+    }
+    return keywords;
+}
 
-    std::clog << "[+] Sending search parameters." << std::endl;
+template<size_t lambda>
+monocypher::byte_array<8> Protocol<lambda>::send_query(Opcode opcode, const std::vector<KeywordSearch>& keywords,
+                                                       uint64_t request) {
+    using prf = monocypher::hash<monocypher::Blake2b<32>>;
 
     keystore.load_keys();
 
-    // Search parameters.
-    const auto& keyword = args.keyword;
-    auto t = prf::createMAC(keyword.data(), keyword.size(), keystore.key_t);
-    auto kt = prf::createMAC(keyword.data(), keyword.size(), keystore.key_f);
-
+    // Search parameters: Con, count, then t and kt of each keyword.
     // Store con to send it to the server.
     auto con = keystore.con;
+    uint64_t count = keywords.size();
+    Data query;
+    query.insert(query.end(), con.begin(), con.end());
+    query.insert(query.end(), reinterpret_cast<uint8_t*>(&count), reinterpret_cast<uint8_t*>(&count) + sizeof(count));
+    for (const auto& search : keywords) {
+        const auto& keyword = search.keyword;
+        auto t = prf::createMAC(keyword.data(), keyword.size(), keystore.key_t);
+        auto kt = prf::createMAC(keyword.data(), keyword.size(), keystore.key_f);
+        query.insert(query.end(), t.begin(), t.end());
+        query.insert(query.end(), kt.begin(), kt.end());
+        t.wipe();
+        kt.wipe();
+    }
     // Wiped before IO.
     keystore.wipe_keys();
 
-    send(2);
-    send(t);
-    t.wipe();
-    send(kt);
-    kt.wipe();
-    send(con);
-    
-    std::clog << "[+] Reading first response." << std::endl;
+    begin_request(opcode, query.size(), request);
+    send(query);
+    monocypher::wipe(query.data(), query.size());
+    return con;
+}
 
-    // ID1.size, ID2.size
-    auto count_1 = recv<size_t>();
-    auto count_2 = recv<size_t>();
+template<size_t lambda>
+void Protocol<lambda>::receive_entries(KeywordSearch& keyword, size_t size) {
+    using hash = monocypher::hash<monocypher::Blake2b<64>>;
 
-    if (count_1 % DocId::byte_count != 0) {
-        throw std::runtime_error("Corrupted response");
-        abort();
-    }
-    count_1 /= DocId::byte_count;
-    
-    if (count_2 % (hash::Size + decltype(keystore.con)::byte_count) != 0) {
+    if (size % (hash::Size + decltype(keystore.con)::byte_count) != 0) {
         throw std::runtime_error("Corrupted response");
         abort();
     }
-    count_2 /= hash::Size + decltype(keystore.con)::byte_count;
+    size /= hash::Size + decltype(keystore.con)::byte_count;
 
-    using hash_t = monocypher::byte_array<hash::Size>;
-    using Con = decltype(keystore.con);
-
-    std::unordered_set<DocId> id1;
-    std::unordered_set<DocId> removals;
-    std::vector<std::pair<hash_t, Con>> id2; 
-
-    // read ID1
-    for (size_t i = 0; i < count_1; ++i) {
-        auto uuid = recv<DocId::byte_count>();
-        id1.insert(uuid);
-    }
-    // read ID2
-    for (size_t i = 0; i < count_2; ++i) {
+    for (size_t i = 0; i < size; ++i) {
         auto eid = recv<hash::Size>();
         auto con = recv<sizeof(keystore.con)>();
 
-        id2.emplace_back(eid, con);
+        keyword.id2.emplace_back(eid, con);
     }
+}
 
-    std::clog << "[+] Decrypting entries." << std::endl;
+template<size_t lambda>
+void Protocol<lambda>::decrypt_entries(KeywordSearch& keyword) {
+    using prf = monocypher::hash<monocypher::Blake2b<32>>;
+    using prp = monocypher::session::encryption_key<monocypher::XChaCha20_Poly1305>;
 
-    // Decryption of the results
-    keystore.load_keys();
-    for (auto& [eid, con] : id2) {
+    for (auto& [eid, con] : keyword.id2) {
         using Mac = monocypher::session::mac;
         using Nonce = monocypher::session::nonce;
 
@@ -183,7 +200,7 @@ void Protocol<lambda>::search(const ArgsSearch& args) {
         Nonce nonce(eid.template range<Mac::byte_count, Nonce::byte_count>());
         auto data = eid.template range<40, 24>();
 
-        auto sk_plain = keyword | con;
+        auto sk_plain = keyword.keyword | con;
         monocypher::secret_byte_array sk(prf::createMAC(sk_plain.data(), sk_plain.size(), keystore.key_g));
         monocypher::wipe(sk_plain.data(), sk_plain.size());
 
@@ -201,36 +218,358 @@ void Protocol<lambda>::search(const ArgsSearch& args) {
         // Without guarantees about the receiving order it is better to only remove 
         // after insertions.
         if (op == 0) {
-            id1.insert(uuid);
+            keyword.id1.insert(uuid);
         } else {
-            removals.insert(uuid);
+            keyword.removals.insert(uuid);
         }
     }
+}
+
+template<size_t lambda>
+std::unordered_set<DocId> Protocol<lambda>::receive_results(std::optional<uint64_t> size) {
+    auto count = recv<size_t>();
+    if (size && *size != sizeof(count) + count * DocId::byte_count) {
+        throw std::runtime_error("Corrupted response");
+        abort();
+    }
+    std::unordered_set<DocId> results;
+    for (size_t i = 0; i < count; ++i) results.insert(recv<DocId::byte_count>());
+    return results;
+}
+
+template<size_t lambda>
+void Protocol<lambda>::search(const ArgsSearch& args) {
+    if (args.conjunctive) {
+        search_all(args);
+        return;
+    }
+
+    // All the keywords are searched by a single request.
+    std::vector<KeywordSearch> keywords = search_keywords(args);
+
+    uint64_t request = ++last_request;
+    TraceContext trace = new_trace(request);
+    TraceSpan span("search", trace);
+
+    std::clog << "[+] Sending search parameters." << std::endl;
+    TraceSpan send_span("send_query", trace);
+    auto con = send_query(OP_SEARCH_BATCH, keywords, request);
+    send_span.end();
     
+    std::clog << "[+] Reading first response." << std::endl;
+    TraceSpan wait_span("wait_results", trace);
+
+    std::optional<Frame> response;
+    if (in_session) response = wait_response(request);
+    uint64_t received = 0;
+
+    // ID1.size, ID2.size, ID1, ID2 of each keyword
+    for (auto& keyword : keywords) {
+        auto count_1 = recv<size_t>();
+        if (!in_session && count_1 == BUSY_SIZE) {
+            throw std::runtime_error("Server busy, retry later");
+            abort();
+        }
+        auto count_2 = recv<size_t>();
+        wait_span.end();
+        TraceSpan receive_span("receive_results", trace);
+
+        received += 2 * sizeof(size_t) + count_1 + count_2;
+        if (response && response->size < received) {
+            throw std::runtime_error("Corrupted response");
+            abort();
+        }
+
+        if (count_1 % DocId::byte_count != 0) {
+            throw std::runtime_error("Corrupted response");
+            abort();
+        }
+        count_1 /= DocId::byte_count;
+
+        // read ID1
+        for (size_t i = 0; i < count_1; ++i) {
+            auto uuid = recv<DocId::byte_count>();
+            keyword.id1.insert(uuid);
+        }
+        // read ID2
+        receive_entries(keyword, count_2);
+    }
+    if (response && response->size != received) {
+        throw std::runtime_error("Corrupted response");
+        abort();
+    }
+
+    std::clog << "[+] Decrypting entries." << std::endl;
+    TraceSpan decrypt_span("decrypt", trace);
 
+    // Decryption of the results
+    keystore.load_keys();
+    for (auto& keyword : keywords) decrypt_entries(keyword);
+
+    // NOTE: the documents key is kept to decrypt the fetched documents, without asking
+    // the password again.
+    std::optional<DocKey> key_d;
+    if (!args.output_dir.empty()) key_d.emplace(keystore.key_d);
     keystore.wipe_keys();
 
-    for (auto& uuid : removals) id1.erase(uuid);
+    uint64_t final_size = con.size();
+    for (auto& keyword : keywords) {
+        for (auto& uuid : keyword.removals) keyword.id1.erase(uuid);
+        final_size += sizeof(size_t) + keyword.id1.size() * DocId::byte_count;
+    }
+    decrypt_span.end();
 
     std::clog << "[+] Sending Sr." << std::endl;
+    TraceSpan finalize_span("send_results", trace);
 
-    send(id1.size());
-    if (id1.empty()) {
-        std::cout << "No results." << std::endl;
+    // Step 2 has no opcode of its own without a session.
+    if (in_session) {
+        Frame frame{request, final_size, OP_SEARCH_FINALIZE};
+        send(frame);
+        unacknowledged.insert(request);
     }
-    for (auto& uuid : id1) {
-        hexprint(uuid);
-        send(uuid);
+    // The documents found, fetched once even if they match many keywords.
+    std::unordered_set<DocId> found;
+    for (auto& keyword : keywords) {
+        // The results are listed under their keyword when there are many.
+        if (keywords.size() > 1) std::cout << keyword.keyword << ":" << std::endl;
+        send(keyword.id1.size());
+        if (keyword.id1.empty()) {
+            std::cout << "No results." << std::endl;
+        }
+        for (auto& uuid : keyword.id1) {
+            hexprint(uuid);
+            send(uuid);
+        }
+        found.insert(keyword.id1.begin(), keyword.id1.end());
     }
 
     send(con);
+    finalize_span.end();
+
+    if (key_d) {
+        TraceSpan fetch_span("fetch", trace);
+        if (!found.empty()) fetch(found, args.output_dir, *key_d);
+        key_d->wipe();
+    }
+}
+
+// The server answers with the encrypted entries (ID2) of each keyword. Without any,
+// its results in Sr are up to date and it intersects them right away. Otherwise the
+// insertions and removals decrypted are sent back (step 2), the server changes the
+// results in Sr with them, then intersects them.
+template<size_t lambda>
+void Protocol<lambda>::search_all(const ArgsSearch& args) {
+    std::vector<KeywordSearch> keywords = search_keywords(args);
+
+    uint64_t request = ++last_request;
+    TraceContext trace = new_trace(request);
+    TraceSpan span("search_all", trace);
+
+    std::clog << "[+] Sending search parameters." << std::endl;
+    TraceSpan send_span("send_query", trace);
+    auto con = send_query(OP_SEARCH_AND, keywords, request);
+    send_span.end();
+
+    std::clog << "[+] Reading first response." << std::endl;
+    TraceSpan wait_span("wait_results", trace);
+
+    std::optional<Frame> response;
+    if (in_session) response = wait_response(request);
+    uint64_t received = 0;
+
+    // ID2.size, ID2 of each keyword
+    bool settled = true;  // No keyword has new entries
+    for (auto& keyword : keywords) {
+        auto size = recv<size_t>();
+        if (!in_session && size == BUSY_SIZE) {
+            throw std::runtime_error("Server busy, retry later");
+            abort();
+        }
+        wait_span.end();
+        TraceSpan receive_span("receive_results", trace);
+
+        received += sizeof(size) + size;
+        if (response && response->size < received) {
+            throw std::runtime_error("Corrupted response");
+            abort();
+        }
+        receive_entries(keyword, size);
+        settled = settled && keyword.id2.empty();
+    }
+
+    std::optional<DocKey> key_d;
+    std::unordered_set<DocId> found;
+    if (settled) {
+        TraceSpan receive_span("receive_results", trace);
+        found = receive_results(response ? std::optional<uint64_t>(response->size - received) : std::nullopt);
+
+        if (!args.output_dir.empty()) {
+            keystore.load_keys();
+            key_d.emplace(keystore.key_d);
+            keystore.wipe_keys();
+        }
+    } else {
+        std::clog << "[+] Decrypting entries." << std::endl;
+        TraceSpan decrypt_span("decrypt", trace);
+
+        keystore.load_keys();
+        for (auto& keyword : keywords) decrypt_entries(keyword);
+        // NOTE: the documents key is kept to decrypt the fetched documents, without asking
+        // the password again.
+        if (!args.output_dir.empty()) key_d.emplace(keystore.key_d);
+        keystore.wipe_keys();
+        decrypt_span.end();
+
+        std::clog << "[+] Sending the changes." << std::endl;
+        TraceSpan finalize_span("send_changes", trace);
+
+        // Step 2: the UUIDs added, then removed, of each keyword.
+        if (in_session) {
+            uint64_t final_size = con.size();
+            for (auto& keyword : keywords) {
+                final_size += 2 * sizeof(size_t) + (keyword.id1.size() + keyword.removals.size()) * DocId::byte_count;
+            }
+            // Answered with the results: waited for here.
+            send(Frame{request, final_size, OP_SEARCH_FINALIZE});
+        }
+        for (auto& keyword : keywords) {
+            send(keyword.id1.size());
+            for (auto& uuid : keyword.id1) send(uuid);
+            send(keyword.removals.size());
+            for (auto& uuid : keyword.removals) send(uuid);
+        }
+        send(con);
+        finalize_span.end();
+
+        TraceSpan results_span("wait_results", trace);
+        if (in_session) response = wait_response(request);
+        found = receive_results(response ? std::optional<uint64_t>(response->size) : std::nullopt);
+    }
+
+    if (found.empty()) {
+        std::cout << "No results." << std::endl;
+    }
+    for (auto& uuid : found) hexprint(uuid);
+
+    if (key_d) {
+        TraceSpan fetch_span("fetch", trace);
+        if (!found.empty()) fetch(found, args.output_dir, *key_d);
+        key_d->wipe();
+    }
+}
+
+template<size_t lambda>
+void Protocol<lambda>::fetch(const std::unordered_set<DocId>& ids, const Path& output_dir, const DocKey& key) {
+    std::clog << "[+] Fetching documents." << std::endl;
+
+    std::filesystem::create_directories(output_dir);
+
+    // The server closes the connection after a search, unless in a session.
+    if (!in_session) connect();
+    uint64_t request = ++last_request;
+    begin_request(OP_FETCH, sizeof(size_t) + ids.size() * DocId::byte_count, request);
+    send(ids.size());
+    for (auto& uuid : ids) send(uuid);
+
+    if (in_session) wait_response(request);
+    auto count = recv<size_t>();
+    if (!in_session && count == BUSY_SIZE) {
+        throw std::runtime_error("Server busy, retry later");
+        abort();
+    }
+    if (count != ids.size()) {
+        throw std::runtime_error("Corrupted response");
+        abort();
+    }
+
+    // The documents are streamed: UUID || length || mac || nonce || ciphertext,
+    // a missing document has length UINT64_MAX.
+    size_t saved = 0;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        auto ad = recv<DocId::byte_count + 8>();
+        DocId uuid(ad.template range<0, DocId::byte_count>());
+        uint64_t size;
+        std::memcpy(&size, ad.data() + DocId::byte_count, sizeof(size));
+
+        if (size == UINT64_MAX) {
+            std::cerr << "[WARN] Document " << hexstring(uuid) << " not found." << std::endl;
+            continue;
+        }
+        if (!ids.contains(uuid) || size < 16 + 24) {
+            throw std::runtime_error("Corrupted response");
+            abort();
+        }
+
+        if (receive_document(output_dir / hexstring(uuid), ad, key, size)) {
+            ++saved;
+        } else {
+            std::cerr << "[WARN] Document " << hexstring(uuid) << " is corrupted: ignored." << std::endl;
+        }
+    }
 
-    // TODO: read documents.
+    std::clog << "[+] " << saved << " documents saved in " << output_dir << "." << std::endl;
 }
 
 template<size_t lambda>
-Protocol<lambda>::Protocol(const sockpp::unix_address& server_addr) {
+bool Protocol<lambda>::receive_document(const Path& path, const monocypher::byte_array<DocId::byte_count + 8>& ad,
+                                        const DocKey& key, uint64_t size) {
+    namespace c = monocypher::c;
+    using Mac = monocypher::session::mac;
+    using Nonce = monocypher::session::nonce;
+
+    auto mac = recv<Mac::byte_count>();
+    auto nonce = recv<Nonce::byte_count>();
+    size -= Mac::byte_count + Nonce::byte_count;
+
+    // Incremental XChaCha20-Poly1305 unlock, the same construction of prp::lock (see
+    // encrypt_documents): the first block of the key stream is the Poly1305 key, the
+    // text is encrypted from the second one. The mac covers the padded ad, the padded
+    // ciphertext and their lengths.
+    static const uint8_t padding[16] = {};
+    uint8_t auth_key[64];
+    c::crypto_chacha20_x(auth_key, nullptr, sizeof(auth_key), key.data(), nonce.data(), 0);
+    c::crypto_poly1305_ctx poly;
+    c::crypto_poly1305_init(&poly, auth_key);
+    monocypher::wipe(auth_key, sizeof(auth_key));
+    c::crypto_poly1305_update(&poly, ad.data(), ad.size());
+    c::crypto_poly1305_update(&poly, padding, (16 - ad.size() % 16) % 16);
+
+    // The plaintext is written to a temporary file, renamed once the document is authenticated.
+    Path partial = path;
+    partial += ".part";
+    std::ofstream file(partial, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+
+    Data chunk(std::min<uint64_t>(size, FETCH_CHUNK));
+    uint64_t counter = 1;
+    for (uint64_t received = 0; received < size;) {
+        size_t n = std::min<uint64_t>(size - received, chunk.size());
+        recv(chunk.data(), n);
+        c::crypto_poly1305_update(&poly, chunk.data(), n);
+        counter = c::crypto_chacha20_x(chunk.data(), chunk.data(), n, key.data(), nonce.data(), counter);
+        file.write(reinterpret_cast<const char*>(chunk.data()), n);
+        received += n;
+    }
+    monocypher::wipe(chunk.data(), chunk.size());
+
+    auto sizes = serialize(ad.size()) | serialize(size);
+    c::crypto_poly1305_update(&poly, padding, (16 - size % 16) % 16);
+    c::crypto_poly1305_update(&poly, sizes.data(), sizes.size());
+    Mac computed;
+    c::crypto_poly1305_final(&poly, computed.data());
+
+    file.close();
+    std::error_code ec;
+    if (c::crypto_verify16(computed.data(), mac.data()) != 0 || !file) {
+        std::filesystem::remove(partial, ec);
+        return false;
+    }
+    std::filesystem::rename(partial, path, ec);
+    return !ec;
+}
 
+template<size_t lambda>
+void Protocol<lambda>::connect() {
     // Connects to the server.
     if (auto res = sock.connect(server_addr); !res) {
         auto msg = std::format("Unable to reach the server.", sock.last_error_str());
@@ -244,6 +583,59 @@ Protocol<lambda>::Protocol(const sockpp::unix_address& server_addr) {
 
 }
 
+template<size_t lambda>
+Protocol<lambda>::Protocol(const sockpp::unix_address& server_addr, bool session)
+    : server_addr(server_addr), in_session(session) {
+    connect();
+    if (in_session) send(OP_SESSION);
+}
+
+template<size_t lambda>
+void Protocol<lambda>::begin_request(Opcode opcode, uint64_t size, uint64_t request_id) {
+    if (in_session) {
+        send(Frame{request_id, size, opcode});
+    } else {
+        send(opcode);
+    }
+}
+
+template<size_t lambda>
+Frame Protocol<lambda>::wait_response(uint64_t request_id) {
+    for (;;) {
+        auto frame = recv<Frame>();
+        if (frame.request_id != request_id) {
+            acknowledge(frame);
+            continue;
+        }
+        if (frame.code == STATUS_BUSY) {
+            throw std::runtime_error("Server busy, retry later");
+            abort();
+        }
+        if (frame.code != STATUS_OK) {
+            throw std::runtime_error("Request failed on the server");
+            abort();
+        }
+        return frame;
+    }
+}
+
+template<size_t lambda>
+void Protocol<lambda>::acknowledge(const Frame& frame) {
+    // Only one request with a response body is in flight at a time.
+    if (!unacknowledged.erase(frame.request_id) || frame.size != 0) {
+        throw std::runtime_error("Corrupted response");
+        abort();
+    }
+    if (frame.code != STATUS_OK) {
+        std::cerr << "[WARN] Request " << frame.request_id << " failed on the server." << std::endl;
+    }
+}
+
+template<size_t lambda>
+void Protocol<lambda>::finish() {
+    while (!unacknowledged.empty()) acknowledge(recv<Frame>());
+}
+
 template<size_t lambda>
 Protocol<lambda>::Data Protocol<lambda>::process(Operation op, const KTMap& index) const {
     // Blake2b as prf (keyed) and hash (unkeyed) function.
@@ -255,14 +647,49 @@ Protocol<lambda>::Data Protocol<lambda>::process(Operation op, const KTMap& inde
 
     std::unordered_map<key, value> encrypted_index;
 
-    // Encrypt the index
+    // The hashes of the keywords are independent, they are computed in batches
+    // (see blake2b_batch.hpp).
+    constexpr size_t kt_con_size = prf::Size + decltype(Keystore<lambda>::con)::byte_count;
+    constexpr size_t key_suffix_size = hash::Size + 1;
+    const size_t count = index.size();
+
+    // KTw || con
+    Data kt_con(count * kt_con_size);
+    size_t n = 0;
     for (auto& [keyword, docs] : index) {
-        // KTw
         auto kt = prf::createMAC(keyword.data(), keyword.length(), keystore.key_f);
-        // Keyw
-        auto key = hash::create(kt | keystore.con);
-        // Addrw
-        monocypher::byte_array addr = hash::create(key | one<1>);
+        auto message = kt | keystore.con;
+        std::copy(message.begin(), message.end(), kt_con.begin() + n++ * kt_con_size);
+        kt.wipe();
+        message.wipe();
+    }
+
+    // Keyw
+    Data keys(count * hash::Size);
+    blake2b_batch(kt_con.data(), kt_con_size, count, keys.data());
+    monocypher::wipe(kt_con.data(), kt_con.size());
+
+    // Keyw || 1 and Keyw || 0, side by side: Addrw and the mask of a keyword are hashed together
+    Data keys_suffixed(2 * count * key_suffix_size);
+    for (size_t i = 0; i < 2 * count; ++i) {
+        auto it = keys_suffixed.begin() + i * key_suffix_size;
+        std::copy_n(keys.begin() + i / 2 * hash::Size, hash::Size, it);
+        *(it + hash::Size) = i % 2 == 0 ? one<1>[0] : zero<1>[0];
+    }
+    monocypher::wipe(keys.data(), keys.size());
+
+    Data addrs_masks(2 * count * hash::Size);
+    blake2b_batch(keys_suffixed.data(), key_suffix_size, 2 * count, addrs_masks.data());
+    monocypher::wipe(keys_suffixed.data(), keys_suffixed.size());
+
+    // Encrypt the index
+    n = 0;
+    for (auto& [keyword, docs] : index) {
+        // Addrw = H(Keyw || 1)
+        key addr(addrs_masks.data() + 2 * n * hash::Size, hash::Size);
+        // H(Keyw || 0)
+        key mask(addrs_masks.data() + (2 * n + 1) * hash::Size, hash::Size);
+        ++n;
 
         // Iterate the chain
         for (auto it = docs.begin(); it != docs.end(); ++it) {
@@ -292,14 +719,16 @@ Protocol<lambda>::Data Protocol<lambda>::process(Operation op, const KTMap& inde
             sk.wipe();
             auto eid = mac | nonce | data;
 
-            auto val = (hash::create(key | zero<1>) ^ eid) | keystore.con | rn;
+            auto val = (mask ^ eid) | keystore.con | rn;
 
             encrypted_index[addr] = val;
 
             // Next address for the chain.
             addr = addr ^ rn;
         }
+        mask.wipe();
     }
+    monocypher::wipe(addrs_masks.data(), addrs_masks.size());
 
 
     Data result; result.reserve(encrypted_index.size() * (hash::Size + value::byte_count));
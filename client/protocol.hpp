@@ -12,9 +12,13 @@
 #include <uuid/uuid.h>
 #include <filesystem>
 #include <stdexcept>
+#include <optional>
 
 
 #include "keystore.hpp"
+#include "frame.hpp"
+#include "trace.hpp"
+#include <unistd.h>
 
 
 template<size_t lambda = 32>
@@ -28,12 +32,42 @@ private:
     using DocMap = std::unordered_map<DocId, std::string>;
     // A generic sequnce of bytes.
     using Data = std::vector<uint8_t>;
+    // Documents encryption (AE).
+    using DocKey = monocypher::session::encryption_key<monocypher::XChaCha20_Poly1305>;
+
+    // Fetched documents are received and decrypted in chunks of this size (multiple of the ChaCha20 block).
+    static constexpr size_t FETCH_CHUNK = 64 << 10;
 
     // The state of the protocol. Contains the keys and con (theta in the paper).
     Keystore<lambda> keystore;
 
     // The socket handler.
     sockpp::unix_connector sock;
+    sockpp::unix_address server_addr;
+
+    /// Connects to the server (the server serves one request per connection, or any
+    /// number in a session).
+    void connect();
+
+    // In a session the requests are sent in frames (see frame.hpp).
+    bool in_session;
+    uint64_t last_request = 0;
+    // Requests whose empty response is not read yet (updates and search finalizations).
+    std::unordered_set<uint64_t> unacknowledged;
+
+    // The requests are traced as the user running the client, like the server sees it (see trace.hpp).
+    const std::string user_id = "user_" + std::to_string(::getuid());
+    TraceContext new_trace(uint64_t request_id) const {
+        return {Tracer::instance().new_track(), request_id, user_id};
+    }
+
+    // Starts a request of size bytes (after the opcode): its frame header in a session,
+    // else its opcode.
+    void begin_request(Opcode opcode, uint64_t size, uint64_t request_id);
+    // Reads the responses until the one of request_id, which must be successful.
+    Frame wait_response(uint64_t request_id);
+    // Checks the empty response of an unacknowledged request.
+    void acknowledge(const Frame& frame);
 
     /// Loads the keys or generates new one if there is no key-file.
     void load_or_setup_keys();
@@ -44,6 +78,31 @@ private:
     Data process(Operation op, const KTMap& index) const;
     // Encrypts (AE) the documents one by one and serializes them.
     Data encrypt_documents(DocMap& args);
+    // A keyword searched and its results.
+    struct KeywordSearch {
+        Keyword keyword;
+        std::unordered_set<DocId> id1;       // The previous results, then the insertions decrypted
+        std::unordered_set<DocId> removals;  // Decrypted, applied after the insertions
+        std::vector<std::pair<monocypher::byte_array<64>, monocypher::byte_array<8>>> id2;  // Eid, con
+    };
+    // The keywords of a search, a repeated one only once.
+    static std::vector<KeywordSearch> search_keywords(const ArgsSearch& args);
+    // Sends step 1 of a search of the keywords (the keys are unlocked once). Returns con.
+    monocypher::byte_array<8> send_query(Opcode opcode, const std::vector<KeywordSearch>& keywords, uint64_t request);
+    // Reads the encrypted entries (ID2) of a keyword, size bytes.
+    void receive_entries(KeywordSearch& keyword, size_t size);
+    // Decrypts the entries of a keyword into id1 and removals. The keys must be loaded.
+    void decrypt_entries(KeywordSearch& keyword);
+    // Reads the results of a conjunctive search: count + UUIDs (size bytes, if known).
+    std::unordered_set<DocId> receive_results(std::optional<uint64_t> size);
+    // Searches the documents with all the keywords, intersected by the server.
+    void search_all(const ArgsSearch& args);
+
+    // Fetches the documents and decrypts them into output_dir, one file per document.
+    void fetch(const std::unordered_set<DocId>& ids, const Path& output_dir, const DocKey& key);
+    // Receives the ciphertext of a document and decrypts it into path. Returns false if it's not authentic.
+    bool receive_document(const Path& path, const monocypher::byte_array<DocId::byte_count + 8>& ad,
+                          const DocKey& key, uint64_t size);
 
     // Writes to the socket.
     void send(const Data& data);
@@ -57,6 +116,11 @@ private:
 
 
     // Reads from the socket.
+    void recv(uint8_t* data, size_t size) {
+        if (auto res = sock.read_n(data, size); !res || static_cast<size_t>(res) != size) {
+            throw std::runtime_error("Unable to read");
+        }
+    }
     template<typename T>
     T recv() {
         T result;
@@ -78,8 +142,16 @@ private:
 
 public:
     
-    Protocol(const sockpp::unix_address& server_addr);
-    Protocol(std::string&& server_addr) : Protocol(sockpp::unix_address{server_addr}) {}
+    Protocol(const sockpp::unix_address& server_addr, bool session = false);
+    Protocol(std::string&& server_addr, bool session = false)
+        : Protocol(sockpp::unix_address{server_addr}, session) {}
+
+    /// Keeps the keys in memory between the requests (see Keystore::hold).
+    void hold_keys() { keystore.hold(); }
+    void release_keys() { keystore.release(); }
+
+    /// Waits for the responses not read yet, in a session.
+    void finish();
 
     /// Add method for updates.
     void add(const ArgsAdd& args);
@@ -87,7 +159,8 @@ public:
     /// Remove method for updates.
     void remove(const ArgsRemove& args);
 
-    /// Performs a search.
+    /// Searches the keywords with a single request (or the documents with all of them), then fetches the
+    /// documents found if an output directory is given.
     void search(const ArgsSearch& args);
 
 };
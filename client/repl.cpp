@@ -0,0 +1,61 @@
+#include "repl.hpp"
+#include "argparse.hpp"
+#include "utils.hpp"
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+
+int repl(Protocol<32>& dsse, const char* program_name) {
+    const bool interactive = isatty(STDIN_FILENO);
+    int status = EXIT_SUCCESS;
+
+    dsse.hold_keys();
+
+    std::string line;
+    while (true) {
+        if (interactive) std::cout << "dsse> " << std::flush;
+        if (!std::getline(std::cin, line)) break;
+
+        // Words, or "quoted strings" for paths with spaces.
+        std::vector<std::string> words;
+        std::istringstream stream(line);
+        for (std::string word; stream >> std::quoted(word); ) words.push_back(std::move(word));
+
+        if (words.empty() || words[0].starts_with("#")) continue;
+        if (words[0] == "quit" || words[0] == "exit") break;
+
+        std::vector<const char*> argv{program_name};
+        for (auto& word : words) argv.push_back(word.c_str());
+
+        try {
+            Args args = parse_action(argv.size(), argv.data());
+
+            std::visit(overload{
+                [&](const ArgsAdd& args) { dsse.add(args); },
+                [&](const ArgsRemove& args) { dsse.remove(args); },
+                [&](const ArgsSearch& args) { dsse.search(args); },
+                [&](const ArgsRepl&) { throw std::invalid_argument("Already reading the commands"); },
+            }, args);
+        } catch (const std::exception& e) {
+            // NOTE: after a failed read or write the session is lost, the next commands fail too.
+            std::cerr << "[ERROR]" << e.what() << "." << std::endl;
+            status = EXIT_FAILURE;
+            if (!interactive) break;
+        }
+    }
+
+    try {
+        dsse.finish();
+    } catch (const std::exception& e) {
+        std::cerr << "[ERROR]" << e.what() << "." << std::endl;
+        status = EXIT_FAILURE;
+    }
+    dsse.release_keys();
+
+    return status;
+}
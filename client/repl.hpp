@@ -0,0 +1,10 @@
+#pragma once
+
+#include "protocol.hpp"
+
+/// Runs the commands read from the standard input, one per line with the syntax of the
+/// command line (e.g. "search keyword -o out"), on the session of dsse.
+/// The keys are held for the whole run: the password is asked once.
+/// Interactive on a terminal, else a batch stopping at the first failed command.
+/// @return the exit status.
+int repl(Protocol<32>& dsse, const char* program_name);
@@ -92,9 +92,18 @@ monocypher::byte_array<size>& operator--(monocypher::byte_array<size>& array) {
 } 
 
 template<size_t size>
-void hexprint(const monocypher::byte_array<size>& array) {
+std::string hexstring(const monocypher::byte_array<size>& array) {
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string result;
+    result.reserve(2 * size);
     for (size_t i = size; i > 0; --i) {
-        std::clog << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(array[i - 1]);
+        result += digits[array[i - 1] >> 4];
+        result += digits[array[i - 1] & 0xf];
     }
-    std::clog << std::endl;
+    return result;
+}
+
+template<size_t size>
+void hexprint(const monocypher::byte_array<size>& array) {
+    std::clog << hexstring(array) << std::endl;
 }
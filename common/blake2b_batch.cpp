@@ -0,0 +1,186 @@
+#include "blake2b_batch.hpp"
+#include <cstring>
+#include <Monocypher.hh>
+
+namespace {
+
+using hash = monocypher::hash<monocypher::Blake2b<BLAKE2B_BATCH_DIGEST_SIZE>>;
+
+constexpr uint64_t IV[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+constexpr uint8_t SIGMA[12][16] = {
+    { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+    {14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3},
+    {11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4},
+    { 7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8},
+    { 9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13},
+    { 2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9},
+    {12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11},
+    {13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10},
+    { 6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5},
+    {10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0},
+    { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+    {14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3},
+};
+
+// Lane i of a register holds a word of message i.
+// NOTE: GCC vector extensions, the instructions used depend on the target of the
+// kernel the code is inlined into.
+using u64x4 = uint64_t __attribute__((vector_size(32)));
+using u64x8 = uint64_t __attribute__((vector_size(64)));
+
+// NOTE: the registers are passed by reference, inlined they never leave the kernel.
+template<int n, typename V>
+[[gnu::always_inline]] inline void xor_rotr(V& x, const V& y) {
+    x ^= y;
+    x = (x >> n) | (x << (64 - n));
+}
+
+template<typename V>
+[[gnu::always_inline]] inline void mix(V v[16], int a, int b, int c, int d, const V& x, const V& y) {
+    v[a] += v[b] + x;
+    xor_rotr<32>(v[d], v[a]);
+    v[c] += v[d];
+    xor_rotr<24>(v[b], v[c]);
+    v[a] += v[b] + y;
+    xor_rotr<16>(v[d], v[a]);
+    v[c] += v[d];
+    xor_rotr<63>(v[b], v[c]);
+}
+
+// Hashes one message per lane, `batches` batches of lanes messages. Every message
+// fits in a single block, so the hash is a single compression of the zero-padded
+// message, flagged as last.
+template<typename V>
+[[gnu::always_inline]] inline void hash_lanes(const uint8_t* messages, size_t size, size_t batches, uint8_t* digests) {
+    constexpr size_t lanes = sizeof(V) / sizeof(uint64_t);
+
+    // Parameter block: 64-byte digest, no key, fanout and depth of 1
+    uint64_t h[8];
+    std::memcpy(h, IV, sizeof(h));
+    h[0] ^= 0x01010000 ^ BLAKE2B_BATCH_DIGEST_SIZE;
+
+    V m[16];
+    V v[16];
+    uint64_t block[16];
+    for (size_t batch = 0; batch < batches; ++batch) {
+        for (size_t l = 0; l < lanes; ++l) {
+            std::memset(block, 0, sizeof(block));
+            std::memcpy(block, messages + l * size, size);
+            for (size_t w = 0; w < 16; ++w) m[w][l] = block[w];
+        }
+
+        for (size_t i = 0; i < 8; ++i) {
+            v[i] = V{} + h[i];
+            v[i + 8] = V{} + IV[i];
+        }
+        v[12] ^= size;  // Byte counter
+        v[14] = ~v[14]; // Last block
+
+#pragma GCC unroll 12
+        for (const auto& s : SIGMA) {
+            mix(v, 0, 4,  8, 12, m[s[0]],  m[s[1]]);
+            mix(v, 1, 5,  9, 13, m[s[2]],  m[s[3]]);
+            mix(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]);
+            mix(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]);
+            mix(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]);
+            mix(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+            mix(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+            mix(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+        }
+
+        // NOTE: the kernels only run on x86, which is little endian like Blake2b.
+        for (size_t i = 0; i < 8; ++i) {
+            V out = v[i] ^ v[i + 8] ^ h[i];
+            for (size_t l = 0; l < lanes; ++l) {
+                uint64_t word = out[l];
+                std::memcpy(digests + l * BLAKE2B_BATCH_DIGEST_SIZE + i * sizeof(word), &word, sizeof(word));
+            }
+        }
+        messages += lanes * size;
+        digests += lanes * BLAKE2B_BATCH_DIGEST_SIZE;
+    }
+
+    // The messages and digests are keys and masks, as everywhere in the client:
+    // wiped once per call, not per batch.
+    monocypher::wipe(block, sizeof(block));
+    monocypher::wipe(m, sizeof(m));
+    monocypher::wipe(v, sizeof(v));
+}
+
+// Hashes `batches` batches of `lanes` messages of at most a block
+using Kernel = void (*)(const uint8_t* messages, size_t size, size_t batches, uint8_t* digests);
+
+struct Dispatch {
+    Kernel kernel;
+    size_t lanes;
+    const char* name;
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+[[gnu::target("avx512f"), gnu::flatten]]
+void hash_avx512(const uint8_t* messages, size_t size, size_t batches, uint8_t* digests) {
+    hash_lanes<u64x8>(messages, size, batches, digests);
+}
+
+[[gnu::target("avx2"), gnu::flatten]]
+void hash_avx2(const uint8_t* messages, size_t size, size_t batches, uint8_t* digests) {
+    hash_lanes<u64x4>(messages, size, batches, digests);
+}
+#endif
+
+Dispatch select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return {hash_avx512, 8, "avx512"};
+    if (__builtin_cpu_supports("avx2")) return {hash_avx2, 4, "avx2"};
+#endif
+    return {nullptr, 1, "scalar"};
+}
+
+const Dispatch& dispatch() {
+    static const Dispatch selected = select_kernel();
+    return selected;
+}
+
+void hash_scalar(const uint8_t* messages, size_t size, size_t count, uint8_t* digests) {
+    for (size_t i = 0; i < count; ++i) {
+        auto digest = hash::create(messages + i * size, size);
+        std::memcpy(digests + i * BLAKE2B_BATCH_DIGEST_SIZE, digest.data(), digest.size());
+        digest.wipe();
+    }
+}
+
+}  // namespace
+
+void blake2b_batch(const uint8_t* messages, size_t size, size_t count, uint8_t* digests) {
+    const Dispatch& d = dispatch();
+    if (!d.kernel || size > BLAKE2B_BATCH_BLOCK_SIZE) {
+        hash_scalar(messages, size, count, digests);
+        return;
+    }
+
+    size_t i = count / d.lanes * d.lanes;
+    if (i > 0) d.kernel(messages, size, count / d.lanes, digests);
+
+    // A single message is cheaper on the scalar path, more fill a padded batch.
+    size_t remaining = count - i;
+    if (remaining == 1) {
+        hash_scalar(messages + i * size, size, 1, digests + i * BLAKE2B_BATCH_DIGEST_SIZE);
+    } else if (remaining > 1) {
+        uint8_t padded_messages[BLAKE2B_BATCH_MAX_LANES * BLAKE2B_BATCH_BLOCK_SIZE] = {};
+        uint8_t padded_digests[BLAKE2B_BATCH_MAX_LANES * BLAKE2B_BATCH_DIGEST_SIZE];
+        std::memcpy(padded_messages, messages + i * size, remaining * size);
+        d.kernel(padded_messages, size, 1, padded_digests);
+        std::memcpy(digests + i * BLAKE2B_BATCH_DIGEST_SIZE, padded_digests, remaining * BLAKE2B_BATCH_DIGEST_SIZE);
+        monocypher::wipe(padded_messages, sizeof(padded_messages));
+        monocypher::wipe(padded_digests, sizeof(padded_digests));
+    }
+}
+
+const char* blake2b_batch_kernel() {
+    return dispatch().name;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Batched Blake2b-512 of short independent messages.
+// The messages of a batch are hashed side by side in the lanes of SIMD registers
+// (8 with AVX-512, 4 with AVX2), the kernel is chosen at runtime from the CPU
+// features. The output is identical to monocypher's Blake2b, which is used when
+// no kernel is available and for messages longer than a block.
+
+constexpr size_t BLAKE2B_BATCH_DIGEST_SIZE = 64;
+// Messages up to a block are hashed by the SIMD kernels
+constexpr size_t BLAKE2B_BATCH_BLOCK_SIZE = 128;
+// Messages hashed side by side by the widest kernel
+constexpr size_t BLAKE2B_BATCH_MAX_LANES = 8;
+
+// Hashes `count` messages of `size` bytes each, stored back to back in `messages`.
+// The digests are stored back to back in `digests` (count * 64 bytes).
+void blake2b_batch(const uint8_t* messages, size_t size, size_t count, uint8_t* digests);
+
+// Name of the kernel in use: "avx512", "avx2" or "scalar"
+const char* blake2b_batch_kernel();
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+
+// Operation codes, the first 4 bytes sent on a connection. A connection opened with
+// OP_SESSION carries any number of requests in frames, the others serve one request.
+enum Opcode : uint32_t {
+    OP_UPDATE = 0,
+    OP_REMOVE = 1,
+    OP_SEARCH = 2,
+    OP_FETCH = 3,
+    OP_SESSION = 4,
+    OP_SEARCH_FINALIZE = 5,  // Step 2 of a search, in a session only
+    OP_SEARCH_BATCH = 6,     // Search of many keywords at once
+    OP_SEARCH_AND = 7,       // Documents matching all the keywords, intersected by the server
+};
+
+// Status of a response frame
+enum Status : uint32_t {
+    STATUS_OK = 0,
+    STATUS_FAILED = 1,
+    STATUS_BUSY = 2,  // Refused by the admission control, may be retried later
+};
+
+// Sent without a session instead of the first size of a search or fetch response
+// when the request is refused by the admission control (then the connection is closed).
+constexpr uint64_t BUSY_SIZE = UINT64_MAX;
+
+// Header of the frames of a session, followed by size bytes: the message of the
+// single-request protocol, without the opcode.
+// Requests may be pipelined: their responses come back as soon as they are ready, in
+// any order, with the ID of their request. Step 2 of a search reuses the ID of step 1.
+// Updates and search finalizations are answered with an empty response, the
+// finalizations of conjunctive searches with their results.
+// NOTE: little endian, like the rest of the protocol.
+struct Frame {
+    uint64_t request_id;
+    uint64_t size;
+    uint32_t code;  // Opcode of a request, status of a response
+    uint32_t reserved = 0;
+};
+static_assert(sizeof(Frame) == 24);
@@ -0,0 +1,132 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <unordered_set>
+#include <unistd.h>
+
+static thread_local TraceContext current_context;
+
+const TraceContext& TraceContext::current() {
+    return current_context;
+}
+
+TraceScope::TraceScope(const TraceContext& context) : previous(current_context) {
+    current_context = context;
+}
+
+TraceScope::~TraceScope() {
+    current_context = previous;
+}
+
+Tracer& Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+void Tracer::configure(size_t spans) {
+    capacity = spans;
+}
+
+Tracer::Ring& Tracer::local() {
+    static thread_local std::shared_ptr<Ring> ring;
+    if (!ring) {
+        ring = std::make_shared<Ring>();
+        ring->spans.resize(capacity.load(std::memory_order_relaxed));
+        std::lock_guard lock(mutex);
+        ring->thread = rings.size();
+        rings.push_back(ring);
+    }
+    return *ring;
+}
+
+void Tracer::record(const char* name, const TraceContext& context, uint64_t start, uint64_t end) {
+    Ring& ring = local();
+    if (ring.spans.empty()) return;
+
+    std::lock_guard lock(ring.mutex);
+    Span& span = ring.spans[ring.recorded++ % ring.spans.size()];
+    span.name = name;
+    span.track = context.track;
+    span.request_id = context.request_id;
+    span.start = start;
+    span.end = end;
+    span.thread = ring.thread;
+    size_t user_size = std::min(context.user.size(), USER_SIZE - 1);
+    std::memcpy(span.user, context.user.data(), user_size);
+    span.user[user_size] = '\0';
+}
+
+// Microseconds, as the Chrome trace format wants them
+static void append_us(std::string& out, uint64_t ns) {
+    char digits[24];
+    out.append(digits, std::to_chars(digits, digits + sizeof(digits), ns / 1000).ptr - digits);
+    char fraction[5] = {'.', char('0' + ns % 1000 / 100), char('0' + ns % 100 / 10), char('0' + ns % 10), '\0'};
+    out.append(fraction);
+}
+
+static void append_uint(std::string& out, uint64_t value) {
+    char digits[24];
+    out.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+}
+
+// A JSON string, the control characters left out
+static void append_string(std::string& out, std::string_view value) {
+    out += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') out += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20) out += c;
+    }
+    out += '"';
+}
+
+std::string Tracer::dump() {
+    std::vector<Span> spans;
+    {
+        std::lock_guard lock(mutex);
+        for (const auto& ring : rings) {
+            std::lock_guard ring_lock(ring->mutex);
+            size_t kept = std::min(ring->recorded, ring->spans.size());
+            spans.insert(spans.end(), ring->spans.begin(), ring->spans.begin() + kept);
+        }
+    }
+    std::sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) { return a.start < b.start; });
+
+    std::string pid = std::to_string(::getpid());
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    std::unordered_set<uint64_t> named;  // Tracks named so far
+    for (const Span& span : spans) {
+        if (out.back() != '[') out += ',';
+        // A track is named after its request on its first span.
+        if (named.insert(span.track).second) {
+            out += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" + pid + ",\"tid\":";
+            append_uint(out, span.track);
+            out += ",\"args\":{\"name\":";
+            std::string name = span.user;
+            if (span.request_id != 0) name += " #" + std::to_string(span.request_id);
+            append_string(out, name.empty() ? "request" : name);
+            out += "}},";
+        }
+        out += "{\"ph\":\"X\",\"name\":";
+        append_string(out, span.name);
+        out += ",\"pid\":" + pid + ",\"tid\":";
+        append_uint(out, span.track);
+        out += ",\"ts\":";
+        append_us(out, span.start);
+        out += ",\"dur\":";
+        append_us(out, span.end - span.start);
+        out += ",\"args\":{\"thread\":";
+        append_uint(out, span.thread);
+        if (span.request_id != 0) {
+            out += ",\"request_id\":";
+            append_uint(out, span.request_id);
+        }
+        if (span.user[0] != '\0') {
+            out += ",\"user\":";
+            append_string(out, span.user);
+        }
+        out += "}}";
+    }
+    out += "]}\n";
+    return out;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The spans of a request share its track: a row of the trace, named after the
+// request. user must outlive the context.
+struct TraceContext {
+    uint64_t track = 0;       // 0: not traced
+    uint64_t request_id = 0;  // In a session
+    std::string_view user;
+
+    // Context of the spans opened without one on this thread (see TraceScope)
+    static const TraceContext& current();
+};
+
+// Makes a context current on this thread until the end of the scope.
+// NOTE: not across a co_await, the coroutine may resume on another thread.
+class TraceScope {
+public:
+    explicit TraceScope(const TraceContext& context);
+    ~TraceScope();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    TraceContext previous;
+};
+
+// Tracing of the requests: spans (name, start, end) of their steps, kept in a ring
+// of each recording thread, the oldest overwritten. A span costs two clock reads and
+// a lock of the ring of its thread, only taken by dump() otherwise; with tracing
+// disabled, a relaxed load. dump() writes them in the Chrome trace format (JSON),
+// opened by Perfetto and chrome://tracing.
+class Tracer {
+public:
+    static Tracer& instance();
+
+    // spans: kept by each thread, 0 disables tracing. Set before recording.
+    void configure(size_t spans);
+
+    static bool enabled() { return capacity.load(std::memory_order_relaxed) > 0; }
+
+    // A new track, 0 if tracing is disabled
+    uint64_t new_track() { return enabled() ? next_track.fetch_add(1, std::memory_order_relaxed) : 0; }
+
+    // Nanoseconds since the tracer was created
+    uint64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    // name: a string literal
+    void record(const char* name, const TraceContext& context, uint64_t start, uint64_t end);
+
+    // The spans recorded, ordered by start
+    std::string dump();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+private:
+    static constexpr size_t USER_SIZE = 32;
+
+    struct Span {
+        const char* name;
+        uint64_t track;
+        uint64_t request_id;
+        uint64_t start;
+        uint64_t end;
+        uint32_t thread;
+        char user[USER_SIZE];  // Truncated, NUL-terminated
+    };
+
+    struct Ring {
+        std::mutex mutex;
+        std::vector<Span> spans;
+        size_t recorded = 0;  // The next span goes to recorded % spans.size()
+        uint32_t thread;
+    };
+
+    Tracer() = default;
+
+    // Ring of this thread, registered on its first span
+    Ring& local();
+
+    static inline std::atomic<size_t> capacity = 0;
+
+    const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> next_track = 1;
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Ring>> rings;  // Of every thread which recorded, kept after it exits
+};
+
+// Span of a scope, or up to end(). Without a context, in the one current on the
+// thread where it is created.
+class TraceSpan {
+public:
+    TraceSpan(const char* name, const TraceContext& context)
+        : name(name), context(context), start(active() ? Tracer::instance().now() : 0) {}
+    explicit TraceSpan(const char* name) : TraceSpan(name, TraceContext::current()) {}
+    ~TraceSpan() { end(); }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    void end() {
+        if (!active()) return;
+        Tracer& tracer = Tracer::instance();
+        tracer.record(name, context, start, tracer.now());
+        name = nullptr;
+    }
+
+private:
+    const char* name;  // nullptr once recorded
+    TraceContext context;
+    uint64_t start;
+
+    bool active() const { return name && context.track != 0 && Tracer::enabled(); }
+};
@@ -0,0 +1,73 @@
+#include "admission.hpp"
+#include <utility>
+
+// Whether adding a request of bytes to usage stays within the limits (0: none)
+static bool within(size_t requests, uint64_t bytes, size_t max_requests, uint64_t max_bytes, uint64_t request_bytes) {
+    return (max_requests == 0 || requests < max_requests) &&
+           (max_bytes == 0 || (bytes <= max_bytes && request_bytes <= max_bytes - bytes));
+}
+
+Admission::Admission(const Limits& limits) : limits(limits) {}
+
+std::optional<Admission::Ticket> Admission::admit(const std::string& user_id, uint64_t bytes) {
+    std::lock_guard lock(mutex);
+    if (!within(total.requests, total.bytes, limits.requests, limits.bytes, bytes)) return std::nullopt;
+
+    auto it = users.find(user_id);
+    Usage user = it != users.end() ? it->second : Usage{};
+    if (!within(user.requests, user.bytes, limits.user_requests, limits.user_bytes, bytes)) return std::nullopt;
+
+    charge(user_id, bytes);
+    return Ticket(this, user_id, bytes);
+}
+
+Admission::Ticket Admission::force(const std::string& user_id, uint64_t bytes) {
+    std::lock_guard lock(mutex);
+    charge(user_id, bytes);
+    return Ticket(this, user_id, bytes);
+}
+
+Admission::Usage Admission::usage() {
+    std::lock_guard lock(mutex);
+    return total;
+}
+
+void Admission::charge(const std::string& user_id, uint64_t bytes) {
+    ++total.requests;
+    total.bytes += bytes;
+    Usage& user = users[user_id];
+    ++user.requests;
+    user.bytes += bytes;
+}
+
+void Admission::release(const std::string& user_id, uint64_t bytes) {
+    std::lock_guard lock(mutex);
+    --total.requests;
+    total.bytes -= bytes;
+    auto it = users.find(user_id);
+    if (--it->second.requests == 0) {
+        users.erase(it);
+    } else {
+        it->second.bytes -= bytes;
+    }
+}
+
+Admission::Ticket::Ticket(Admission* admission, std::string user_id, uint64_t bytes)
+    : admission(admission), user_id(std::move(user_id)), bytes(bytes) {}
+
+Admission::Ticket::Ticket(Ticket&& other) noexcept
+    : admission(std::exchange(other.admission, nullptr)), user_id(std::move(other.user_id)), bytes(other.bytes) {}
+
+Admission::Ticket& Admission::Ticket::operator=(Ticket&& other) noexcept {
+    if (this != &other) {
+        if (admission) admission->release(user_id, bytes);
+        admission = std::exchange(other.admission, nullptr);
+        user_id = std::move(other.user_id);
+        bytes = other.bytes;
+    }
+    return *this;
+}
+
+Admission::Ticket::~Ticket() {
+    if (admission) admission->release(user_id, bytes);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+// Admission control: limits on the requests in progress and on the memory they
+// hold (bytes), over all the users and for each one. A request over a limit is
+// refused at once, and the client is told the server is busy: under overload the
+// server sheds the requests instead of queueing them without bound, and a user
+// flooding it can't take the capacity of the others.
+class Admission {
+public:
+    // 0: no limit
+    struct Limits {
+        size_t requests;
+        uint64_t bytes;
+        size_t user_requests;
+        uint64_t user_bytes;
+    };
+
+    // An admitted request, counted until it is destroyed
+    class Ticket {
+    public:
+        Ticket(Ticket&& other) noexcept;
+        Ticket& operator=(Ticket&& other) noexcept;
+        ~Ticket();
+
+    private:
+        friend class Admission;
+        Ticket(Admission* admission, std::string user_id, uint64_t bytes);
+
+        Admission* admission;  // nullptr once moved from
+        std::string user_id;
+        uint64_t bytes;
+    };
+
+    struct Usage {
+        size_t requests = 0;
+        uint64_t bytes = 0;
+    };
+
+    explicit Admission(const Limits& limits);
+
+    Admission(const Admission&) = delete;
+    Admission& operator=(const Admission&) = delete;
+
+    // Admits a request of the user holding bytes, unless it exceeds a limit.
+    std::optional<Ticket> admit(const std::string& user_id, uint64_t bytes);
+
+    // Admits a request whatever the limits (it can't be retried), counting it
+    // against the next ones.
+    Ticket force(const std::string& user_id, uint64_t bytes);
+
+    // Requests in progress over all the users
+    Usage usage();
+
+private:
+    const Limits limits;
+
+    std::mutex mutex;
+    Usage total;
+    std::unordered_map<std::string, Usage> users;  // Only the users with requests in progress
+
+    void charge(const std::string& user_id, uint64_t bytes);
+    void release(const std::string& user_id, uint64_t bytes);
+};
@@ -0,0 +1,213 @@
+#include "compute_pool.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <cstring>
+#include <filesystem>
+#include <pthread.h>
+#include <sched.h>
+
+// Coroutines waiting for a shard (the event loop waits when it is full, the pool
+// threads overflow it)
+static constexpr size_t SHARD_QUEUE_SIZE = 1 << 12;
+
+thread_local const ComputePool::Shard* ComputePool::current = nullptr;
+
+// Parses a cpulist ("0-3,8,10-11")
+static std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    size_t position = 0;
+    while (position < list.size()) {
+        size_t end = list.find(',', position);
+        if (end == std::string::npos) end = list.size();
+        std::string range = list.substr(position, end - position);
+        size_t dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        } catch (const std::exception&) {
+            break;
+        }
+        position = end + 1;
+    }
+    return cpus;
+}
+
+std::vector<std::vector<int>> ComputePool::placement(size_t shards_count, Pinning pinning) {
+    // The CPUs the process may run on
+    std::vector<int> allowed;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) allowed.push_back(cpu);
+        }
+    }
+
+    std::vector<std::vector<int>> groups;
+    if (pinning == Pinning::core) {
+        for (int cpu : allowed) groups.push_back({cpu});
+    } else if (pinning == Pinning::node) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        std::vector<fs::path> nodes;
+        for (const auto& entry : fs::directory_iterator("/sys/devices/system/node", ec)) {
+            std::string name = entry.path().filename().string();
+            if (name.starts_with("node") && name.find_first_not_of("0123456789", 4) == std::string::npos) {
+                nodes.push_back(entry.path());
+            }
+        }
+        std::sort(nodes.begin(), nodes.end());
+        for (const fs::path& node : nodes) {
+            std::ifstream file(node / "cpulist");
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus;
+            for (int cpu : parse_cpu_list(list)) {
+                if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) cpus.push_back(cpu);
+            }
+            if (!cpus.empty()) groups.push_back(std::move(cpus));
+        }
+        if (groups.empty() && !allowed.empty()) groups.push_back(allowed);  // No NUMA topology
+    }
+
+    std::vector<std::vector<int>> result(shards_count);
+    if (!groups.empty()) {
+        for (size_t i = 0; i < shards_count; ++i) result[i] = groups[i % groups.size()];
+    }
+    return result;
+}
+
+ComputePool::ComputePool(size_t shards_count, Pinning pinning, size_t sync_threads, bool count_keys)
+    : count_keys(count_keys) {
+    cpu_set_t set;
+    size_t cores = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set)
+                                                                : std::max(1u, std::thread::hardware_concurrency());
+    if (shards_count == 0) shards_count = cores;
+    if (sync_threads == 0) sync_threads = cores;
+
+    std::vector<std::vector<int>> cpus = placement(shards_count, pinning);
+    shards.reserve(shards_count);
+    for (size_t i = 0; i < shards_count; ++i) {
+        shards.push_back(std::make_unique<Shard>(SHARD_QUEUE_SIZE));
+        shards.back()->threads.emplace_back(run, std::ref(*shards.back()), cpus[i]);
+    }
+
+    sync = std::make_unique<Shard>(SHARD_QUEUE_SIZE);
+    for (size_t i = 0; i < sync_threads; ++i) sync->threads.emplace_back(run, std::ref(*sync), std::vector<int>());
+}
+
+ComputePool::~ComputePool() {
+    stop();
+}
+
+void ComputePool::stop() {
+    if (!sync) return;
+
+    // A thread stops at the first null handle, queued as bulk work.
+    // NOTE: a coroutine moving between a shard and the sync threads meanwhile may be
+    // queued after it, and a latency one may be overtaken by it (see URGENT_BURST):
+    // it is never resumed, but no thread is destroyed before all stopped.
+    for (auto& shard : shards) shard->queue.push(nullptr, false);
+    for (size_t i = 0; i < sync->threads.size(); ++i) sync->queue.push(nullptr, false);
+    for (auto& shard : shards) shard->threads.front().join();
+    for (std::thread& thread : sync->threads) thread.join();
+    shards.clear();
+    sync.reset();
+}
+
+size_t ComputePool::shard_of(std::string_view key) const {
+    return std::hash<std::string_view>{}(key) % shards.size();
+}
+
+ComputePool::Load ComputePool::load(size_t index) {
+    Shard& shard = *shards[index];
+    Load load{shard.tasks, shard.busy_ns, shard.queued, {}, 0};
+
+    // The shard thread restarts counting at its next task.
+    uint64_t epoch = shard.epoch.fetch_add(1);
+    std::lock_guard lock(shard.hot_mutex);
+    if (shard.hot_epoch == epoch) {
+        load.hot_key = shard.hot_key;
+        load.hot_key_tasks = shard.hot_key_tasks;
+    }
+    return load;
+}
+
+// NOTE: the shard and sync threads push into each other's queues: waiting for a full
+// one, they could wait for each other forever. Only the event loop is held back.
+static void push(BlockingPriorityQueue<std::coroutine_handle<>>& queue, std::coroutine_handle<> awaiter, bool urgent,
+                 bool from_pool) {
+    if (from_pool) {
+        queue.push_overflow(awaiter, urgent);
+    } else {
+        queue.push(awaiter, urgent);
+    }
+}
+
+void ComputePool::Schedule::await_suspend(std::coroutine_handle<> awaiter) {
+    Shard& target = *pool.shards[shard];
+    ++target.queued;
+    push(target.queue, awaiter, priority == Priority::latency, current != nullptr);
+}
+
+void ComputePool::ScheduleSync::await_suspend(std::coroutine_handle<> awaiter) {
+    ++pool.sync->queued;
+    push(pool.sync->queue, awaiter, priority == Priority::latency, current != nullptr);
+}
+
+static Detached run_posted(ComputePool& pool, std::function<void()> f, ComputePool::Priority priority) {
+    co_await ComputePool::ScheduleSync{pool, priority, true};
+    f();
+}
+
+void ComputePool::post_sync(std::function<void()> f, Priority priority) {
+    run_posted(*this, std::move(f), priority);
+}
+
+void ComputePool::Schedule::await_resume() {
+    if (!pool.count_keys) return;
+
+    // Runs on the shard thread, the only one writing the counters.
+    Shard& target = *pool.shards[shard];
+    uint64_t epoch = target.epoch.load(std::memory_order_relaxed);
+    if (epoch != target.counted_epoch) {
+        target.key_tasks.fill(0);
+        target.hot_slot_tasks = 0;
+        target.counted_epoch = epoch;
+    }
+
+    uint64_t tasks = ++target.key_tasks[std::hash<std::string_view>{}(key) / pool.shards.size() % KEY_SLOTS];
+    if (tasks <= target.hot_slot_tasks) return;
+    target.hot_slot_tasks = tasks;
+    if (target.hot_epoch == epoch && target.hot_key == key) {
+        target.hot_key_tasks.store(tasks, std::memory_order_relaxed);
+        return;
+    }
+    std::lock_guard lock(target.hot_mutex);
+    target.hot_key.assign(key);
+    target.hot_epoch = epoch;
+    target.hot_key_tasks.store(tasks, std::memory_order_relaxed);
+}
+
+void ComputePool::run(Shard& shard, const std::vector<int>& cpus) {
+    if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) CPU_SET(cpu, &set);
+        if (int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); error != 0) {
+            log_error("Failed to pin a compute shard", "error", std::strerror(error));
+        }
+    }
+
+    current = &shard;
+    while (std::coroutine_handle<> handle = shard.queue.pop()) {
+        --shard.queued;
+        auto start = std::chrono::steady_clock::now();
+        handle.resume();
+        ++shard.tasks;
+        shard.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "coro.hpp"
+#include "mpmc_queue.hpp"
+
+// Threads running the CPU-heavy and blocking parts of the requests (storage
+// accesses, searches, syncs), so that they never stall the event loop.
+// The pool is split in shards of one thread each, owning the keys (users) hashed
+// to them: the requests of a user always run on the same thread, which keeps its
+// indexes in the caches of one core (and its memory on the local NUMA node) and
+// leaves its locks uncontended. A coroutine moves to a shard by awaiting schedule().
+// The waits for the disk (commits) run on a separate set of threads instead, shared
+// by all the keys: they would stall the other keys of the shard, and the requests of
+// a key could no longer share them.
+// Every queue is split by priority: the latency-sensitive work (searches, fetches)
+// overtakes the bulk work (updates) waiting on the same threads.
+class ComputePool {
+public:
+    enum class Priority {
+        latency,  // A client waits for a short answer
+        bulk,     // Large transfers, where the queueing delay is small in comparison
+    };
+
+    // CPUs a shard thread is pinned to
+    enum class Pinning {
+        none,  // Any
+        core,  // One core per shard, in turn
+        node,  // The cores of one NUMA node per shard, in turn
+    };
+
+    // Load of a shard
+    struct Load {
+        uint64_t tasks;          // Coroutines resumed
+        uint64_t busy_ns;        // Time spent running them
+        size_t queued;           // Coroutines waiting
+        std::string hot_key;     // Key scheduled the most since the previous call (if counted)
+        uint64_t hot_key_tasks;  // Times it was scheduled
+    };
+
+    // Runs `shards` shard threads and `sync_threads` threads for the syncs (0: one
+    // per core available). The keys scheduled are counted for load() if count_keys.
+    ComputePool(size_t shards, Pinning pinning, size_t sync_threads, bool count_keys);
+    ~ComputePool();
+
+    // Stops the threads once the coroutines already scheduled are resumed.
+    void stop();
+
+    ComputePool(const ComputePool&) = delete;
+    ComputePool& operator=(const ComputePool&) = delete;
+
+    size_t size() const { return shards.size(); }
+    size_t sync_size() const { return sync ? sync->threads.size() : 0; }
+    size_t shard_of(std::string_view key) const;
+    Load load(size_t shard);
+
+    // Resumes the awaiting coroutine on the thread of the shard owning key (at once
+    // if it already runs on it). key must outlive the wait.
+    struct Schedule {
+        ComputePool& pool;
+        std::string_view key;
+        size_t shard;
+        Priority priority;
+
+        bool await_ready() const noexcept { return current == pool.shards[shard].get(); }
+        void await_suspend(std::coroutine_handle<> awaiter);
+        void await_resume();
+    };
+    Schedule schedule(std::string_view key, Priority priority) { return {*this, key, shard_of(key), priority}; }
+
+    // Resumes the awaiting coroutine on a sync thread (at once if it already runs on one,
+    // unless queued).
+    struct ScheduleSync {
+        ComputePool& pool;
+        Priority priority;
+        bool queued = false;
+
+        bool await_ready() const noexcept { return !queued && current == pool.sync.get(); }
+        void await_suspend(std::coroutine_handle<> awaiter);
+        void await_resume() const noexcept {}
+    };
+    ScheduleSync schedule_sync(Priority priority) { return {*this, priority}; }
+
+    // Runs f on a sync thread, never the calling one, without waiting for it.
+    // NOTE: must not be called once stop() started, f could be dropped.
+    void post_sync(std::function<void()> f, Priority priority);
+
+private:
+    // Slots of the keys counted by a shard
+    static constexpr size_t KEY_SLOTS = 64;
+
+    struct Shard {
+        BlockingPriorityQueue<std::coroutine_handle<>> queue;
+        std::vector<std::thread> threads;
+        std::atomic<uint64_t> tasks = 0;
+        std::atomic<uint64_t> busy_ns = 0;
+        std::atomic<size_t> queued = 0;
+
+        // Tasks of the keys hashed to each slot, counted by the shard thread since
+        // the epoch of the previous load() (the keys of a slot are counted together)
+        std::array<uint64_t, KEY_SLOTS> key_tasks{};
+        std::atomic<uint64_t> epoch = 0;  // Incremented by load()
+        uint64_t counted_epoch = 0;       // Epoch of key_tasks
+        uint64_t hot_slot_tasks = 0;      // Tasks of the hottest slot
+
+        // NOTE: only contended by load() and when the hottest key changes.
+        std::mutex hot_mutex;
+        std::string hot_key;                       // Key last counted in the hottest slot
+        uint64_t hot_epoch = 0;                    // Epoch of hot_key
+        std::atomic<uint64_t> hot_key_tasks = 0;
+
+        explicit Shard(size_t queue_size) : queue(queue_size) {}
+    };
+
+    static thread_local const Shard* current;  // Shard of the calling thread
+    const bool count_keys;
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::unique_ptr<Shard> sync;
+
+    static void run(Shard& shard, const std::vector<int>& cpus);
+    // CPUs of each shard under the pinning policy (empty: not pinned)
+    static std::vector<std::vector<int>> placement(size_t shards, Pinning pinning);
+};
@@ -0,0 +1,129 @@
+#include "config.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <charconv>
+
+
+void print_usage(const char *program_name) {
+    using std::cerr;
+    cerr << "Usage:\n";
+    cerr << program_name << " [options]\n";
+    cerr << "  --storage=<path>        storage directory (default: storage)\n";
+    cerr << "  --storage-engine=<name> where the indexes are stored: file or memory, lost on exit (default: file)\n";
+    cerr << "  --legacy-uid=<uid>      peer uid given the storage of test_user, the user of older servers (default: none)\n";
+    cerr << "  --cache-budget=<size>   memory budget of the resident user indexes (default: 1G)\n";
+    cerr << "  --search-threads=<n>    threads walking the epochs of a search (default: 0, one per core)\n";
+    cerr << "  --workers=<n>           threads running the event loop (default: 0, one per core)\n";
+    cerr << "  --shards=<n>            threads owning the users, running their requests (default: 0, one per core)\n";
+    cerr << "  --pinning=<policy>      CPUs of the shard threads: none, core or node (default: core)\n";
+    cerr << "  --sync-threads=<n>      threads waiting for the commits to the disk (default: 0, one per core)\n";
+    cerr << "  --load-report=<s>       interval of the shard load reports (default: 60, 0: none)\n";
+    cerr << "  --commit-window=<us>    delay grouping the commits of the write-ahead logs (default: 0)\n";
+    cerr << "  --io-uring=<0|1>        batch the storage I/O through io_uring when available (default: 1)\n";
+    cerr << "  --max-update=<size>     largest update (default: 4G)\n";
+    cerr << "  --max-request=<size>    largest search, search confirmation or fetch request (default: 64M)\n";
+    cerr << "  --max-requests=<n>      requests in progress, the next are refused as busy (default: 1024, 0: no limit)\n";
+    cerr << "  --max-inflight=<size>   memory held by the requests in progress (default: 1G, 0: no limit)\n";
+    cerr << "  --user-requests=<n>     requests in progress of a user (default: 64, 0: no limit)\n";
+    cerr << "  --user-inflight=<size>  memory held by the requests in progress of a user (default: 256M, 0: no limit)\n";
+    cerr << "  --log-level=<level>     least severe level logged: debug, info, warning, error or off (default: info)\n";
+    cerr << "  --log-rate=<n>          records logged per second, errors excepted (default: 10000, 0: no limit)\n";
+    cerr << "  --trace-spans=<n>       tracing spans kept by each thread (default: 1024, 0: no tracing)\n";
+    cerr.flush();
+}
+
+
+// Parses an unsigned number with an optional K, M or G suffix.
+size_t parse_size(std::string_view name, std::string_view value) {
+    size_t result = 0;
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (ec != std::errc{} || end == value.data()) {
+        throw std::invalid_argument("Invalid value for " + std::string(name));
+    }
+
+    std::string_view suffix(end, value.data() + value.size() - end);
+    if (suffix == "K") return result << 10;
+    if (suffix == "M") return result << 20;
+    if (suffix == "G") return result << 30;
+    if (!suffix.empty()) {
+        throw std::invalid_argument("Invalid value for " + std::string(name));
+    }
+    return result;
+}
+
+
+ServerConfig parse_config(int argc, const char **argv) {
+    ServerConfig config{};
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        size_t eq = arg.find('=');
+        if (!arg.starts_with("--") || eq == std::string_view::npos) {
+            print_usage(argv[0]);
+            throw std::invalid_argument("Invalid option " + std::string(arg));
+        }
+
+        std::string_view name = arg.substr(2, eq - 2);
+        std::string_view value = arg.substr(eq + 1);
+
+        if (name == "storage") {
+            config.storage_path = value;
+        } else if (name == "storage-engine") {
+            if (value != "file" && value != "memory") {
+                throw std::invalid_argument("Invalid value for " + std::string(name));
+            }
+            config.storage_engine = value;
+        } else if (name == "legacy-uid") {
+            config.legacy_uid = std::to_string(parse_size(name, value));
+        } else if (name == "cache-budget") {
+            config.cache_budget = parse_size(name, value);
+        } else if (name == "search-threads") {
+            config.search_threads = parse_size(name, value);
+        } else if (name == "workers") {
+            config.workers = parse_size(name, value);
+        } else if (name == "shards") {
+            config.shards = parse_size(name, value);
+        } else if (name == "pinning") {
+            if (value != "none" && value != "core" && value != "node") {
+                throw std::invalid_argument("Invalid value for " + std::string(name));
+            }
+            config.pinning = value;
+        } else if (name == "sync-threads") {
+            config.sync_threads = parse_size(name, value);
+        } else if (name == "load-report") {
+            config.load_report = parse_size(name, value);
+        } else if (name == "commit-window") {
+            config.commit_window = parse_size(name, value);
+        } else if (name == "io-uring") {
+            config.io_uring = parse_size(name, value) != 0;
+        } else if (name == "max-update") {
+            config.max_update = parse_size(name, value);
+        } else if (name == "max-request") {
+            config.max_request = parse_size(name, value);
+        } else if (name == "max-requests") {
+            config.max_requests = parse_size(name, value);
+        } else if (name == "max-inflight") {
+            config.max_inflight = parse_size(name, value);
+        } else if (name == "user-requests") {
+            config.user_requests = parse_size(name, value);
+        } else if (name == "user-inflight") {
+            config.user_inflight = parse_size(name, value);
+        } else if (name == "log-level") {
+            if (value != "debug" && value != "info" && value != "warning" && value != "error" && value != "off") {
+                throw std::invalid_argument("Invalid value for " + std::string(name));
+            }
+            config.log_level = value;
+        } else if (name == "log-rate") {
+            config.log_rate = parse_size(name, value);
+        } else if (name == "trace-spans") {
+            config.trace_spans = parse_size(name, value);
+        } else {
+            print_usage(argv[0]);
+            throw std::invalid_argument("Unknown option " + std::string(arg));
+        }
+    }
+
+    return config;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Server settings, given as --name=value command line options
+struct ServerConfig {
+    std::string storage_path = "storage";    // Storage directory for user data
+    std::string storage_engine = "file";     // Where the indexes are stored: file or memory
+    std::string legacy_uid;                  // Peer uid given the storage of test_user, the only user of the
+                                             // servers before the peer credentials (empty: kept as is)
+    size_t cache_budget = 1ULL << 30;        // Memory budget of the resident user indexes (bytes)
+    size_t search_threads = 0;               // Threads walking the epochs of a search (0: one per core)
+    size_t workers = 0;                      // Threads running the event loop (0: one per core)
+    size_t shards = 0;                       // Threads owning the users, running their requests (0: one per core)
+    std::string pinning = "core";            // CPUs of the shard threads: none, core or node (NUMA)
+    size_t sync_threads = 0;                 // Threads waiting for the commits to the disk (0: one per core)
+    size_t load_report = 60;                 // Interval of the shard load reports (seconds, 0: none)
+    size_t commit_window = 0;                // Delay grouping the commits of the write-ahead logs (microseconds)
+    bool io_uring = true;                    // Batch the storage I/O through io_uring when the kernel supports it
+    size_t max_update = 4ULL << 30;          // Largest update (bytes)
+    size_t max_request = 64ULL << 20;        // Largest request read whole: searches, their step 2, fetches (bytes)
+    size_t max_requests = 1024;              // Requests in progress (0: no limit)
+    size_t max_inflight = 1ULL << 30;        // Memory held by the requests in progress (bytes, 0: no limit)
+    size_t user_requests = 64;               // Requests in progress of a user (0: no limit)
+    size_t user_inflight = 256ULL << 20;     // Memory held by the requests in progress of a user (bytes, 0: no limit)
+    std::string log_level = "info";          // Least severe level logged: debug, info, warning, error or off
+    size_t log_rate = 10000;                 // Records logged per second, errors excepted (0: no limit)
+    size_t trace_spans = 1024;               // Tracing spans kept by each thread (0: no tracing)
+};
+
+// Parses the command line options.
+// Sizes accept the K, M and G suffixes.
+// @throws std::invalid_argument on unknown options or invalid values.
+ServerConfig parse_config(int argc, const char **argv);
+
+void print_usage(const char *program_name);
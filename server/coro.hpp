@@ -0,0 +1,107 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// Coroutine returning a T to the coroutine awaiting it.
+// A task starts when it is awaited and resumes its awaiter when it completes
+// (by symmetric transfer, so chains of tasks don't grow the stack).
+template<typename T = void>
+class Task;
+
+namespace coro {
+
+template<typename T>
+struct Promise;
+
+// Resumes the awaiter of the completed task
+struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template<typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> done) noexcept {
+        return done.promise().continuation;
+    }
+    void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+    T result() {
+        if (exception) std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {
+        if (exception) std::rethrow_exception(exception);
+    }
+};
+
+}  // namespace coro
+
+template<typename T>
+class Task {
+public:
+    using promise_type = coro::Promise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    explicit Task(Handle handle) : handle(handle) {}
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+private:
+    Handle handle;
+};
+
+template<typename T>
+Task<T> coro::Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> coro::Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// Coroutine started at once and never awaited: its frame is freed when it completes.
+// An exception escaping it terminates the program.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
@@ -0,0 +1,583 @@
+#include "doc_store.hpp"
+#include "file_io.hpp"
+#include "io_batch.hpp"
+#include "logger.hpp"
+#include "storage_engine.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Segment files are read in chunks of this size when scanned
+static constexpr size_t SCAN_CHUNK = 1 << 20;
+
+DocStore::Compaction::~Compaction() {
+    if (source_fd != -1) ::close(source_fd);
+    if (target_fd != -1) {
+        ::close(target_fd);
+        std::error_code ec;
+        StorageEngine::instance().remove(target_path, ec);
+    }
+}
+
+DocStore::Pending::~Pending() {
+    if (fd != -1) ::close(fd);
+}
+
+DocStore::Snapshot::~Snapshot() {
+    for (int fd : fds) ::close(fd);
+}
+
+DocStore::~DocStore() {
+    close();
+}
+
+fs::path DocStore::segment_path(uint32_t id) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%08u.pack", id);
+    return dir_path / name;
+}
+
+bool DocStore::open(const fs::path& dir) {
+    close();
+    dir_path = dir;
+
+    std::error_code ec;
+    StorageEngine::instance().create_directories(dir_path, ec);
+    if (ec) {
+        log_error("Cannot create document store", "path", dir_path);
+        return false;
+    }
+
+    // Segments are applied in id order: later records supersede earlier ones.
+    std::vector<uint32_t> ids;
+    for (const fs::path& path : StorageEngine::instance().list(dir_path, ec)) {
+        if (path.extension() == ".compact") {
+            // Leftover of an interrupted compaction
+            StorageEngine::instance().remove(path, ec);
+        } else if (std::string stem = path.stem().string();
+                   path.extension() == ".pack" && !stem.empty() && std::all_of(stem.begin(), stem.end(), ::isdigit)) {
+            ids.push_back(std::stoul(stem));
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    if (ids.empty()) ids.push_back(1);
+
+    for (uint32_t id : ids) {
+        Segment& segment = segments[id];
+        segment.fd = StorageEngine::instance().open(segment_path(id), O_CREAT);
+        if (segment.fd == -1) {
+            log_error("Cannot open document segment", "path", segment_path(id));
+            close();
+            return false;
+        }
+
+        bool indexed = scan(segment.fd, segment.size, [&](const Uuid& uuid, uint64_t offset, uint64_t length) {
+            if (length == TOMBSTONE) segment.tombstones += HEADER_SIZE;
+            record(uuid, Location{id, offset, length});
+        });
+        if (!indexed) {
+            log_error("Failed to read document segment", "path", segment_path(id));
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void DocStore::close() {
+    for (auto& [id, segment] : segments) {
+        if (segment.fd != -1) ::close(segment.fd);
+    }
+    segments.clear();
+    index.clear();
+    pending_records.clear();
+    dir_dirty = false;
+    ++generation;
+}
+
+bool DocStore::scan(int fd, uint64_t& end,
+                    const std::function<void(const Uuid&, uint64_t, uint64_t)>& f) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+    const uint64_t size = st.st_size;
+
+    // Only the headers are needed: the documents in the chunk are skipped.
+    std::vector<uint8_t> chunk(SCAN_CHUNK);
+    uint64_t chunk_start = 0, chunk_end = 0;
+
+    uint64_t offset = 0;
+    while (offset + HEADER_SIZE <= size) {
+        if (offset + HEADER_SIZE > chunk_end) {
+            chunk_start = offset;
+            chunk_end = std::min<uint64_t>(offset + chunk.size(), size);
+            if (!read_at(fd, chunk.data(), chunk_end - chunk_start, chunk_start)) return false;
+        }
+        const uint8_t* header = chunk.data() + (offset - chunk_start);
+
+        uint64_t length;
+        std::memcpy(&length, header + UUID_SIZE, sizeof(length));
+        bool padding = length != TOMBSTONE && (length & PADDING);
+        uint64_t body = length == TOMBSTONE ? 0 : length & ~PADDING;
+        if (body > size - offset - HEADER_SIZE) break;
+
+        if (!padding) {
+            Uuid uuid;
+            std::memcpy(uuid.data(), header, UUID_SIZE);
+            f(uuid, offset, length);
+        }
+        offset += HEADER_SIZE + body;
+    }
+
+    if (offset != size) {
+        log_warning("Truncating partial document record");
+        if (ftruncate(fd, offset) != 0) return false;
+    }
+    end = offset;
+    return true;
+}
+
+void DocStore::record(const Uuid& uuid, const Location& location) {
+    if (location.length == TOMBSTONE) {
+        if (const Location* previous = index.find(uuid)) {
+            segments[previous->segment].live -= HEADER_SIZE + previous->length;
+            index.erase(uuid);
+        }
+        return;
+    }
+
+    auto [current, inserted] = index.try_emplace(uuid, location);
+    if (!inserted) {
+        segments[current->segment].live -= HEADER_SIZE + current->length;
+        *current = location;
+    }
+    segments[location.segment].live += HEADER_SIZE + location.length;
+}
+
+void DocStore::supersede(const Uuid& uuid) {
+    for (Pending* pending : pending_records) {
+        if (pending->uuid == uuid) pending->superseded = true;
+    }
+}
+
+bool DocStore::reserve(uint64_t size) {
+    if (active().size == 0 || active().size + size <= SEGMENT_SIZE) return true;
+
+    // The active segment is sealed.
+    uint32_t id = segments.rbegin()->first + 1;
+    int fd = StorageEngine::instance().open(segment_path(id), O_CREAT | O_TRUNC);
+    if (fd == -1) {
+        log_error("Cannot create document segment", "path", segment_path(id));
+        return false;
+    }
+    segments[id].fd = fd;
+    dir_dirty = true;
+    return true;
+}
+
+bool DocStore::put_batch(const uint8_t* data, size_t size) {
+    if (!is_open()) return false;
+
+    // Validate the whole batch before writing it.
+    for (size_t i = 0; i < size; ) {
+        uint64_t length;
+        if (size - i < HEADER_SIZE) {
+            log_error("Invalid document header");
+            return false;
+        }
+        std::memcpy(&length, data + i + UUID_SIZE, sizeof(length));
+        if (length > size - i - HEADER_SIZE) {
+            log_error("Invalid document data format");
+            return false;
+        }
+        i += HEADER_SIZE + length;
+    }
+    if (size == 0) return true;
+
+    if (!reserve(size)) return false;
+    uint32_t id = segments.rbegin()->first;
+    Segment& segment = active();
+
+    if (!write_at(segment.fd, data, size, segment.size)) {
+        log_error("Failed to append documents");
+        // Drop the partial batch, it must not be indexed when reopened.
+        if (ftruncate(segment.fd, segment.size) != 0) log_error("Failed to truncate document segment");
+        return false;
+    }
+
+    for (size_t i = 0; i < size; ) {
+        Uuid uuid;
+        uint64_t length;
+        std::memcpy(uuid.data(), data + i, UUID_SIZE);
+        std::memcpy(&length, data + i + UUID_SIZE, sizeof(length));
+        record(uuid, Location{id, segment.size + i, length});
+        supersede(uuid);
+        i += HEADER_SIZE + length;
+    }
+    segment.size += size;
+    segment.dirty = true;
+    return true;
+}
+
+std::unique_ptr<DocStore::Pending> DocStore::begin_record(const uint8_t* uuid, uint64_t length) {
+    if (!is_open()) return nullptr;
+    if (length >= PADDING - HEADER_SIZE) {
+        log_error("Invalid document length");
+        return nullptr;
+    }
+    if (!reserve(HEADER_SIZE + length)) return nullptr;
+
+    auto pending = std::make_unique<Pending>();
+    pending->generation = generation;
+    std::memcpy(pending->uuid.data(), uuid, UUID_SIZE);
+    pending->segment = segments.rbegin()->first;
+    pending->length = length;
+    Segment& segment = active();
+    pending->offset = segment.size;
+
+    // Until it is finished the record is padding: the space after it may be
+    // appended to while the document is written.
+    uint8_t header[HEADER_SIZE];
+    uint64_t padding = PADDING | length;
+    std::memcpy(header, uuid, UUID_SIZE);
+    std::memcpy(header + UUID_SIZE, &padding, sizeof(padding));
+    pending->fd = dup(segment.fd);
+    if (pending->fd == -1 || !write_at(segment.fd, header, sizeof(header), segment.size)) {
+        log_error("Failed to reserve document record");
+        return nullptr;
+    }
+
+    supersede(pending->uuid);
+    segment.size += HEADER_SIZE + length;
+    segment.dirty = true;
+    ++segment.pending;
+    pending_records.push_back(pending.get());
+    return pending;
+}
+
+bool DocStore::finish_record(Pending& pending, bool written) {
+    // The store was reopened in the meantime.
+    if (pending.generation != generation) return false;
+    auto it = segments.find(pending.segment);
+    if (it == segments.end()) return false;
+    Segment& segment = it->second;
+    --segment.pending;
+    std::erase(pending_records, &pending);
+    if (!written) return false;
+
+    if (!write_at(pending.fd, &pending.length, sizeof(pending.length), pending.offset + UUID_SIZE)) {
+        log_error("Failed to write document header");
+        return false;
+    }
+    segment.dirty = true;
+
+    // A record (or tombstone) of the same UUID appended in the meantime supersedes
+    // this one, as it does when the segments are indexed.
+    if (!pending.superseded) record(pending.uuid, Location{pending.segment, pending.offset, pending.length});
+    return true;
+}
+
+bool DocStore::restore_record(const uint8_t* uuid, uint64_t length, uint32_t segment, uint64_t offset) {
+    auto it = segments.find(segment);
+    if (it == segments.end() || offset > it->second.size || it->second.size - offset < HEADER_SIZE ||
+        length > it->second.size - offset - HEADER_SIZE) {
+        log_error("Invalid document record");
+        return false;
+    }
+
+    uint8_t header[HEADER_SIZE];
+    std::memcpy(header, uuid, UUID_SIZE);
+    std::memcpy(header + UUID_SIZE, &length, sizeof(length));
+    if (!write_at(it->second.fd, header, sizeof(header), offset)) {
+        log_error("Failed to write document header");
+        return false;
+    }
+    it->second.dirty = true;
+
+    Uuid key;
+    std::memcpy(key.data(), uuid, UUID_SIZE);
+    record(key, Location{segment, offset, length});
+    return true;
+}
+
+int64_t DocStore::erase_batch(const uint8_t* uuids, size_t count) {
+    if (!is_open()) return -1;
+
+    std::vector<uint8_t> tombstones;
+    tombstones.reserve(count * HEADER_SIZE);
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* uuid = uuids + i * UUID_SIZE;
+        if (!find(uuid)) continue;
+
+        tombstones.insert(tombstones.end(), uuid, uuid + UUID_SIZE);
+        tombstones.insert(tombstones.end(), reinterpret_cast<const uint8_t*>(&TOMBSTONE),
+                          reinterpret_cast<const uint8_t*>(&TOMBSTONE) + sizeof(TOMBSTONE));
+    }
+    if (tombstones.empty()) return 0;
+
+    if (!reserve(tombstones.size())) return -1;
+    uint32_t id = segments.rbegin()->first;
+    Segment& segment = active();
+
+    if (!write_at(segment.fd, tombstones.data(), tombstones.size(), segment.size)) {
+        log_error("Failed to append document tombstones");
+        if (ftruncate(segment.fd, segment.size) != 0) log_error("Failed to truncate document segment");
+        return -1;
+    }
+
+    for (size_t i = 0; i < tombstones.size(); i += HEADER_SIZE) {
+        Uuid uuid;
+        std::memcpy(uuid.data(), tombstones.data() + i, UUID_SIZE);
+        record(uuid, Location{id, segment.size + i, TOMBSTONE});
+        supersede(uuid);
+    }
+    segment.size += tombstones.size();
+    segment.tombstones += tombstones.size();
+    segment.dirty = true;
+    return tombstones.size() / HEADER_SIZE;
+}
+
+const DocStore::Location* DocStore::find(const uint8_t* uuid) const {
+    Uuid key;
+    std::memcpy(key.data(), uuid, UUID_SIZE);
+    return index.find(key);
+}
+
+bool DocStore::get(const uint8_t* uuid, std::vector<uint8_t>& document) const {
+    const Location* location = find(uuid);
+    if (!location) return false;
+
+    document.resize(location->length);
+    if (!read_at(segments.at(location->segment).fd, document.data(), document.size(), location->offset + HEADER_SIZE)) {
+        log_error("Failed to read document");
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<DocStore::Snapshot> DocStore::snapshot(const uint8_t* uuids, size_t count) const {
+    auto snapshot = std::make_unique<Snapshot>();
+    snapshot->records.resize(count);
+
+    std::map<uint32_t, int> pinned;  // Duplicate descriptor of each segment referenced
+    for (size_t i = 0; i < count; ++i) {
+        Snapshot::Record& record = snapshot->records[i];
+        std::memcpy(record.uuid.data(), uuids + i * UUID_SIZE, UUID_SIZE);
+
+        const Location* location = index.find(record.uuid);
+        if (!location) continue;
+
+        auto [it, inserted] = pinned.try_emplace(location->segment, -1);
+        if (inserted) {
+            it->second = dup(segments.at(location->segment).fd);
+            if (it->second == -1) {
+                log_error("Failed to pin document segment");
+                return nullptr;
+            }
+            snapshot->fds.push_back(it->second);
+        }
+        record.fd = it->second;
+        record.offset = location->offset;
+        record.size = HEADER_SIZE + location->length;
+    }
+    return snapshot;
+}
+
+bool DocStore::sync() {
+    if (!is_open()) return false;
+
+    for (auto& [id, segment] : segments) {
+        if (!segment.dirty) continue;
+        if (!StorageEngine::instance().sync(segment.fd)) {
+            log_error("Failed to sync document segment", "path", segment_path(id));
+            return false;
+        }
+        segment.dirty = false;
+    }
+
+    // The segments created or replaced must be found when the store is reopened.
+    if (dir_dirty) {
+        if (!StorageEngine::instance().sync_directory(dir_path)) {
+            log_error("Failed to sync document store", "path", dir_path);
+            return false;
+        }
+        dir_dirty = false;
+    }
+    return true;
+}
+
+size_t DocStore::file_size() const {
+    size_t total = 0;
+    for (const auto& [id, segment] : segments) total += segment.size;
+    return total;
+}
+
+size_t DocStore::live_bytes() const {
+    size_t total = 0;
+    for (const auto& [id, segment] : segments) total += segment.live;
+    return total;
+}
+
+uint64_t DocStore::reclaimable(uint32_t id, const Segment& segment) const {
+    if (segment.pending) return 0;
+    // The tombstones of the first segment cannot hide anything anymore.
+    uint64_t kept = id == segments.begin()->first ? 0 : segment.tombstones;
+    return segment.size - segment.live - kept;
+}
+
+bool DocStore::needs_compaction() const {
+    for (auto it = segments.begin(); it != segments.end() && std::next(it) != segments.end(); ++it) {
+        uint64_t dead = reclaimable(it->first, it->second);
+        if (dead >= MIN_DEAD_BYTES && dead * 2 >= it->second.size) return true;
+    }
+    return false;
+}
+
+std::unique_ptr<DocStore::Compaction> DocStore::begin_compaction() {
+    // The sealed segment with the most dead bytes
+    uint32_t id = 0;
+    uint64_t most_dead = 0;
+    for (auto it = segments.begin(); it != segments.end() && std::next(it) != segments.end(); ++it) {
+        uint64_t dead = reclaimable(it->first, it->second);
+        if (dead >= MIN_DEAD_BYTES && dead * 2 >= it->second.size && dead > most_dead) {
+            id = it->first;
+            most_dead = dead;
+        }
+    }
+    if (id == 0) return nullptr;
+
+    auto compaction = std::make_unique<Compaction>();
+    compaction->generation = generation;
+    compaction->segment = id;
+    compaction->keep_tombstones = id != segments.begin()->first;
+    compaction->target_path = segment_path(id);
+    compaction->target_path += ".compact";
+
+    compaction->source_fd = dup(segments[id].fd);
+    compaction->target_fd = StorageEngine::instance().open(compaction->target_path, O_CREAT | O_TRUNC);
+    if (compaction->source_fd == -1 || compaction->target_fd == -1) {
+        log_error("Cannot start document compaction");
+        return nullptr;
+    }
+
+    index.for_each([&](const Uuid& uuid, const Location& location) {
+        if (location.segment == id) compaction->records.emplace_back(uuid, location);
+    });
+    std::sort(compaction->records.begin(), compaction->records.end(),
+              [](const auto& a, const auto& b) { return a.second.offset < b.second.offset; });
+    return compaction;
+}
+
+bool DocStore::compaction_copy(Compaction& compaction) {
+    // NOTE: the segment is sealed, its records are immutable.
+    // The records of a chunk are read in one batch, then written at once: they are
+    // contiguous in the compacted segment.
+    bool copied = true;
+    size_t next = 0;  // Next live record
+    std::vector<uint8_t> chunk;
+    std::vector<std::pair<uint64_t, size_t>> extents;  // Offset and size of the records of the chunk
+    uint64_t chunk_start = compaction.end;
+    IoBatch batch;
+
+    auto flush = [&] {
+        if (extents.empty()) return;
+        chunk.resize(compaction.end - chunk_start);
+        size_t position = 0;
+        for (const auto& [offset, size] : extents) {
+            batch.read(compaction.source_fd, chunk.data() + position, size, offset);
+            position += size;
+        }
+        if (!batch.submit() || !write_at(compaction.target_fd, chunk.data(), chunk.size(), chunk_start)) {
+            copied = false;
+        }
+        extents.clear();
+        chunk_start = compaction.end;
+    };
+
+    auto copy = [&](uint64_t offset, size_t size) {
+        extents.emplace_back(offset, size);
+        compaction.end += size;
+        if (compaction.end - chunk_start >= COPY_CHUNK_SIZE) flush();
+    };
+
+    uint64_t source_end;
+    bool scanned = scan(compaction.source_fd, source_end, [&](const Uuid&, uint64_t offset, uint64_t length) {
+        if (!copied) return;
+
+        if (length == TOMBSTONE) {
+            if (!compaction.keep_tombstones) return;
+            copy(offset, HEADER_SIZE);
+            compaction.tombstones += HEADER_SIZE;
+        } else if (next < compaction.records.size() && compaction.records[next].second.offset == offset) {
+            compaction.offsets.push_back(compaction.end);
+            copy(offset, HEADER_SIZE + length);
+            ++next;
+        }
+    });
+    if (copied) flush();
+
+    // Every live record must have been copied, or the index would point past them.
+    if (!scanned || !copied || next != compaction.records.size()) {
+        log_error("Failed to copy document segment");
+        return false;
+    }
+
+    // The compacted segment must be durable before it replaces the current one.
+    if (!StorageEngine::instance().sync(compaction.target_fd)) {
+        log_error("Failed to sync compacted document segment");
+        return false;
+    }
+    return true;
+}
+
+bool DocStore::finish_compaction(Compaction& compaction, CompactionStats& stats) {
+    // The store was reopened in the meantime.
+    if (compaction.generation != generation) return false;
+    auto it = segments.find(compaction.segment);
+    if (it == segments.end()) return false;
+    Segment& segment = it->second;
+
+    // The records still current are relocated once the segment is replaced: the others
+    // were superseded or deleted in the meantime, by records of a later segment.
+    std::vector<std::pair<Location*, uint64_t>> relocated;
+    uint64_t live = 0;
+    for (size_t i = 0; i < compaction.offsets.size(); ++i) {
+        const auto& [uuid, previous] = compaction.records[i];
+        Location* current = index.find(uuid);
+        if (current && current->segment == previous.segment && current->offset == previous.offset) {
+            relocated.emplace_back(current, compaction.offsets[i]);
+            live += HEADER_SIZE + current->length;
+        }
+    }
+
+    std::error_code ec;
+    StorageEngine::instance().rename(compaction.target_path, segment_path(compaction.segment), ec);
+    if (ec) {
+        log_error("Failed to replace document segment", "error", ec.message());
+        return false;
+    }
+    for (const auto& [location, offset] : relocated) location->offset = offset;
+
+    stats.segment = compaction.segment;
+    stats.bytes_before = segment.size;
+    stats.bytes_after = compaction.end;
+
+    ::close(segment.fd);
+    segment.fd = compaction.target_fd;
+    compaction.target_fd = -1;
+    dir_dirty = true;
+    segment.size = compaction.end;
+    segment.live = live;
+    segment.tombstones = compaction.tombstones;
+
+    // An empty sealed segment is dropped.
+    if (segment.size == 0) {
+        ::close(segment.fd);
+        StorageEngine::instance().remove(segment_path(compaction.segment), ec);
+        segments.erase(it);
+    }
+    return true;
+}
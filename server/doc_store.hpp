@@ -0,0 +1,209 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include "flat_table.hpp"
+
+namespace fs = std::filesystem;
+
+// Store of the encrypted documents of a user.
+// The documents are appended to segment files (packfiles) of about SEGMENT_SIZE
+// bytes, an in-memory index keeps the location of the latest record of each UUID.
+// A record supersedes the records of the same UUID in earlier positions (earlier
+// in its segment, or in a segment with a lower id); a deletion appends a tombstone.
+// Superseded and deleted records are dropped by compaction, one segment at a time.
+//
+// Record: UUID (16) || length (8) || document (length)
+// Tombstone: UUID (16) || TOMBSTONE (8)
+// Padding: UUID (16) || PADDING | length (8) || unused (length), a record still being
+// received (or never completed), skipped when the segment is indexed.
+class DocStore {
+public:
+    static constexpr size_t UUID_SIZE = 16;
+    static constexpr size_t HEADER_SIZE = UUID_SIZE + 8;  // UUID || length
+
+    using Uuid = std::array<uint8_t, UUID_SIZE>;
+
+    // Location of a document
+    struct Location {
+        uint32_t segment;  // Id of the segment
+        uint64_t offset;   // Offset of the record in the segment
+        uint64_t length;   // Length of the document
+    };
+
+    // Outcome of a completed compaction
+    struct CompactionStats {
+        uint32_t segment;     // Id of the compacted segment
+        size_t bytes_before;  // Size of the segment before the compaction
+        size_t bytes_after;   // Size of the compacted segment
+    };
+
+    // State of a running compaction (see begin_compaction)
+    struct Compaction;
+    // Records pinned to be read without holding the user's indexes (see snapshot)
+    struct Snapshot;
+    // Record written without holding the user's indexes (see begin_record)
+    struct Pending;
+
+    DocStore() = default;
+    ~DocStore();
+
+    DocStore(const DocStore&) = delete;
+    DocStore& operator=(const DocStore&) = delete;
+
+    // Opens the store in the directory dir (created if it doesn't exist) and indexes
+    // its segments. A partially written trailing record is truncated.
+    bool open(const fs::path& dir);
+    void close();
+    bool is_open() const { return !segments.empty(); }
+
+    // Appends the serialized documents (UUID || length || document)* with a single write.
+    bool put_batch(const uint8_t* data, size_t size);
+
+    // Reserves a record for a document of the given length, to be written to
+    // pending->fd at pending->offset + HEADER_SIZE without holding the user's indexes
+    // (e.g. received from a socket). The segment of a pending record is not compacted.
+    std::unique_ptr<Pending> begin_record(const uint8_t* uuid, uint64_t length);
+    // Indexes the record if its document was written, otherwise it is left as padding.
+    // A record superseded in the meantime is not indexed (see Pending::superseded).
+    bool finish_record(Pending& pending, bool written);
+
+    // Indexes a record whose document was written in place (see begin_record), its
+    // header is rewritten: it may not have reached the file. Replays the write-ahead log.
+    bool restore_record(const uint8_t* uuid, uint64_t length, uint32_t segment, uint64_t offset);
+
+    // Deletes the documents with the given UUIDs (UUID_SIZE bytes each) with a single write.
+    // Returns the number of documents deleted, -1 on failure.
+    int64_t erase_batch(const uint8_t* uuids, size_t count);
+
+    // Writes the modified segments back to their files.
+    bool sync();
+
+    // Returns the location of the latest document with the given UUID, or nullptr.
+    const Location* find(const uint8_t* uuid) const;
+
+    // Reads the latest document with the given UUID. Returns false if there is none.
+    bool get(const uint8_t* uuid, std::vector<uint8_t>& document) const;
+
+    // Locates the records of the documents with the given UUIDs (UUID_SIZE bytes each).
+    // Their segments are pinned by duplicate descriptors: records are never modified in
+    // place and compaction replaces a segment by renaming, so the records can be read
+    // after the user's indexes are released. Returns nullptr on failure.
+    std::unique_ptr<Snapshot> snapshot(const uint8_t* uuids, size_t count) const;
+
+    size_t size() const { return index.size(); }
+    size_t segment_count() const { return segments.size(); }
+    size_t file_size() const;
+    size_t live_bytes() const;
+    // Memory held by the in-memory index
+    size_t memory_usage() const { return index.memory_usage(); }
+
+    // Compaction of a sealed segment (not the one being appended to): its live records
+    // and the tombstones still needed are copied into a fresh file without holding the
+    // user's indexes, finish_compaction then replaces the segment.
+    bool needs_compaction() const;
+    // Called while holding the indexes.
+    std::unique_ptr<Compaction> begin_compaction();
+    // Called without holding the indexes.
+    static bool compaction_copy(Compaction& compaction);
+    // Called while holding the indexes.
+    bool finish_compaction(Compaction& compaction, CompactionStats& stats);
+
+private:
+    static constexpr uint64_t TOMBSTONE = UINT64_MAX;
+    static constexpr uint64_t PADDING = 1ULL << 63;
+    // A segment is sealed once it exceeds this size
+    static constexpr uint64_t SEGMENT_SIZE = 64ULL << 20;
+    // Minimum amount of dead bytes worth compacting a segment
+    static constexpr uint64_t MIN_DEAD_BYTES = 1ULL << 20;
+    // Records read in one batch by a compaction copy
+    static constexpr size_t COPY_CHUNK_SIZE = 1 << 20;
+
+    struct Segment {
+        int fd = -1;
+        uint64_t size = 0;        // Size of the segment file
+        uint64_t live = 0;        // Bytes of the latest records
+        uint64_t tombstones = 0;  // Bytes of the tombstones
+        uint32_t pending = 0;     // Records being written (see begin_record)
+        bool dirty = false;       // Written since the last sync
+    };
+
+    using Index = flat::FlatMap<Uuid, Location>;
+
+    fs::path dir_path;
+    std::map<uint32_t, Segment> segments;  // By id, the last one is appended to
+    uint64_t generation = 0;               // Incremented when the store is reopened
+    Index index;
+    std::vector<Pending*> pending_records; // Records being written
+    bool dir_dirty = false;                // Segments created or replaced since the last sync
+
+    fs::path segment_path(uint32_t id) const;
+    Segment& active() { return std::prev(segments.end())->second; }
+    // Dead bytes compaction would drop from a segment (none while records are pending)
+    uint64_t reclaimable(uint32_t id, const Segment& segment) const;
+    // Starts a new segment if the active one is full
+    bool reserve(uint64_t size);
+    // Indexes a record, superseding the previous one of the same UUID
+    void record(const Uuid& uuid, const Location& location);
+    // Marks the pending records of the UUID as superseded by a record appended after them
+    void supersede(const Uuid& uuid);
+
+    // Calls f(uuid, offset, length) for every record of fd, truncating a partial
+    // trailing record. end is set to the size of the records.
+    static bool scan(int fd, uint64_t& end,
+                     const std::function<void(const Uuid&, uint64_t, uint64_t)>& f);
+};
+
+struct DocStore::Compaction {
+    uint64_t generation = 0;      // Generation of the store when the compaction began
+    uint32_t segment = 0;         // Id of the segment being compacted
+    bool keep_tombstones = true;  // Tombstones may hide records of earlier segments
+    int source_fd = -1;           // Duplicate of the segment descriptor
+    int target_fd = -1;
+    fs::path target_path;
+
+    std::vector<std::pair<Uuid, Location>> records;  // Live records of the segment, by offset
+    std::vector<uint64_t> offsets;                   // Their offsets in the compacted segment
+    uint64_t end = 0;                                // Size of the compacted segment
+    uint64_t tombstones = 0;                         // Bytes of the tombstones kept
+
+    ~Compaction();
+};
+
+struct DocStore::Pending {
+    uint64_t generation = 0;  // Generation of the store when the record was reserved
+    Uuid uuid;
+    uint32_t segment = 0;
+    uint64_t offset = 0;      // Offset of the record
+    uint64_t length = 0;      // Length of the document
+    int fd = -1;              // Duplicate of the segment descriptor
+    bool superseded = false;  // A record of the same UUID was appended after this one
+
+    Pending() = default;
+    Pending(const Pending&) = delete;
+    Pending& operator=(const Pending&) = delete;
+    ~Pending();
+};
+
+struct DocStore::Snapshot {
+    struct Record {
+        Uuid uuid;
+        int fd = -1;          // Descriptor of the segment, -1 if there is no such document
+        uint64_t offset = 0;  // Offset of the record (UUID || length || document)
+        uint64_t size = 0;    // Size of the record
+    };
+
+    std::vector<Record> records;  // In the order of the requested UUIDs
+    std::vector<int> fds;         // Duplicates of the segment descriptors
+
+    Snapshot() = default;
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+    ~Snapshot();
+};
@@ -0,0 +1,22 @@
+#include "file_io.hpp"
+#include <unistd.h>
+
+bool read_at(int fd, void* buf, size_t size, uint64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = pread(fd, static_cast<uint8_t*>(buf) + done, size - done, offset + done);
+        if (r <= 0) return false;
+        done += r;
+    }
+    return true;
+}
+
+bool write_at(int fd, const void* buf, size_t size, uint64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = pwrite(fd, static_cast<const uint8_t*>(buf) + done, size - done, offset + done);
+        if (r <= 0) return false;
+        done += r;
+    }
+    return true;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Positional I/O of exactly size bytes
+bool read_at(int fd, void* buf, size_t size, uint64_t offset);
+bool write_at(int fd, const void* buf, size_t size, uint64_t offset);
+
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <random>
+#include <utility>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Open-addressing with group probing (Swiss table scheme).
+// Every slot has a control byte: EMPTY, DELETED, or a 7-bit tag of the key hash.
+// The control bytes are scanned a group at a time, comparing the tag against the
+// whole group with SIMD, so only the slots whose tag matches are compared.
+//
+// NOTE: the keys stored by the server (Addrw, tw, UUIDs) are chosen by the clients,
+// which can't check they are hash outputs: they are hashed whole, with a random seed,
+// so that nobody can make them collide.
+namespace flat {
+
+constexpr size_t GROUP_SIZE = 16;
+
+constexpr int8_t EMPTY = -128;   // 0b10000000
+constexpr int8_t DELETED = -2;   // 0b11111110
+// Full slots have a non-negative control byte (the tag).
+inline bool is_full(int8_t ctrl) { return ctrl >= 0; }
+
+// A fresh random seed
+inline uint64_t random_seed() {
+    std::random_device device;
+    return (uint64_t(device()) << 32) ^ device();
+}
+
+// Seed of the in-memory tables, random for each process
+inline uint64_t process_seed() {
+    static const uint64_t seed = random_seed();
+    return seed;
+}
+
+// High and low halves of the 128-bit product, folded
+inline uint64_t fold_multiply(uint64_t a, uint64_t b) {
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+// Seeded hash of a key of size bytes, a multiple of 8 (multiply-fold over 16 bytes at a time)
+inline uint64_t hash_bytes(const uint8_t* key, size_t size, uint64_t seed) {
+    constexpr uint64_t K0 = 0xa0761d6478bd642fULL, K1 = 0xe7037ed1a0b428dbULL, K2 = 0x8ebc6af09c88c6e3ULL;
+    uint64_t h = seed ^ K0;
+    for (size_t i = 0; i < size; i += 16) {
+        uint64_t a, b = 0;
+        std::memcpy(&a, key + i, sizeof(a));
+        if (i + 8 < size) std::memcpy(&b, key + i + 8, sizeof(b));
+        h = fold_multiply(a ^ K1, b ^ h);
+    }
+    return fold_multiply(h ^ K2, size ^ seed);
+}
+// Tag stored in the control byte
+inline int8_t h2(uint64_t hash) { return static_cast<int8_t>(hash & 0x7f); }
+// Starting group
+inline uint64_t h1(uint64_t hash) { return hash >> 7; }
+
+// Bit i is set if slot i of the group matches
+class BitMask {
+public:
+    explicit BitMask(uint32_t mask) : mask(mask) {}
+    explicit operator bool() const { return mask != 0; }
+    size_t lowest() const { return __builtin_ctz(mask); }
+
+    // Iteration over the set bits
+    BitMask begin() const { return *this; }
+    BitMask end() const { return BitMask(0); }
+    size_t operator*() const { return lowest(); }
+    BitMask& operator++() { mask &= mask - 1; return *this; }
+    bool operator!=(const BitMask& other) const { return mask != other.mask; }
+
+private:
+    uint32_t mask;
+};
+
+// A group of control bytes
+class Group {
+public:
+    explicit Group(const int8_t* ctrl) {
+#if defined(__SSE2__)
+        bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+#else
+        std::memcpy(bytes, ctrl, GROUP_SIZE);
+#endif
+    }
+
+    BitMask match(int8_t tag) const {
+#if defined(__SSE2__)
+        return BitMask(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), bytes)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_SIZE; ++i) mask |= uint32_t(bytes[i] == tag) << i;
+        return BitMask(mask);
+#endif
+    }
+
+    BitMask match_empty() const { return match(EMPTY); }
+
+    BitMask match_empty_or_deleted() const {
+#if defined(__SSE2__)
+        // EMPTY and DELETED are the only control bytes with the sign bit set.
+        return BitMask(_mm_movemask_epi8(bytes));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_SIZE; ++i) mask |= uint32_t(bytes[i] < 0) << i;
+        return BitMask(mask);
+#endif
+    }
+
+private:
+#if defined(__SSE2__)
+    __m128i bytes;
+#else
+    int8_t bytes[GROUP_SIZE];
+#endif
+};
+
+// Triangular probing over the groups, it visits every group when their number is a power of two
+class ProbeSeq {
+public:
+    ProbeSeq(uint64_t hash, size_t groups) : mask(groups - 1), group(h1(hash) & mask) {}
+    // First slot of the current group
+    size_t offset() const { return group * GROUP_SIZE; }
+    void next() { ++step; group = (group + step) & mask; }
+
+private:
+    size_t mask;
+    size_t group;
+    size_t step = 0;
+};
+
+// Smallest capacity (a power of two, multiple of the group size) keeping `entries`
+// entries below half load
+inline size_t capacity_for(size_t entries, size_t minimum = GROUP_SIZE) {
+    size_t capacity = minimum;
+    while (capacity < entries * 2) capacity *= 2;
+    return capacity;
+}
+
+// In-memory flat hash map with inline fixed-width keys and values.
+// Key must be a byte array (a multiple of 8 bytes), Key and Value trivially copyable.
+template<typename Key, typename Value>
+class FlatMap {
+    static_assert(sizeof(Key) % 8 == 0);
+
+public:
+    FlatMap() = default;
+
+    FlatMap(FlatMap&& other) noexcept { *this = std::move(other); }
+    FlatMap& operator=(FlatMap&& other) noexcept {
+        ctrl = std::move(other.ctrl);
+        slots = std::move(other.slots);
+        capacity = std::exchange(other.capacity, 0);
+        count = std::exchange(other.count, 0);
+        tombstones = std::exchange(other.tombstones, 0);
+        seed = other.seed;
+        return *this;
+    }
+
+    const Value* find(const Key& key) const {
+        if (capacity == 0) return nullptr;
+        size_t i = find_slot(key);
+        return i == NPOS ? nullptr : &slots[i].second;
+    }
+    Value* find(const Key& key) {
+        return const_cast<Value*>(std::as_const(*this).find(key));
+    }
+
+    // Inserts key -> value if key is absent.
+    // Returns the stored value and whether it was inserted.
+    std::pair<Value*, bool> try_emplace(const Key& key, const Value& value) {
+        if (capacity > 0) {
+            if (size_t i = find_slot(key); i != NPOS) return {&slots[i].second, false};
+        }
+
+        // Keep the load factor (tombstones included) below 3/4.
+        if ((count + tombstones + 1) * 4 > capacity * 3) rehash(capacity_for(count + 1));
+
+        uint64_t key_hash = hash(key);
+        size_t i = find_free(key_hash);
+        if (ctrl[i] == DELETED) --tombstones;
+        ctrl[i] = h2(key_hash);
+        slots[i] = {key, value};
+        ++count;
+        return {&slots[i].second, true};
+    }
+
+    bool erase(const Key& key) {
+        if (capacity == 0) return false;
+        size_t i = find_slot(key);
+        if (i == NPOS) return false;
+
+        ctrl[i] = DELETED;
+        --count;
+        ++tombstones;
+        return true;
+    }
+
+    // Makes room for entries entries without rehashing.
+    void reserve(size_t entries) {
+        if (capacity_for(entries) > capacity) rehash(capacity_for(entries));
+    }
+
+    void clear() {
+        ctrl.clear();
+        slots.clear();
+        capacity = count = tombstones = 0;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t memory_usage() const { return capacity * (sizeof(int8_t) + sizeof(Slot)); }
+
+    // Calls f(key, value) for every entry.
+    template<typename F>
+    void for_each(F&& f) const {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (is_full(ctrl[i])) f(slots[i].first, slots[i].second);
+        }
+    }
+
+private:
+    using Slot = std::pair<Key, Value>;
+    static constexpr size_t NPOS = -1;
+
+    std::vector<int8_t> ctrl;
+    std::vector<Slot> slots;
+    size_t capacity = 0;
+    size_t count = 0;
+    size_t tombstones = 0;
+    uint64_t seed = process_seed();
+
+    uint64_t hash(const Key& key) const { return hash_bytes(key.data(), sizeof(Key), seed); }
+
+    size_t find_slot(const Key& key) const {
+        uint64_t key_hash = hash(key);
+        int8_t tag = h2(key_hash);
+        for (ProbeSeq seq(key_hash, capacity / GROUP_SIZE); ; seq.next()) {
+            Group group(&ctrl[seq.offset()]);
+            for (size_t bit : group.match(tag)) {
+                size_t i = seq.offset() + bit;
+                if (slots[i].first == key) return i;
+            }
+            if (group.match_empty()) return NPOS;
+        }
+    }
+
+    size_t find_free(uint64_t hash) const {
+        for (ProbeSeq seq(hash, capacity / GROUP_SIZE); ; seq.next()) {
+            if (BitMask free = Group(&ctrl[seq.offset()]).match_empty_or_deleted()) {
+                return seq.offset() + free.lowest();
+            }
+        }
+    }
+
+    void rehash(size_t new_capacity) {
+        std::vector<int8_t> previous_ctrl = std::exchange(ctrl, std::vector<int8_t>(new_capacity, EMPTY));
+        std::vector<Slot> previous_slots = std::exchange(slots, std::vector<Slot>(new_capacity));
+
+        capacity = new_capacity;
+        tombstones = 0;
+        for (size_t i = 0; i < previous_ctrl.size(); ++i) {
+            if (!is_full(previous_ctrl[i])) continue;
+            size_t j = find_free(hash(previous_slots[i].first));
+            ctrl[j] = previous_ctrl[i];
+            slots[j] = previous_slots[i];
+        }
+    }
+};
+
+}  // namespace flat
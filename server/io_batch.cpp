@@ -0,0 +1,194 @@
+#include "io_batch.hpp"
+#include "file_io.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+
+// Operations in flight per submission
+static constexpr unsigned IO_RING_ENTRIES = 64;
+
+static std::atomic<bool> io_uring_enabled = true;
+
+void IoBatch::use_io_uring(bool enabled) {
+    io_uring_enabled = enabled;
+}
+
+void IoBatch::read(int fd, void* buf, size_t size, uint64_t offset) {
+    ops.push_back({false, fd, static_cast<uint8_t*>(buf), size, offset});
+}
+
+void IoBatch::write(int fd, const void* buf, size_t size, uint64_t offset) {
+    ops.push_back({true, fd, const_cast<uint8_t*>(static_cast<const uint8_t*>(buf)), size, offset});
+}
+
+bool IoBatch::finish(const Op& op, size_t done) {
+    return op.write ? write_at(op.fd, op.buf + done, op.size - done, op.offset + done)
+                    : read_at(op.fd, op.buf + done, op.size - done, op.offset + done);
+}
+
+#ifdef HAVE_IO_URING
+
+// Submission and completion queues shared with the kernel, set up through the raw
+// system calls (no liburing).
+struct IoBatch::Ring {
+    int fd = -1;
+    unsigned entries = 0;
+
+    void* sq_map = MAP_FAILED;
+    void* cq_map = MAP_FAILED;
+    size_t sq_map_size = 0, cq_map_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+
+    unsigned *sq_tail = nullptr, *sq_array = nullptr, sq_mask = 0;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    Ring() = default;
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    ~Ring() {
+        if (sqes != MAP_FAILED) munmap(sqes, entries * sizeof(io_uring_sqe));
+        if (cq_map != MAP_FAILED && cq_map != sq_map) munmap(cq_map, cq_map_size);
+        if (sq_map != MAP_FAILED) munmap(sq_map, sq_map_size);
+        if (fd != -1) ::close(fd);
+    }
+
+    bool setup() {
+        io_uring_params params{};
+        fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+        if (fd < 0) {
+            fd = -1;
+            return false;
+        }
+        entries = params.sq_entries;
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_map) sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+
+        sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_map == MAP_FAILED) return false;
+        cq_map = single_map ? sq_map
+                            : mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED) return false;
+        void* sqes_map = mmap(nullptr, entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes_map == MAP_FAILED) return false;
+        sqes = static_cast<io_uring_sqe*>(sqes_map);
+
+        uint8_t* sq = static_cast<uint8_t*>(sq_map);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        uint8_t* cq = static_cast<uint8_t*>(cq_map);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Performs ops[first, first + count), count <= entries, and waits for all of them.
+    // NOTE: every completion is reaped even after a failure, the kernel may still be
+    // using the buffers of the others.
+    bool run(const std::vector<Op>& ops, size_t first, unsigned count) {
+        unsigned tail = std::atomic_ref<unsigned>(*sq_tail).load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < count; ++i, ++tail) {
+            const Op& op = ops[first + i];
+            unsigned slot = tail & sq_mask;
+            io_uring_sqe& sqe = sqes[slot];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = op.write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe.fd = op.fd;
+            sqe.addr = reinterpret_cast<uint64_t>(op.buf);
+            sqe.len = static_cast<uint32_t>(std::min<size_t>(op.size, 1u << 30));  // Short completions are finished below.
+            sqe.off = op.offset;
+            sqe.user_data = first + i;
+            sq_array[slot] = slot;
+        }
+        std::atomic_ref<unsigned>(*sq_tail).store(tail, std::memory_order_release);
+
+        bool ok = true;
+        unsigned to_submit = count, completed = 0;
+        while (completed < count) {
+            int r = syscall(__NR_io_uring_enter, fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (r >= 0) {
+                to_submit -= std::min<unsigned>(r, to_submit);
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                log_error("io_uring_enter failed", "error", std::strerror(errno));
+                // The entries not submitted yet are withdrawn, the others still waited for.
+                tail -= to_submit;
+                std::atomic_ref<unsigned>(*sq_tail).store(tail, std::memory_order_release);
+                count -= to_submit;
+                to_submit = 0;
+                ok = false;
+            }
+
+            unsigned head = std::atomic_ref<unsigned>(*cq_head).load(std::memory_order_relaxed);
+            unsigned ready = std::atomic_ref<unsigned>(*cq_tail).load(std::memory_order_acquire);
+            for (; head != ready; ++head, ++completed) {
+                const io_uring_cqe& cqe = cqes[head & cq_mask];
+                const Op& op = ops[cqe.user_data];
+                if (cqe.res <= 0 && op.size > 0) {
+                    ok = false;  // Failed (-errno) or end of file
+                } else if (static_cast<size_t>(cqe.res) < op.size) {
+                    ok = finish(op, cqe.res) && ok;
+                }
+            }
+            std::atomic_ref<unsigned>(*cq_head).store(head, std::memory_order_release);
+        }
+        return ok;
+    }
+};
+
+IoBatch::Ring* IoBatch::ring() {
+    thread_local std::unique_ptr<Ring> ring;
+    thread_local bool unavailable = false;
+    if (ring || unavailable) return ring.get();
+
+    auto created = std::make_unique<Ring>();
+    if (!created->setup()) {
+        static std::atomic<bool> reported = false;
+        if (!reported.exchange(true)) {
+            log_info("io_uring unavailable, using pread/pwrite", "error", std::strerror(errno));
+        }
+        unavailable = true;
+        return nullptr;
+    }
+    ring = std::move(created);
+    return ring.get();
+}
+
+#endif
+
+bool IoBatch::submit() {
+    bool ok = true;
+    size_t done = 0;
+#ifdef HAVE_IO_URING
+    if (Ring* r = io_uring_enabled ? ring() : nullptr) {
+        while (ok && done < ops.size()) {
+            unsigned count = std::min<size_t>(r->entries, ops.size() - done);
+            ok = r->run(ops, done, count);
+            done += count;
+        }
+    }
+#endif
+    for (; ok && done < ops.size(); ++done) ok = finish(ops[done], 0);
+
+    ops.clear();
+    return ok;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Positional reads and writes submitted together, so that the kernel keeps them all
+// in flight: through an io_uring of the calling thread when the kernel provides one,
+// else one pread/pwrite at a time.
+class IoBatch {
+public:
+    // Queues an operation of exactly size bytes. buf must stay valid until submit.
+    void read(int fd, void* buf, size_t size, uint64_t offset);
+    void write(int fd, const void* buf, size_t size, uint64_t offset);
+
+    size_t size() const { return ops.size(); }
+    bool empty() const { return ops.empty(); }
+
+    // Performs the queued operations, in no particular order, and clears the batch.
+    // Returns false if any of them failed.
+    bool submit();
+
+    // Whether the batches submitted afterwards may use io_uring (the default)
+    static void use_io_uring(bool enabled);
+
+private:
+    struct Op {
+        bool write;
+        int fd;
+        uint8_t* buf;
+        size_t size;
+        uint64_t offset;
+    };
+    struct Ring;
+
+    std::vector<Op> ops;
+
+    // Performs the rest of op, from done bytes, with pread/pwrite
+    static bool finish(const Op& op, size_t done);
+    // Returns the io_uring of the calling thread (nullptr if unavailable)
+    static Ring* ring();
+};
@@ -0,0 +1,202 @@
+#include "logger.hpp"
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+// Records written to the output at once
+static constexpr size_t FLUSH_BUFFER_SIZE = 64 << 10;
+// Wait of the background thread for new records
+static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(10);
+
+static constexpr std::string_view level_name(LogLevel level) {
+    switch (level) {
+        case LogLevel::debug: return "debug";
+        case LogLevel::info: return "info";
+        case LogLevel::warning: return "warning";
+        case LogLevel::error: return "error";
+        default: return "off";
+    }
+}
+
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() : ring(RING_SIZE), flusher([this] { run(); }) {}
+
+Logger::~Logger() {
+    stopping = true;
+    flusher.join();
+}
+
+void Logger::configure(LogLevel level, size_t records_per_second) {
+    min_level = level;
+    rate = records_per_second;
+}
+
+bool Logger::admit(LogLevel level) {
+    size_t limit = rate.load(std::memory_order_relaxed);
+    if (limit == 0 || level == LogLevel::error) return true;
+
+    uint64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    uint64_t current = window.load(std::memory_order_relaxed);
+    // The first record of a second opens its window.
+    if (current != second && window.compare_exchange_strong(current, second, std::memory_order_relaxed)) {
+        window_records.store(0, std::memory_order_relaxed);
+    }
+    if (window_records.fetch_add(1, std::memory_order_relaxed) < limit) return true;
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void Logger::push(Line& line) {
+    if (!ring.try_push(std::move(line))) dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Logger::run() {
+    std::string buffer;
+    buffer.reserve(FLUSH_BUFFER_SIZE);
+
+    auto flush = [&buffer] {
+        // NOTE: a failed write loses the records, there is nowhere to report it.
+        for (size_t written = 0; written < buffer.size(); ) {
+            ssize_t result = ::write(STDOUT_FILENO, buffer.data() + written, buffer.size() - written);
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) break;
+            written += result;
+        }
+        buffer.clear();
+    };
+
+    Line line;
+    for (;;) {
+        bool stop = stopping.load();
+        while (ring.try_pop(line)) {
+            if (buffer.size() + line.size > FLUSH_BUFFER_SIZE) flush();
+            buffer.append(line.text, line.size);
+        }
+        if (uint64_t lost = dropped.exchange(0, std::memory_order_relaxed); lost > 0) {
+            Line report(LogLevel::warning, "Log records dropped");
+            report.field("count", lost);
+            report.finish();
+            buffer.append(report.text, report.size);
+        }
+        flush();
+
+        // Records pushed before stopping was set are written on the last turn.
+        if (stop) return;
+        std::this_thread::sleep_for(FLUSH_INTERVAL);
+    }
+}
+
+Logger::Line::Line(LogLevel level, std::string_view msg) {
+    uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    raw("{\"ts\":");
+    char digits[24];
+    raw(std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), now).ptr - digits));
+    raw(",\"level\":\"");
+    raw(level_name(level));
+    raw("\",\"msg\":");
+    string(msg);
+}
+
+void Logger::Line::raw(std::string_view data) {
+    if (full) return;
+    if (data.size() > LINE_SIZE - TAIL - size) {
+        full = true;
+        return;
+    }
+    std::memcpy(text + size, data.data(), data.size());
+    size += data.size();
+}
+
+void Logger::Line::string(std::string_view value) {
+    raw("\"");
+    for (char c : value) {
+        if (full) return;
+        char escaped[6] = {'\\', c};
+        size_t length = 2;
+        if (c == '"' || c == '\\') {
+        } else if (c == '\n') {
+            escaped[1] = 'n';
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            static constexpr char hex[] = "0123456789abcdef";
+            std::memcpy(escaped + 1, "u00", 3);
+            escaped[4] = hex[c >> 4];
+            escaped[5] = hex[c & 0xf];
+            length = 6;
+        } else {
+            escaped[0] = c;
+            length = 1;
+        }
+        // Truncated: the string is closed by finish(), without a partial UTF-8 character.
+        if (length > LINE_SIZE - TAIL - size) {
+            while (static_cast<unsigned char>(text[size - 1]) >= 0x80) --size;
+            full = true;
+            in_string = true;
+            return;
+        }
+        std::memcpy(text + size, escaped, length);
+        size += length;
+    }
+    raw("\"");
+}
+
+// Starts a field, false if its key doesn't fit
+bool Logger::Line::key(std::string_view name) {
+    if (full) return false;
+    uint32_t start = size;
+    raw(",");
+    string(name);
+    raw(":");
+    if (full) {
+        size = start;
+        in_string = false;
+    }
+    return !full;
+}
+
+void Logger::Line::number(std::string_view name, std::string_view digits) {
+    uint32_t start = size;
+    if (!key(name)) return;
+    raw(digits);
+    if (full) size = start;
+}
+
+void Logger::Line::field(std::string_view name, std::string_view value) {
+    if (key(name)) string(value);
+}
+
+void Logger::Line::field(std::string_view name, bool value) {
+    number(name, value ? "true" : "false");
+}
+
+void Logger::Line::field(std::string_view name, double value) {
+    char digits[32];
+    number(name, std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr - digits));
+}
+
+void Logger::Line::field_int(std::string_view name, int64_t value) {
+    char digits[24];
+    number(name, std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr - digits));
+}
+
+void Logger::Line::field_uint(std::string_view name, uint64_t value) {
+    char digits[24];
+    number(name, std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr - digits));
+}
+
+void Logger::Line::finish() {
+    if (in_string) {
+        text[size++] = '"';
+        in_string = false;
+    }
+    text[size++] = '}';
+    text[size++] = '\n';
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "mpmc_queue.hpp"
+
+enum class LogLevel : uint8_t { debug, info, warning, error, off };
+
+// Asynchronous structured logger: every record is a JSON line
+//   {"ts":<microseconds since the epoch>,"level":"info","msg":"...",<field>:<value>,...}
+// formatted by the caller into a fixed-size slot of a lock-free ring, and written to
+// the standard output in batches by a background thread: the threads serving the
+// requests never wait for the terminal or the journal. A disabled level costs a
+// relaxed load. When the ring is full, or over the rate limit (records per second,
+// errors excepted), the records are dropped and counted.
+class Logger {
+public:
+    // Longest record, the longer ones are truncated
+    static constexpr size_t LINE_SIZE = 512;
+    // Records waiting for the background thread
+    static constexpr size_t RING_SIZE = 1 << 12;
+
+    static Logger& instance();
+
+    // rate: records per second, 0: no limit
+    void configure(LogLevel level, size_t rate);
+
+    static bool enabled(LogLevel level) { return level >= min_level.load(std::memory_order_relaxed); }
+
+    // Logs msg with the fields, given as key-value pairs.
+    template<typename... Fields>
+    void write(LogLevel level, std::string_view msg, const Fields&... fields);
+
+    // Writes the records queued, then stops the background thread.
+    ~Logger();
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    // Formats a record, whose end is always written: a string reaching the end is
+    // truncated, the fields after it are left out.
+    class Line {
+    public:
+        Line() = default;
+        Line(LogLevel level, std::string_view msg);
+        void field(std::string_view key, std::string_view value);
+        void field(std::string_view key, const std::string& value) { field(key, std::string_view(value)); }
+        void field(std::string_view key, const char* value) { field(key, std::string_view(value)); }
+        void field(std::string_view key, const std::filesystem::path& value) { field(key, value.native()); }
+        void field(std::string_view key, bool value);
+        void field(std::string_view key, double value);
+        void field(std::string_view key, std::signed_integral auto value) { field_int(key, value); }
+        void field(std::string_view key, std::unsigned_integral auto value) { field_uint(key, value); }
+        void finish();
+
+    private:
+        friend class Logger;
+        // Room kept for the end of the record: "\"}\n"
+        static constexpr size_t TAIL = 3;
+
+        uint32_t size = 0;
+        bool full = false;       // Nothing more fits
+        bool in_string = false;  // Truncated in a string, closed by finish()
+        char text[LINE_SIZE];
+
+        void raw(std::string_view data);
+        void string(std::string_view value);
+        bool key(std::string_view key);
+        void number(std::string_view key, std::string_view digits);
+        void field_int(std::string_view key, int64_t value);
+        void field_uint(std::string_view key, uint64_t value);
+    };
+
+private:
+    Logger();
+
+    static inline std::atomic<LogLevel> min_level = LogLevel::info;
+
+    MpmcQueue<Line> ring;
+    std::atomic<uint64_t> dropped = 0;
+
+    // Rate limit: records of the current second
+    std::atomic<size_t> rate = 0;
+    std::atomic<uint64_t> window = 0;
+    std::atomic<size_t> window_records = 0;
+
+    std::atomic<bool> stopping = false;
+    std::thread flusher;
+
+    bool admit(LogLevel level);
+    void push(Line& line);
+    void run();
+};
+
+template<typename... Fields>
+void Logger::write(LogLevel level, std::string_view msg, const Fields&... fields) {
+    static_assert(sizeof...(Fields) % 2 == 0, "fields are key-value pairs");
+    if (!admit(level)) return;
+
+    Line line(level, msg);
+    // Pairs up the arguments.
+    auto pairs = [&line](auto&& self, std::string_view key, const auto& value, const auto&... rest) -> void {
+        line.field(key, value);
+        if constexpr (sizeof...(rest) > 0) self(self, rest...);
+    };
+    if constexpr (sizeof...(Fields) > 0) pairs(pairs, fields...);
+    line.finish();
+    push(line);
+}
+
+template<typename... Fields>
+inline void log_debug(std::string_view msg, const Fields&... fields) {
+    if (Logger::enabled(LogLevel::debug)) Logger::instance().write(LogLevel::debug, msg, fields...);
+}
+
+template<typename... Fields>
+inline void log_info(std::string_view msg, const Fields&... fields) {
+    if (Logger::enabled(LogLevel::info)) Logger::instance().write(LogLevel::info, msg, fields...);
+}
+
+template<typename... Fields>
+inline void log_warning(std::string_view msg, const Fields&... fields) {
+    if (Logger::enabled(LogLevel::warning)) Logger::instance().write(LogLevel::warning, msg, fields...);
+}
+
+template<typename... Fields>
+inline void log_error(std::string_view msg, const Fields&... fields) {
+    if (Logger::enabled(LogLevel::error)) Logger::instance().write(LogLevel::error, msg, fields...);
+}
@@ -1,5 +1,8 @@
 #include "protocol.hpp"
 #include "server.hpp"
+#include "config.hpp"
+#include "logger.hpp"
+#include "trace.hpp"
 #include <cstdlib>
 #include <utility>
 #include <functional>
@@ -10,21 +13,39 @@
 
 DSSEServer* server_instance = nullptr;
 
+static LogLevel parse_log_level(const std::string& level) {
+    if (level == "debug") return LogLevel::debug;
+    if (level == "warning") return LogLevel::warning;
+    if (level == "error") return LogLevel::error;
+    if (level == "off") return LogLevel::off;
+    return LogLevel::info;
+}
+
 // Gracefully handle SIGINT (Ctrl+C) to stop the server
 void handle_signal([[maybe_unused]] int signal) {
     if (server_instance) {
-        std::cout << "\n[!] Shutting down DSSE Server...\n";
+        log_info("Shutting down DSSE Server");
         delete server_instance;
         server_instance = nullptr;
         exit(0);
     }
 }
 
-int main() {
-    std::string storage_path = "storage";  // Storage directory for user data
+int main(int argc, const char **argv) {
+    ServerConfig config;
+
+    try {
+        config = parse_config(argc, argv);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << "[ERROR] " << e.what() << ".\n";
+        return EXIT_FAILURE;
+    }
+
+    Logger::instance().configure(parse_log_level(config.log_level), config.log_rate);
+    Tracer::instance().configure(config.trace_spans);
 
-    std::cout << "[+] Initializing DSSE Server...\n";
-    server_instance = new DSSEServer(storage_path);
+    log_info("Initializing DSSE Server");
+    server_instance = new DSSEServer(config);
 
     // Handle Ctrl+C to allow clean exit
     signal(SIGINT, handle_signal);
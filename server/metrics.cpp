@@ -0,0 +1,166 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <charconv>
+
+// Bucket bounds of the exported histograms, in seconds
+static constexpr double EXPORT_BOUNDS[] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+static constexpr double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+static constexpr std::string_view OP_NAMES[] = {"update", "search", "finalize", "fetch"};
+static constexpr std::string_view PHASE_NAMES[] = {"receive", "se_load", "chain_walk", "sr_rewrite", "send"};
+static constexpr std::string_view OUTCOME_NAMES[] = {"ok", "failed", "busy"};
+
+uint64_t Histogram::upper_bound(size_t bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    uint64_t lower = (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return lower + ((uint64_t(1) << shift) - 1);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot result;
+    // NOTE: taken while recording, count and sum may be slightly off the buckets.
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        result.counts[i] = counts[i].load(std::memory_order_relaxed);
+    }
+    result.count = count.load(std::memory_order_relaxed);
+    result.sum = sum.load(std::memory_order_relaxed);
+    return result;
+}
+
+uint64_t Histogram::Snapshot::count_up_to(uint64_t limit) const {
+    uint64_t result = 0;
+    for (size_t i = 0; i < BUCKETS && upper_bound(i) <= limit; ++i) {
+        result += counts[i];
+    }
+    return result;
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const {
+    uint64_t total = 0;
+    for (uint64_t c : counts) total += c;
+    if (total == 0) return 0;
+
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * total + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) return upper_bound(i);
+    }
+    return upper_bound(BUCKETS - 1);
+}
+
+Metrics& Metrics::instance() {
+    static Metrics metrics;
+    return metrics;
+}
+
+void Metrics::request(MetricOp op, Outcome outcome, uint64_t ns) {
+    outcomes[index(op)][index(outcome)].fetch_add(1, std::memory_order_relaxed);
+    if (outcome != Outcome::busy) durations[index(op)].record(ns);
+}
+
+// Histogram of durations in nanoseconds, exported in seconds
+static void append_histogram(std::string& out, std::string_view name, const std::string& labels,
+                             const Histogram::Snapshot& snapshot) {
+    std::string prefix = labels.empty() ? "" : labels + ",";
+    std::string bucket = std::string(name) + "_bucket";
+    for (double bound : EXPORT_BOUNDS) {
+        char digits[32];
+        std::string_view le(digits, std::to_chars(digits, digits + sizeof(digits), bound).ptr - digits);
+        append_sample(out, bucket, prefix + "le=\"" + std::string(le) + "\"",
+                      snapshot.count_up_to(static_cast<uint64_t>(bound * 1e9)));
+    }
+    append_sample(out, bucket, prefix + "le=\"+Inf\"", snapshot.count);
+    append_sample(out, std::string(name) + "_sum", labels, snapshot.sum / 1e9);
+    append_sample(out, std::string(name) + "_count", labels, snapshot.count);
+}
+
+static void append_quantiles(std::string& out, std::string_view name, const std::string& labels,
+                             const Histogram::Snapshot& snapshot) {
+    for (double q : QUANTILES) {
+        char digits[32];
+        std::string_view quantile(digits, std::to_chars(digits, digits + sizeof(digits), q).ptr - digits);
+        append_sample(out, name, labels + ",quantile=\"" + std::string(quantile) + "\"",
+                      snapshot.quantile(q) / 1e9);
+    }
+}
+
+void Metrics::render(std::string& out) const {
+    std::array<Histogram::Snapshot, OPS> requests;
+    for (size_t op = 0; op < OPS; ++op) requests[op] = durations[op].snapshot();
+
+    append_family(out, "dsse_request_duration_seconds", "histogram", "Duration of the requests served");
+    for (size_t op = 0; op < OPS; ++op) {
+        append_histogram(out, "dsse_request_duration_seconds", "op=\"" + std::string(OP_NAMES[op]) + "\"",
+                         requests[op]);
+    }
+    append_family(out, "dsse_request_duration_quantile_seconds", "gauge",
+                  "Quantiles of the duration of the requests, within 1/8 of the value");
+    for (size_t op = 0; op < OPS; ++op) {
+        append_quantiles(out, "dsse_request_duration_quantile_seconds",
+                         "op=\"" + std::string(OP_NAMES[op]) + "\"", requests[op]);
+    }
+
+    // Only the phases of each kind of request
+    append_family(out, "dsse_phase_duration_seconds", "histogram", "Duration of the phases of the requests");
+    for (size_t op = 0; op < OPS; ++op) {
+        for (size_t phase = 0; phase < PHASES; ++phase) {
+            Histogram::Snapshot snapshot = phases[op][phase].snapshot();
+            if (snapshot.count == 0) continue;
+            append_histogram(out, "dsse_phase_duration_seconds",
+                             "op=\"" + std::string(OP_NAMES[op]) + "\",phase=\"" + std::string(PHASE_NAMES[phase]) + "\"",
+                             snapshot);
+        }
+    }
+
+    append_family(out, "dsse_requests_total", "counter", "Requests by outcome");
+    for (size_t op = 0; op < OPS; ++op) {
+        for (size_t outcome = 0; outcome < OUTCOMES; ++outcome) {
+            append_sample(out, "dsse_requests_total",
+                          "op=\"" + std::string(OP_NAMES[op]) + "\",outcome=\"" + std::string(OUTCOME_NAMES[outcome]) + "\"",
+                          outcomes[op][outcome].load(std::memory_order_relaxed));
+        }
+    }
+    append_family(out, "dsse_received_bytes_total", "counter", "Bytes of the requests");
+    for (size_t op = 0; op < OPS; ++op) {
+        append_sample(out, "dsse_received_bytes_total", "op=\"" + std::string(OP_NAMES[op]) + "\"",
+                      received_bytes[op].load(std::memory_order_relaxed));
+    }
+    append_family(out, "dsse_sent_bytes_total", "counter", "Bytes of the responses");
+    for (size_t op = 0; op < OPS; ++op) {
+        append_sample(out, "dsse_sent_bytes_total", "op=\"" + std::string(OP_NAMES[op]) + "\"",
+                      sent_bytes[op].load(std::memory_order_relaxed));
+    }
+}
+
+void append_family(std::string& out, std::string_view name, std::string_view type, std::string_view help) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void append_sample(std::string& out, std::string_view name, std::string_view labels, double value) {
+    out.append(name);
+    if (!labels.empty()) out.append("{").append(labels).append("}");
+    char digits[32];
+    out.append(" ").append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+    out.append("\n");
+}
+
+std::string label_value(std::string_view value) {
+    std::string result;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            result += '\\';
+            result += c;
+        } else if (c == '\n') {
+            result += "\\n";
+        } else {
+            result += c;
+        }
+    }
+    return result;
+}
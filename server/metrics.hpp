@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Kinds of request, phases of a request and their outcomes: the labels of the metrics
+enum class MetricOp : uint8_t { update, search, finalize, fetch };
+enum class Phase : uint8_t {
+    receive,     // Reading the request from the socket
+    se_load,     // Getting the user's indexes (loaded from the disk on a cache miss)
+    chain_walk,  // Walking the epochs of the keyword in Se
+    sr_rewrite,  // Storing the results in Sr
+    send,        // Writing the response to the socket
+};
+enum class Outcome : uint8_t { ok, failed, busy };
+
+// Time elapsed since its creation
+struct Stopwatch {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    uint64_t elapsed_ns() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+// Histogram with log-linear buckets (HDR-style): SUB_BUCKETS buckets per power of two,
+// so the bucket of a value is within 1/SUB_BUCKETS of it over the whole range.
+// Recording is three relaxed atomic additions, the buckets are read without stopping it.
+class Histogram {
+public:
+    static constexpr unsigned SUB_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    void record(uint64_t value) {
+        counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // The values below SUB_BUCKETS have a bucket each, then every power of two is split
+    // in SUB_BUCKETS.
+    static size_t bucket_of(uint64_t value) {
+        if (value < SUB_BUCKETS) return value;
+        unsigned shift = 63 - std::countl_zero(value) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+    // Largest value of a bucket
+    static uint64_t upper_bound(size_t bucket);
+
+    struct Snapshot {
+        std::array<uint64_t, BUCKETS> counts;
+        uint64_t count = 0;
+        uint64_t sum = 0;
+
+        // Values up to limit
+        uint64_t count_up_to(uint64_t limit) const;
+        // Upper bound of the bucket of the q-quantile
+        uint64_t quantile(double q) const;
+    };
+    Snapshot snapshot() const;
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> sum = 0;
+};
+
+// Metrics of the requests, in the Prometheus text format (render): the durations of
+// the requests and of their phases (nanoseconds, exported in seconds), the requests
+// by outcome and the bytes received and sent, per kind of request.
+class Metrics {
+public:
+    static Metrics& instance();
+
+    // Counts a request, and times it unless it was refused (busy)
+    void request(MetricOp op, Outcome outcome, uint64_t ns);
+    void phase(MetricOp op, Phase phase, uint64_t ns) { phases[index(op)][index(phase)].record(ns); }
+    void received(MetricOp op, uint64_t bytes) { received_bytes[index(op)].fetch_add(bytes, std::memory_order_relaxed); }
+    void sent(MetricOp op, uint64_t bytes) { sent_bytes[index(op)].fetch_add(bytes, std::memory_order_relaxed); }
+
+    void render(std::string& out) const;
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+private:
+    static constexpr size_t OPS = 4;
+    static constexpr size_t PHASES = 5;
+    static constexpr size_t OUTCOMES = 3;
+
+    Metrics() = default;
+
+    template<typename E>
+    static size_t index(E value) { return static_cast<size_t>(value); }
+
+    std::array<Histogram, OPS> durations;
+    std::array<std::array<Histogram, PHASES>, OPS> phases;
+    std::array<std::array<std::atomic<uint64_t>, OUTCOMES>, OPS> outcomes{};
+    std::array<std::atomic<uint64_t>, OPS> received_bytes{};
+    std::array<std::atomic<uint64_t>, OPS> sent_bytes{};
+};
+
+// Records a request: when it succeeds or is refused, otherwise as failed when it ends
+class RequestTimer {
+public:
+    explicit RequestTimer(MetricOp op) : op(op) {}
+    ~RequestTimer() { record(Outcome::failed); }
+
+    RequestTimer(const RequestTimer&) = delete;
+    RequestTimer& operator=(const RequestTimer&) = delete;
+
+    void succeed() { record(Outcome::ok); }
+    void refuse() { record(Outcome::busy); }
+
+private:
+    MetricOp op;
+    bool recorded = false;
+    Stopwatch watch;
+
+    void record(Outcome outcome) {
+        if (recorded) return;
+        recorded = true;
+        Metrics::instance().request(op, outcome, watch.elapsed_ns());
+    }
+};
+
+// Helpers writing the Prometheus text format
+void append_family(std::string& out, std::string_view name, std::string_view type, std::string_view help);
+// labels: `name="value",...` (values escaped with label_value), or empty
+void append_sample(std::string& out, std::string_view name, std::string_view labels, double value);
+std::string label_value(std::string_view value);
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <thread>
+#include <utility>
+
+// Bounded lock-free multi-producer multi-consumer queue (Vyukov's array queue).
+// Every cell carries a sequence number telling whether it is ready to be pushed
+// to or popped from at a given position: producers and consumers each claim a
+// position with a single CAS and never wait for each other, except for the
+// cell they claimed.
+template<typename T>
+class MpmcQueue {
+public:
+    // capacity is rounded up to a power of two.
+    explicit MpmcQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        mask = size - 1;
+        cells = std::make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+    size_t capacity() const { return mask + 1; }
+
+    // Returns false if the queue is full (value is then left untouched).
+    bool try_push(T&& value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // The cell still holds the value pushed a lap earlier.
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Returns false if the queue is empty.
+    bool try_pop(T& value) {
+        size_t position = head.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // The cell was not pushed to yet.
+            } else {
+                position = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    // NOTE: cells, head and tail are kept on separate cache lines, producers and
+    // consumers don't invalidate each other's.
+    static constexpr size_t LINE = 64;
+
+    struct alignas(LINE) Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    alignas(LINE) std::atomic<size_t> tail = 0;  // Next position pushed to
+    alignas(LINE) std::atomic<size_t> head = 0;  // Next position popped from
+};
+
+// Two MpmcQueues, urgent and bulk, whose push waits while its queue is full and
+// pop while both are empty. pop takes the urgent values first, but no more than
+// URGENT_BURST in a row while bulk values wait: the bulk ones are delayed, never starved.
+// The waits are on semaphores counting the free cells of each queue and the filled
+// cells of both: the queues themselves are only touched once a cell is guaranteed.
+// The producers that must never wait push_overflow: past the capacity their values
+// are kept in unbounded lists, popped before the queues.
+template<typename T>
+class BlockingPriorityQueue {
+public:
+    static constexpr unsigned URGENT_BURST = 16;
+
+    explicit BlockingPriorityQueue(size_t capacity)
+        : urgent(capacity), bulk(capacity),
+          free_urgent(urgent.capacity()), free_bulk(bulk.capacity()), filled_cells(0) {}
+
+    void push(T value, bool is_urgent) {
+        MpmcQueue<T>& queue = is_urgent ? urgent : bulk;
+        std::counting_semaphore<>& free_cells = is_urgent ? free_urgent : free_bulk;
+        free_cells.acquire();
+        while (!queue.try_push(std::move(value))) std::this_thread::yield();
+        filled_cells.release();
+    }
+
+    // Like push, without waiting when the queue is full.
+    void push_overflow(T value, bool is_urgent) {
+        MpmcQueue<T>& queue = is_urgent ? urgent : bulk;
+        std::counting_semaphore<>& free_cells = is_urgent ? free_urgent : free_bulk;
+        if (free_cells.try_acquire()) {
+            while (!queue.try_push(std::move(value))) std::this_thread::yield();
+        } else {
+            std::lock_guard lock(overflow_mutex);
+            (is_urgent ? overflow_urgent : overflow_bulk).push_back(std::move(value));
+            overflowed.fetch_add(1, std::memory_order_release);
+        }
+        filled_cells.release();
+    }
+
+    T pop() {
+        filled_cells.acquire();
+        // A cell is filled, but an earlier position may still be being pushed to.
+        T value;
+        for (;;) {
+            bool bulk_turn = streak.load(std::memory_order_relaxed) >= URGENT_BURST;
+            // The overflowed values were pushed while the queues were full: older
+            // than most of their values.
+            if (overflowed.load(std::memory_order_acquire) > 0 && pop_overflow(value, bulk_turn)) return value;
+            if (!bulk_turn && urgent.try_pop(value)) {
+                streak.fetch_add(1, std::memory_order_relaxed);
+                free_urgent.release();
+                return value;
+            }
+            if (bulk.try_pop(value)) {
+                streak.store(0, std::memory_order_relaxed);
+                free_bulk.release();
+                return value;
+            }
+            if (bulk_turn && urgent.try_pop(value)) {
+                free_urgent.release();
+                return value;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    MpmcQueue<T> urgent;
+    MpmcQueue<T> bulk;
+    std::counting_semaphore<> free_urgent;
+    std::counting_semaphore<> free_bulk;
+    std::counting_semaphore<> filled_cells;
+    std::atomic<unsigned> streak = 0;  // Urgent values popped since the last bulk one
+
+    std::mutex overflow_mutex;
+    std::deque<T> overflow_urgent;
+    std::deque<T> overflow_bulk;
+    std::atomic<size_t> overflowed = 0;  // Values in the overflow lists
+
+    bool pop_overflow(T& value, bool bulk_turn) {
+        std::lock_guard lock(overflow_mutex);
+        bool take_urgent = !overflow_urgent.empty() && (!bulk_turn || overflow_bulk.empty());
+        std::deque<T>& list = take_urgent ? overflow_urgent : overflow_bulk;
+        if (list.empty()) return false;
+        value = std::move(list.front());
+        list.pop_front();
+        overflowed.fetch_sub(1, std::memory_order_relaxed);
+        if (take_urgent) {
+            streak.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            streak.store(0, std::memory_order_relaxed);
+        }
+        return true;
+    }
+};
@@ -0,0 +1,112 @@
+#include "posting_list.hpp"
+#include <algorithm>
+
+namespace posting_list {
+
+static uint8_t* put_varint(uint32_t value, uint8_t* out) {
+    while (value >= 0x80) {
+        *out++ = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
+
+static size_t varint_size(uint32_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+static bool get_varint(const uint8_t*& data, const uint8_t* end, uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 35 && data != end; shift += 7) {
+        uint8_t byte = *data++;
+        if (shift == 28 && byte > 0x0f) return false;  // Beyond 32 bits
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+void encode(const std::vector<uint32_t>& ordinals, std::vector<uint8_t>& out) {
+    size_t array_size = 1 + varint_size(ordinals.size());
+    for (size_t i = 0; i < ordinals.size(); ++i) array_size += varint_size(ordinals[i] - (i ? ordinals[i - 1] : 0));
+
+    if (!ordinals.empty()) {
+        uint32_t first = ordinals.front();
+        size_t bitmap_size = 1 + varint_size(first) + (static_cast<size_t>(ordinals.back() - first) / 8 + 1);
+        if (bitmap_size < array_size) {
+            size_t start = out.size();
+            out.resize(start + bitmap_size);
+            out[start] = BITMAP;
+            uint8_t* bits = put_varint(first, out.data() + start + 1);
+            for (uint32_t ordinal : ordinals) bits[(ordinal - first) / 8] |= 1 << ((ordinal - first) % 8);
+            return;
+        }
+    }
+
+    size_t start = out.size();
+    out.resize(start + array_size);
+    out[start] = ARRAY;
+    uint8_t* next = put_varint(ordinals.size(), out.data() + start + 1);
+    for (size_t i = 0; i < ordinals.size(); ++i) next = put_varint(ordinals[i] - (i ? ordinals[i - 1] : 0), next);
+}
+
+void sort(std::vector<uint32_t>& ordinals, uint32_t limit) {
+    // A bitmap costs a scan of limit bits, a comparison sort about log2(size)
+    // comparisons per ordinal, each far slower than the scan of a bit.
+    if (ordinals.size() < limit / 1024) {
+        std::sort(ordinals.begin(), ordinals.end());
+        ordinals.erase(std::unique(ordinals.begin(), ordinals.end()), ordinals.end());
+        return;
+    }
+
+    std::vector<uint64_t> bits(limit / 64 + 1);
+    for (uint32_t ordinal : ordinals) bits[ordinal / 64] |= uint64_t(1) << (ordinal % 64);
+    ordinals.clear();
+    for (size_t word = 0; word < bits.size(); ++word) {
+        for (uint64_t w = bits[word]; w; w &= w - 1) ordinals.push_back(word * 64 + __builtin_ctzll(w));
+    }
+}
+
+bool decode(const uint8_t* data, size_t size, std::vector<uint32_t>& ordinals) {
+    ordinals.clear();
+    if (size == 0) return false;
+    const uint8_t* end = data + size;
+    uint8_t kind = *data++;
+
+    if (kind == ARRAY) {
+        uint32_t count;
+        if (!get_varint(data, end, count) || count > static_cast<size_t>(end - data)) return false;
+        ordinals.reserve(count);
+        uint64_t ordinal = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t gap;
+            if (!get_varint(data, end, gap) || (i > 0 && gap == 0)) return false;
+            ordinal += gap;
+            if (ordinal > UINT32_MAX) return false;
+            ordinals.push_back(static_cast<uint32_t>(ordinal));
+        }
+        return data == end;
+    }
+
+    if (kind == BITMAP) {
+        uint32_t first;
+        if (!get_varint(data, end, first)) return false;
+        for (uint64_t position = 0; data != end; ++data, position += 8) {
+            for (uint8_t bits = *data; bits; bits &= bits - 1) {
+                uint64_t ordinal = first + position + __builtin_ctz(bits);
+                if (ordinal > UINT32_MAX) return false;
+                ordinals.push_back(static_cast<uint32_t>(ordinal));
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Compressed posting lists: the sorted ordinals of the documents of a keyword in Sr
+// (see UuidDictionary), encoded as the smaller of
+// - ARRAY || count || gaps: varints (LEB128), each ordinal minus the previous one
+//   (the first from 0)
+// - BITMAP || first || bits: first as a varint, then a bit for each ordinal from
+//   first on (least significant first)
+// Dense lists take about a bit per document of the range, sparse ones a few bytes
+// per document, instead of 16 bytes per UUID.
+namespace posting_list {
+
+constexpr uint8_t ARRAY = 0;
+constexpr uint8_t BITMAP = 1;
+
+// Appends the encoding of ordinals (sorted, without duplicates) to out
+void encode(const std::vector<uint32_t>& ordinals, std::vector<uint8_t>& out);
+
+// Sorts ordinals (all below limit) and drops the duplicates. The long lists are
+// sorted through a bitmap of [0, limit).
+void sort(std::vector<uint32_t>& ordinals, uint32_t limit);
+
+// Decodes a list into ordinals. Returns false if it is malformed.
+bool decode(const uint8_t* data, size_t size, std::vector<uint32_t>& ordinals);
+
+}
@@ -1,19 +1,37 @@
 #include "protocol.hpp"
-#include <fstream>
-#include <iostream>
-#include <sstream>
-#include <iomanip>
-#include <unordered_map>
+#include "io_batch.hpp"
+#include "posting_list.hpp"
+#include "storage_engine.hpp"
+#include <condition_variable>
 #include <cstring>
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <Monocypher.hh>
+#include "blake2b_batch.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 
 namespace fs = std::filesystem;
 
-DSSEProtocol::DSSEProtocol(const fs::path& base_storage_path) 
-    : storage_path(base_storage_path) {
+DSSEProtocol::DSSEProtocol(const ServerConfig& config)
+    : storage_path(config.storage_path),
+      commit_window(config.commit_window),
+      cache(config.cache_budget, [this](const std::string& user_id) { return load_user_index(user_id); }),
+      search_pool(config.search_threads) {
+    // The engine must be chosen before any index is opened.
+    StorageEngine::use(config.storage_engine);
+    IoBatch::use_io_uring(config.io_uring);
+
     // Ensure base storage directory exists
-    fs::create_directories(storage_path);
+    std::error_code ec;
+    StorageEngine::instance().create_directories(storage_path, ec);
+    if (ec) log_error("Cannot create storage directory", "path", storage_path, "error", ec.message());
+
+    compactor = std::jthread([this](std::stop_token stop) { compaction_loop(stop); });
 }
 
 // Check if a string is a valid filename (to prevent directory traversal)
@@ -31,422 +49,896 @@ bool DSSEProtocol::create_user_directory(const std::string& user_id) {
 
     // Ensure the user_id is safe
     if (!is_valid_filename(user_id)) {
-        std::cerr << "[ERROR] Invalid user_id format.\n";
+        log_error("Invalid user_id format");
+        return false;
+    }
+
+    // Create the directory if it doesn't exist (the index files are created when first opened).
+    std::error_code ec;
+    StorageEngine::instance().create_directories(user_dir, ec);
+    if (ec) {
+        log_error("Failed to create user directory", "user", user_id);
+        return false;
+    }
+    return true;
+}
+
+// Open the user's Se table, importing the legacy flat Se.enc file if present
+bool DSSEProtocol::open_se_table(const std::string& user_id, SeTable& table) {
+    fs::path user_dir = storage_path / user_id;
+    fs::path legacy_path = user_dir / "Se.enc";
+
+    if (!table.open(user_dir / "Se.tbl")) return false;
+
+    std::error_code ec;
+    if (!StorageEngine::instance().exists(legacy_path, ec)) return true;
+
+    std::vector<uint8_t> legacy;
+    if (!StorageEngine::instance().read_file(legacy_path, legacy)) {
+        log_error("Failed to open legacy Se file");
         return false;
     }
 
-    // If directory doesn't exist, create it securely
-    if (!fs::exists(user_dir)) {
-        if (!fs::create_directory(user_dir)) {
-            std::cerr << "[ERROR] Failed to create user directory: " << user_id << "\n";
+    // A partial trailing entry is dropped.
+    for (size_t i = 0; i + SeTable::ENTRY_SIZE <= legacy.size(); i += SeTable::ENTRY_SIZE) {
+        if (!table.insert(legacy.data() + i, legacy.data() + i + SeTable::KEY_SIZE)) return false;
+    }
+
+    // The imported entries must be durable before the legacy file is removed.
+    if (!table.sync()) return false;
+    StorageEngine::instance().remove(legacy_path, ec);
+    log_info("Imported legacy Se file", "user", user_id);
+    return true;
+}
+
+// Open the user's Sr log and UUID dictionary, importing the legacy Sr.enc file
+// (UUIDs in the values) if present
+bool DSSEProtocol::open_sr_log(const std::string& user_id, UserIndex& index) {
+    fs::path user_dir = storage_path / user_id;
+    fs::path legacy_path = user_dir / "Sr.enc";
+
+    if (!index.ids.open(user_dir / "Sr.ids") || !index.sr.open(user_dir / "Sr.log")) return false;
+
+    std::error_code ec;
+    if (!StorageEngine::instance().exists(legacy_path, ec)) return true;
+
+    // The latest record of each tw is imported.
+    SrLog legacy;
+    if (!legacy.open(legacy_path)) return false;
+    std::vector<uint8_t> value;
+    for (const SrLog::Key& tw : legacy.keys()) {
+        if (!legacy.get(tw.data(), value)) return false;
+        if (value.size() < sizeof(uint64_t)) continue;  // Never read by the searches
+        if (!index.put_sr_uuids(tw.data(), value.data(), value.size())) {
+            log_error("Failed to import legacy Sr file", "user", user_id);
             return false;
         }
+    }
+    legacy.close();
 
-        // Initialize Se and Sr files
-        std::ofstream se_file(user_dir / "Se.enc", std::ios::binary | std::ios::trunc);
-        if (!se_file) {
-            std::cerr << "[ERROR] Failed to create Se file.\n";
-            se_file.close();
+    // The imported records must be durable before the legacy file is removed.
+    if (!index.ids.sync() || !index.sr.sync()) return false;
+    StorageEngine::instance().remove(legacy_path, ec);
+    log_info("Imported legacy Sr file", "user", user_id, "keywords", index.sr.size());
+    return true;
+}
+
+// Open the user's document store, importing the legacy per-document files if present
+bool DSSEProtocol::open_doc_store(const std::string& user_id, DocStore& store) {
+    fs::path user_dir = storage_path / user_id;
+    if (!store.open(user_dir / "docs")) return false;
+
+    // Legacy files: <UUID hex>.enc, holding UUID(128) + length(64) + document(length) records
+    std::vector<fs::path> legacy_paths;
+    std::error_code ec;
+    for (const fs::path& path : StorageEngine::instance().list(user_dir, ec)) {
+        std::string stem = path.stem().string();
+        if (path.extension() == ".enc" && stem.size() == 32 && std::all_of(stem.begin(), stem.end(), ::isxdigit)) {
+            legacy_paths.push_back(path);
+        }
+    }
+    if (legacy_paths.empty()) return true;
+
+    // The files are imported in batches of about LEGACY_IMPORT_BATCH bytes.
+    std::vector<uint8_t> batch, content;
+    size_t imported = 0;
+    for (size_t i = 0; i < legacy_paths.size(); ++i) {
+        if (!StorageEngine::instance().read_file(legacy_paths[i], content)) {
+            log_error("Failed to read legacy document", "path", legacy_paths[i]);
             return false;
         }
+        batch.insert(batch.end(), content.begin(), content.end());
 
-        std::ofstream sr_file(user_dir / "Sr.enc", std::ios::binary | std::ios::trunc);
-        if (!sr_file) {
-            std::cerr << "[ERROR] Failed to create Sr file.\n";
-            sr_file.close();
-            return false;
+        if (batch.size() >= LEGACY_IMPORT_BATCH || i + 1 == legacy_paths.size()) {
+            if (!store.put_batch(batch.data(), batch.size()) || !store.sync()) return false;
+            batch.clear();
+            for (; imported <= i; ++imported) StorageEngine::instance().remove(legacy_paths[imported], ec);
         }
     }
+
+    log_info("Imported legacy documents", "user", user_id, "documents", imported);
+    return true;
+}
+
+bool DSSEProtocol::rename_user(const std::string& from, const std::string& to) {
+    StorageEngine& engine = StorageEngine::instance();
+    fs::path from_dir = storage_path / from, to_dir = storage_path / to;
+    std::error_code ec;
+    if (!engine.exists(from_dir, ec)) return true;
+    if (engine.exists(to_dir, ec)) {
+        log_warning("User storage not renamed, the new user has its own", "from", from, "to", to);
+        return false;
+    }
+
+    engine.rename(from_dir, to_dir, ec);
+    if (ec || !engine.sync_directory(storage_path)) {
+        log_error("Failed to rename user storage", "from", from, "to", to);
+        return false;
+    }
+    log_info("Renamed user storage", "from", from, "to", to);
     return true;
 }
 
+bool DSSEProtocol::has_user(const std::string& user_id) {
+    std::error_code ec;
+    return StorageEngine::instance().exists(storage_path / user_id, ec);
+}
 
-// Convert UUID to hex string
-std::string DSSEProtocol::uuid_to_hex(const std::vector<uint8_t>& uuid) {
-    std::stringstream ss;
-    ss << std::hex << std::setfill('0');
-    for (uint8_t byte : uuid) {
-        ss << std::setw(2) << static_cast<int>(byte);
+// Get the resident indexes of the user from the cache
+std::shared_ptr<UserIndex> DSSEProtocol::get_user_index(const std::string& user_id) {
+    return cache.get(user_id);
+}
+
+// Sizes of the indexes of the resident users
+std::vector<DSSEProtocol::UserStats> DSSEProtocol::user_stats() const {
+    std::vector<UserStats> result;
+    for (const auto& [user_id, index] : cache.snapshot()) {
+        std::shared_lock lock(index->mutex);
+        result.push_back({user_id, index->se.size(), index->se.file_size(), index->sr.size(),
+                          index->sr.file_size(), index->docs.size(), index->docs.file_size(),
+                          index->memory_usage()});
     }
-    return ss.str();
+    return result;
+}
+
+// Open the indexes of the user (cache miss)
+std::shared_ptr<UserIndex> DSSEProtocol::load_user_index(const std::string& user_id) {
+    // Only on a miss: a resident user has its directory.
+    if (!create_user_directory(user_id)) return nullptr;
+
+    auto index = std::make_shared<UserIndex>();
+    // The log first: it is locked, the files are not touched if another instance owns them.
+    if (!index->wal.open(storage_path / user_id / "wal.log", commit_window) ||
+        !open_se_table(user_id, index->se) ||
+        !open_sr_log(user_id, *index) ||
+        !open_doc_store(user_id, index->docs) ||
+        !index->recover()) {
+        // Not replayed: the log must not be emptied by the checkpoint of the destructor.
+        index->wal.close();
+        return nullptr;
+    }
+    return index;
+}
+
+// Background compaction of the Se tables, Sr logs and document segments
+void DSSEProtocol::compaction_loop(std::stop_token stop) {
+    std::mutex wait_mutex;
+    std::condition_variable_any wakeup;
+
+    while (!stop.stop_requested()) {
+        // NOTE: only the resident users are compacted, the snapshot keeps them resident.
+        auto snapshot = cache.snapshot();
+        for (auto& [user_id, index] : snapshot) {
+            if (stop.stop_requested()) return;
+            compact_se(user_id, *index, stop);
+            compact_sr(user_id, *index);
+            compact_docs(user_id, *index);
+        }
+
+        std::unique_lock lock(wait_mutex);
+        wakeup.wait_for(lock, stop, COMPACTION_INTERVAL, [] { return false; });
+    }
+}
+
+// Rewrite the live entries of the user's Se table into a fresh file
+void DSSEProtocol::compact_se(const std::string& user_id, UserIndex& index, std::stop_token stop) {
+    {
+        std::lock_guard lock(index.mutex);
+        if (!index.se.needs_compaction() || !index.se.begin_compaction()) return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool done = false;
+    while (!done) {
+        std::this_thread::sleep_for(COMPACTION_PAUSE);
+
+        // Throttling: a step is performed only when no request holds the indexes.
+        std::unique_lock lock(index.mutex, std::try_to_lock);
+        if (!lock.owns_lock()) continue;
+
+        if (stop.stop_requested()) {
+            index.se.abort_compaction();
+            return;
+        }
+        // The compaction is aborted if the table is rehashed in the meantime.
+        if (!index.se.is_compacting()) return;
+
+        done = index.se.compaction_step(COMPACTION_BATCH);
+    }
+
+    SeTable::CompactionStats stats;
+    {
+        std::lock_guard lock(index.mutex);
+        if (!index.se.finish_compaction(stats)) {
+            log_error("Se compaction failed", "user", user_id);
+            return;
+        }
+        cache.update_charge(user_id, index.memory_usage());
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    size_t reclaimed = stats.bytes_before > stats.bytes_after ? stats.bytes_before - stats.bytes_after : 0;
+    log_info("Compacted Se", "user", user_id, "reclaimed_bytes", reclaimed, "tombstones", stats.tombstones,
+             "ms", elapsed.count());
+}
+
+// Rewrite the latest records of the user's Sr log into a fresh file
+void DSSEProtocol::compact_sr(const std::string& user_id, UserIndex& index) {
+    std::unique_ptr<SrLog::Compaction> compaction;
+    {
+        std::lock_guard lock(index.mutex);
+        if (!index.sr.needs_compaction()) return;
+        compaction = index.sr.begin_compaction();
+        if (!compaction) return;
+    }
+
+    // The bulk of the copy doesn't hold the indexes.
+    auto start = std::chrono::steady_clock::now();
+    if (!SrLog::compaction_copy(*compaction)) {
+        log_error("Sr compaction failed", "user", user_id);
+        return;
+    }
+
+    SrLog::CompactionStats stats;
+    {
+        std::lock_guard lock(index.mutex);
+        if (!index.sr.finish_compaction(*compaction, stats)) {
+            log_error("Sr compaction failed", "user", user_id);
+            return;
+        }
+        cache.update_charge(user_id, index.memory_usage());
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    size_t reclaimed = stats.bytes_before > stats.bytes_after ? stats.bytes_before - stats.bytes_after : 0;
+    log_info("Compacted Sr", "user", user_id, "reclaimed_bytes", reclaimed, "ms", elapsed.count());
+}
+
+// Rewrite the live documents of the user's most wasteful document segment
+void DSSEProtocol::compact_docs(const std::string& user_id, UserIndex& index) {
+    std::unique_ptr<DocStore::Compaction> compaction;
+    {
+        std::lock_guard lock(index.mutex);
+        if (!index.docs.needs_compaction()) return;
+        compaction = index.docs.begin_compaction();
+        if (!compaction) return;
+    }
+
+    // The copy doesn't hold the indexes.
+    auto start = std::chrono::steady_clock::now();
+    if (!DocStore::compaction_copy(*compaction)) {
+        log_error("Document compaction failed", "user", user_id);
+        return;
+    }
+
+    DocStore::CompactionStats stats;
+    {
+        std::lock_guard lock(index.mutex);
+        // The logged records in place refer to locations in the segments.
+        if (!index.checkpoint() || !index.docs.finish_compaction(*compaction, stats)) {
+            log_error("Document compaction failed", "user", user_id);
+            return;
+        }
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    size_t reclaimed = stats.bytes_before > stats.bytes_after ? stats.bytes_before - stats.bytes_after : 0;
+    log_info("Compacted document segment", "user", user_id, "segment", stats.segment,
+             "reclaimed_bytes", reclaimed, "ms", elapsed.count());
 }
 
 // Process and store encrypted indexes (Se, Sr)
 bool DSSEProtocol::init_encrypted_index(const std::string& user_id, 
                                            const std::vector<uint8_t>& Se_serialized, 
                                            const std::vector<uint8_t>& Sr_serialized) {
-    // Ensure user directory exists
-    if (!create_user_directory(user_id)) return false;
-
     fs::path user_dir = storage_path / user_id;
-    fs::path se_path = user_dir / "Se.enc";
-    fs::path sr_path = user_dir / "Sr.enc";
+    fs::path se_path = user_dir / "Se.tbl";
 
-    constexpr size_t SE_ENTRY_SIZE = 64 + 64 + 8 + 64;  // Key (256 bytes) || Eid (64 bytes) || Con (8 bytes) || rn (256 bytes)
-    constexpr size_t SR_ENTRY_SIZE = 256 + 64;  // Key (256) + Con (64)
-    
     // Validate input sizes
-    if (Se_serialized.size() % SE_ENTRY_SIZE != 0) {
-        std::cerr << "[ERROR] Invalid Se size.\n";
+    if (Se_serialized.size() % SeTable::ENTRY_SIZE != 0) {
+        log_error("Invalid Se size");
         return false;
     }
-    /*if (Sr_serialized.size() % SR_ENTRY_SIZE != 0) {
-        std::cerr << "[ERROR] Invalid Sr size.\n";
-        return false;
-    }*/
 
     try {
-        // Handle Se (encrypted index)
-        std::ofstream se_file(se_path, std::ios::binary | std::ios::trunc);
-        if (!se_file) {
-            std::cerr << "[ERROR] Cannot open Se file for writing.\n";
-            se_file.close();
-            return false;
-        }
-        if (!se_file.write(reinterpret_cast<const char*>(Se_serialized.data()), Se_serialized.size())) {
-            std::cerr << "[ERROR] Failed to write Se.\n";
-            se_file.close();
+        std::shared_ptr<UserIndex> index = get_user_index(user_id);
+        if (!index) return false;
+        std::lock_guard lock(index->mutex);
+
+        // The indexes are replaced without logging: the log must not be replayed over them.
+        if (!index->checkpoint()) return false;
+
+        // Handle Se (encrypted index): rebuild the table from scratch
+        ++index->se_updates;
+        index->se.close();
+        std::error_code ec;
+        StorageEngine::instance().remove(user_dir / "Se.enc", ec);
+        StorageEngine::instance().remove(se_path, ec);
+
+        if (!index->se.open(se_path) ||
+            !index->se.insert_serialized(Se_serialized.data(), Se_serialized.size())) {
+            log_error("Failed to write Se");
             return false;
         }
-        se_file.close();
 
-        // Handle Sr (explicit index)
-        std::ofstream sr_file(sr_path, std::ios::binary | std::ios::trunc);
-        if (!sr_file) {
-            std::cerr << "[ERROR] Cannot open Sr file for writing.\n";
-            sr_file.close();
+        // Handle Sr (explicit index): records tw || length || Con || UUIDs, a partial
+        // trailing one is dropped
+        if (!index->sr.reset({})) {
+            log_error("Failed to write Sr");
             return false;
         }
-        if (!sr_file.write(reinterpret_cast<const char*>(Sr_serialized.data()), Sr_serialized.size())) {
-            std::cerr << "[ERROR] Failed to write Sr.\n";
-            sr_file.close();
+        const uint8_t* records = Sr_serialized.data();
+        for (size_t offset = 0; Sr_serialized.size() - offset >= SrLog::HEADER_SIZE; ) {
+            uint64_t length;
+            std::memcpy(&length, records + offset + SrLog::KEY_SIZE, sizeof(length));
+            if (length > Sr_serialized.size() - offset - SrLog::HEADER_SIZE) break;
+            if (length >= sizeof(uint64_t) &&
+                !index->put_sr_uuids(records + offset, records + offset + SrLog::HEADER_SIZE, length)) {
+                log_error("Failed to write Sr");
+                return false;
+            }
+            offset += SrLog::HEADER_SIZE + length;
+        }
+        cache.update_charge(user_id, index->memory_usage());
+
+        if (!index->checkpoint()) {
+            log_error("Failed to sync Se and Sr");
             return false;
         }
-        sr_file.close();
 
-        std::cout << "[+] Successfully updated Se and Sr for user: " << user_id << "\n";
+        log_info("Successfully updated Se and Sr", "user", user_id);
         return true;
 
     } catch (const std::exception& e) {
-        std::cerr << "[ERROR] Exception while processing Se/Sr: " << e.what() << "\n";
+        log_error("Exception while processing Se/Sr", "error", e.what());
         return false;
     }
 }
 
-// Update encrypted index by appending (Se')
+// Update encrypted index by inserting (Se') into the Se table
 bool DSSEProtocol::update_encrypted_index(const std::string& user_id, 
                                              const std::vector<uint8_t>& Se_serialized) {
-    // Ensure user directory exists
-    if (!create_user_directory(user_id)) return false;
-
-    fs::path se_path = storage_path / user_id / "Se.enc";
-
-    constexpr size_t SE_ENTRY_SIZE = 64 + 64 + 8 + 64;  // Key(512) + Value(512+64+512)
-
-    if (Se_serialized.size() % SE_ENTRY_SIZE != 0) {
-        std::cerr << "[ERROR] Invalid Se' size.\n";
+    if (Se_serialized.size() % SeTable::ENTRY_SIZE != 0) {
+        log_error("Invalid Se' size");
         return false;
     }
 
     try {
-        std::ofstream se_file(se_path, std::ios::binary | std::ios::app);
-        if (!se_file) {
-            std::cerr << "[ERROR] Cannot open Se file for writing.\n";
-            se_file.close();
-            return false;
-        }
-        if (!se_file.write(reinterpret_cast<const char*>(Se_serialized.data()), Se_serialized.size())) {
-            std::cerr << "[ERROR] Failed to append Se'.\n";
-            se_file.close();
+        Stopwatch load;
+        std::shared_ptr<UserIndex> index = get_user_index(user_id);
+        Metrics::instance().phase(MetricOp::update, Phase::se_load, load.elapsed_ns());
+        if (!index) return false;
+        std::lock_guard lock(index->mutex);
+
+        // Insert Se' in place
+        ++index->se_updates;
+        if (!index->se.insert_serialized(Se_serialized.data(), Se_serialized.size()) ||
+            !index->wal.append(Wal::Type::se_insert, Se_serialized.data(), Se_serialized.size())) {
+            log_error("Failed to insert Se'");
             return false;
         }
-        se_file.close();
+        cache.update_charge(user_id, index->memory_usage());
 
-        std::cout << "[+] Successfully updated Se for user: " << user_id << "\n";
+        log_debug("Successfully updated Se", "user", user_id);
         return true;
 
     } catch (const std::exception& e) {
-        std::cerr << "[ERROR] Exception while updating Se: " << e.what() << "\n";
+        log_error("Exception while updating Se", "error", e.what());
         return false;
     }
 }
 
-// Store an encrypted document
+// Store encrypted documents
 bool DSSEProtocol::store_encrypted_document(const std::string& user_id, 
                                             const std::vector<uint8_t>& document_data) {
-    // Ensure user directory exists
-    if (!create_user_directory(user_id)) return false;
-
-    // extract UUID (128 bits) and document length (64 bits) from document_data.
-    // there could be more than one document serialized this way: UIID(128) + length(64) + document(length)
-    // we need to extract each document and store it separately.
-    for (size_t i = 0; i < document_data.size(); ) {
-        if (i + 16 + 8 > document_data.size()) {
-            std::cerr << "[ERROR] Invalid document header.\n";
-            return false;
-        }
+    std::shared_ptr<UserIndex> index = get_user_index(user_id);
+    if (!index) {
+        log_error("Failed to open the indexes");
+        return false;
+    }
+    std::lock_guard lock(index->mutex);
+
+    // document_data holds the serialized documents: UUID(128) + length(64) + document(length),
+    // they are appended to the store with a single write.
+    size_t before = index->docs.size();
+    if (!index->docs.put_batch(document_data.data(), document_data.size()) ||
+        !index->wal.append(Wal::Type::doc_put, document_data.data(), document_data.size())) {
+        log_error("Failed to store documents");
+        return false;
+    }
+    cache.update_charge(user_id, index->memory_usage());
 
-        std::vector<uint8_t> uuid(document_data.begin() + i, document_data.begin() + i + 16);
-        i += 16;
-        uint64_t doc_len = *reinterpret_cast<const uint64_t*>(&document_data[i]);
-        i += 8;
+    log_debug("Stored encrypted documents", "user", user_id, "new", index->docs.size() - before);
+    return true;
+}
 
-        // Detect overflows.
-        if (i + doc_len > document_data.size() || i + doc_len < i) {
-            std::cerr << "[ERROR] Invalid document data format.\n";
-            return false;
-        }
+// Reserve the record of an encrypted document received in place
+bool DSSEProtocol::begin_document(const std::string& user_id, const uint8_t* header, PendingDocument& document) {
+    document.index = get_user_index(user_id);
+    if (!document.index) {
+        log_error("Failed to open the indexes");
+        return false;
+    }
 
-        std::vector<uint8_t> doc(document_data.begin() + i, document_data.begin() + i + doc_len);
-        i += doc_len;
+    uint64_t length;
+    std::memcpy(&length, header + DocStore::UUID_SIZE, sizeof(length));
 
-        fs::path user_dir = storage_path / user_id;
-        fs::path doc_path = user_dir / (uuid_to_hex(uuid) + ".enc");
+    std::lock_guard lock(document.index->mutex);
+    document.record = document.index->docs.begin_record(header, length);
+    if (!document.record) {
+        log_error("Failed to store document");
+        return false;
+    }
+    return true;
+}
 
-        try {
-            std::ofstream doc_file(doc_path, std::ios::binary | std::ios::app);
-            if (!doc_file) {
-                std::cerr << "[ERROR] Cannot open document file for writing.\n";
-                doc_file.close();
-                return false;
-            }
-            if (!doc_file.write(reinterpret_cast<const char*>(uuid.data()), uuid.size()) ||
-                !doc_file.write(reinterpret_cast<const char*>(&doc_len), sizeof(doc_len)) ||
-                !doc_file.write(reinterpret_cast<const char*>(doc.data()), doc.size())) {
-                std::cerr << "[ERROR] Failed to write document.\n";
-                doc_file.close();
-                return false;
-            }
-            doc_file.close();
+// Index an encrypted document received in place
+bool DSSEProtocol::finish_document(const std::string& user_id, PendingDocument& document, bool written) {
+    UserIndex* index = document.index.get();
+    DocStore::Pending& pending = *document.record;
+
+    // The document is synced where it was written, only its location is logged.
+    written = written && StorageEngine::instance().sync(pending.fd);
+
+    std::lock_guard lock(index->mutex);
+    if (!index->docs.finish_record(pending, written)) {
+        log_error("Failed to store document");
+        return false;
+    }
+    cache.update_charge(user_id, index->memory_usage());
+    if (pending.superseded) return true;
+
+    // UUID || length || segment || offset
+    uint8_t record[DocStore::HEADER_SIZE + sizeof(pending.segment) + sizeof(pending.offset)];
+    std::memcpy(record, pending.uuid.data(), DocStore::UUID_SIZE);
+    std::memcpy(record + DocStore::UUID_SIZE, &pending.length, sizeof(pending.length));
+    std::memcpy(record + DocStore::HEADER_SIZE, &pending.segment, sizeof(pending.segment));
+    std::memcpy(record + DocStore::HEADER_SIZE + sizeof(pending.segment), &pending.offset, sizeof(pending.offset));
+    if (!index->wal.append(Wal::Type::doc_record, record, sizeof(record))) {
+        log_error("Failed to store document");
+        return false;
+    }
+    return true;
+}
+
+// Delete encrypted documents
+bool DSSEProtocol::remove_encrypted_documents(const std::string& user_id,
+                                              const std::vector<uint8_t>& uuids) {
+    if (uuids.size() % DocStore::UUID_SIZE != 0) {
+        log_error("Invalid UUID list");
+        return false;
+    }
+
+    std::shared_ptr<UserIndex> index = get_user_index(user_id);
+    if (!index) {
+        log_error("Failed to open the indexes");
+        return false;
+    }
+    std::lock_guard lock(index->mutex);
+
+    int64_t removed = index->docs.erase_batch(uuids.data(), uuids.size() / DocStore::UUID_SIZE);
+    if (removed < 0 || (removed > 0 && !index->wal.append(Wal::Type::doc_erase, uuids.data(), uuids.size()))) {
+        log_error("Failed to delete documents");
+        return false;
+    }
+    cache.update_charge(user_id, index->memory_usage());
+
+    log_info("Deleted encrypted documents", "user", user_id, "documents", removed);
+    return true;
+}
+
+// Locate encrypted documents
+std::unique_ptr<DocStore::Snapshot> DSSEProtocol::fetch_documents(const std::string& user_id,
+                                                                  const std::vector<uint8_t>& uuids) {
+    if (uuids.size() % DocStore::UUID_SIZE != 0) {
+        log_error("Invalid UUID list");
+        return nullptr;
+    }
+
+    Stopwatch load;
+    std::shared_ptr<UserIndex> index = get_user_index(user_id);
+    Metrics::instance().phase(MetricOp::fetch, Phase::se_load, load.elapsed_ns());
+    if (!index) {
+        log_error("Failed to open the indexes");
+        return nullptr;
+    }
+    std::lock_guard lock(index->mutex);
 
-            std::cout << "[+] Stored encrypted document: " << uuid_to_hex(uuid) << " for user: " << user_id << "\n";
+    return index->docs.snapshot(uuids.data(), uuids.size() / DocStore::UUID_SIZE);
+}
 
-        } catch (const std::exception& e) {
-            std::cerr << "[ERROR] Exception while storing document: " << e.what() << "\n";
+// NOTE: Refer to the paper's search algorithm pseudocode for the steps cited below
+bool DSSEProtocol::search_keywords(const std::string& user_id,
+                                   const std::vector<SearchQuery>& queries,  // tw (location in Sr) and KTw (locates the entries in Se) of each keyword
+                                   uint64_t Con,                             // Counter tracking previous search instances
+                                   std::vector<SearchResults>& results,      // Output: ID1, ID2 and what was read, per query
+                                   std::optional<std::vector<uint8_t>>* intersection) {  // Output (conjunctive): results in Sr of all the keywords
+    for (const SearchQuery& query : queries) {
+        if (query.tw.size() != SrLog::KEY_SIZE) {
+            log_error("Invalid tw size");
             return false;
         }
     }
+    TraceSpan span("search_keywords");
+
+    Stopwatch load;
+    TraceSpan load_span("load_indexes");
+    std::shared_ptr<UserIndex> index = get_user_index(user_id);
+    load_span.end();
+    Metrics::instance().phase(MetricOp::search, Phase::se_load, load.elapsed_ns());
+    if (!index) {
+        log_error("Failed to open the indexes");
+        return false;
+    }
+    SeTable& se_table = index->se;
+
+    // A range of epochs of a keyword, walked by a task
+    struct Range {
+        size_t query;
+        uint64_t first;
+        uint64_t last;
+        EpochResults* results;
+    };
+
+    results.assign(queries.size(), {});
+    std::vector<uint64_t> Lcon(queries.size());
+    std::vector<std::vector<EpochResults>> walks(queries.size());  // Of each keyword, in epoch order
+    std::vector<Range> ranges;
+    Stopwatch walk;
+
+    // NOTE: step 1 only reads the indexes, the searches of the user walk concurrently.
+    // The entries found are deleted by step 2, when their results are written to Sr:
+    // until then the concurrent searches of the keyword find them too, and a search
+    // never finalized leaves them in Se.
+    std::shared_lock lock(index->mutex);
+    for (size_t q = 0; q < queries.size(); ++q) {
+        SearchBase& base = results[q].base;
+        base.se_updates = index->se_updates;
+        base.index = index;
+
+        // Step 6-10: Check if Sr[tw] exists (explicit index contains results)
+        Lcon[q] = SYSTEM_CONSTANT;  // Default system constant
+        if (index->sr.get(queries[q].tw.data(), base.Sr_value) && base.Sr_value.size() >= sizeof(Lcon[q])) {
+            std::memcpy(&Lcon[q], base.Sr_value.data(), sizeof(Lcon[q]));  // Update Lcon with previous search counter
+        } else {
+            base.Sr_value.clear();
+        } // otherwise proceed searching in Se
+
+        // Step 11: Iterate over Con to Lcon
+        // The epochs are independent: they are split into ranges walked in parallel,
+        // the results are merged in epoch order.
+        if (Con <= Lcon[q]) {
+            uint64_t epochs = Lcon[q] - Con + 1;
+            size_t tasks = std::clamp<uint64_t>(epochs / SEARCH_MIN_EPOCHS, 1, search_pool.size());
+            uint64_t per_task = epochs / tasks;
+
+            walks[q].resize(tasks);
+            for (size_t t = 0; t < tasks; ++t) {
+                uint64_t first = Con + t * per_task;
+                uint64_t last = t + 1 == tasks ? Lcon[q] : first + per_task - 1;
+                ranges.push_back({q, first, last, &walks[q][t]});
+            }
+        }
+    }
 
+    // The ranges of all the keywords are walked by the same loop.
+    if (!ranges.empty()) {
+        TraceSpan walk_span("walk_epochs");
+        const TraceContext& trace = TraceContext::current();
+        search_pool.run(ranges.size(), [&](size_t r) {
+            TraceSpan range_span("walk_range", trace);
+            const Range& range = ranges[r];
+            walk_epochs(se_table, queries[range.query].KTw, range.first, range.last, *range.results);
+        });
+    }
+    Metrics::instance().phase(MetricOp::search, Phase::chain_walk, walk.elapsed_ns());
+
+    // Sr[tw] holds the ordinals of the UUIDs: they are expanded for the client, or
+    // intersected as they are for a conjunctive search.
+    std::vector<std::vector<uint32_t>> stored(queries.size());
+    for (size_t q = 0; q < queries.size(); ++q) {
+        uint64_t stored_con;
+        SearchResults& result = results[q];
+        if (!result.base.Sr_value.empty() && !UserIndex::parse_sr_value(result.base.Sr_value, stored_con, stored[q])) {
+            log_error("Malformed Sr record", "user", user_id);
+            return false;
+        }
+        if (!intersection) index->ids.expand(stored[q], result.ID1);  // Eid
+
+        for (const EpochResults& r : walks[q]) {
+            // Step 16: ID2 <- ID2 ∪ {Eid || i}
+            result.ID2.insert(result.ID2.end(), r.ID2.begin(), r.ID2.end());
+            // Step 17 (Delete Se[Addrw]) is applied by step 2.
+            result.base.Addrw.insert(result.base.Addrw.end(), r.Addrw.begin(), r.Addrw.end());
+        }
+        result.newCon = Lcon[q] + 1;
+    }
+
+    if (intersection) {
+        intersection->reset();
+        if (std::all_of(results.begin(), results.end(), [](const SearchResults& r) { return r.ID2.empty(); })) {
+            index->ids.expand(intersect_search_results(std::move(stored)), intersection->emplace());
+        }
+    }
+    log_info("Search Step 1 completed", "user", user_id, "keywords", queries.size());
     return true;
 }
 
+
 // NOTE: Refer to the paper's search algorithm pseudocode for the steps cited below
-bool DSSEProtocol::search_keyword(const std::string& user_id, 
-                                  const std::vector<uint8_t>& tw,   // Transformed keyword (location in Sr)
-                                  const std::vector<uint8_t>& KTw,  // Derived key used to locate encrypted entries in Se
-                                  uint64_t Con,                     // Counter tracking previous search instances
-                                  std::vector<uint8_t>& ID1,        // Output: Stores previous search result (explicit index Sr)
-                                  std::vector<uint8_t>& ID2,        // Output: Stores newly retrived encrypted results (encrypted index Se)
-                                  uint64_t& newCon) {               // Output: Updated counter for consistency across searches
-    
+void DSSEProtocol::walk_epochs(const SeTable& se_table,
+                               const std::vector<uint8_t>& KTw,
+                               uint64_t first,
+                               uint64_t last,
+                               EpochResults& results) {
     using hash = monocypher::hash<monocypher::Blake2b<64>>;
 
-    if (!create_user_directory(user_id)) return false;
+    // The epochs are hashed in batches of BLAKE2B_BATCH_MAX_LANES (see blake2b_batch.hpp)
+    constexpr size_t BATCH = BLAKE2B_BATCH_MAX_LANES;
+    constexpr size_t HASH_SIZE = BLAKE2B_BATCH_DIGEST_SIZE;
+    const size_t KTw_i_size = KTw.size() + sizeof(uint64_t);
 
-    fs::path user_dir = storage_path / user_id;
-    fs::path se_path = user_dir / "Se.enc";
-    fs::path sr_path = user_dir / "Sr.enc";
+    std::vector<uint8_t> KTw_i(BATCH * KTw_i_size);  // KTw || i
+    uint8_t Keyw[BATCH * HASH_SIZE];
+    uint8_t Keyw_one[BATCH * (HASH_SIZE + 1)];        // Keyw || 1
+    uint8_t Addrws[BATCH * HASH_SIZE];
+    std::vector<uint8_t> buff;
+    std::vector<uint8_t> Eid_i_rn(64 + 8 + 64);
 
-    std::ifstream sr_file(sr_path, std::ios::binary);
-    if (!sr_file) {
-        std::cerr << "[ERROR] Failed to open Sr file.\n";
-        sr_file.close();
-        return false;
+    for (size_t b = 0; b < BATCH; ++b) {
+        std::memcpy(KTw_i.data() + b * KTw_i_size, KTw.data(), KTw.size());
     }
 
-    std::ifstream se_file(se_path, std::ios::binary);
-    if (!se_file) {
-        std::cerr << "[ERROR] Failed to open Se file.\n";
-        se_file.close();
-        return false;
-    }
-
-    // Step 6-10: Check if Sr[tw] exists (explicit index contains results)
-    uint64_t Lcon = SYSTEM_CONSTANT;  // Default system constant
-    uint64_t prev_con = 0;
-
-    // Load Sr into memory
-    std::unordered_map<std::vector<uint8_t>, std::vector<uint8_t>, VectorHash> Sr_map;
-    while (!sr_file.eof()) {
-        std::vector<uint8_t> key(32);
-        sr_file.read(reinterpret_cast<char*>(key.data()), key.size());
-        if (sr_file.gcount() == 0) break;
-        size_t length;
-        sr_file.read(reinterpret_cast<char*>(&length), sizeof(length));
-        if (sr_file.gcount() == 0) break;
-        
-        std::vector<uint8_t> value(length);
-        sr_file.read(reinterpret_cast<char*>(value.data()), value.size());
-        if (sr_file.gcount() == 0) break;
-        Sr_map[key] = value;
-    }
-
-    sr_file.close();
-
-    // Check if Sr[tw] exists
-    auto it = Sr_map.find(tw);
-    if (it != Sr_map.end()) {
-        ID1.insert(ID1.end(), it->second.begin() + 8, it->second.end());  // Eid
-        std::memcpy(&prev_con, it->second.data(), sizeof(prev_con));   // Con
-        Lcon = prev_con; // Update Lcon with prevuious search counter
-    } // otherwise proceed searching in Se
-
-    // Step 14: If Se[Addrw] != null
-    std::unordered_map<std::vector<uint8_t>, std::vector<uint8_t>, VectorHash> Se_map;
-    while (!se_file.eof()) {
-        std::vector<uint8_t> key(64), value(64 + 8 + 64);
-        se_file.read(reinterpret_cast<char*>(key.data()), key.size());
-        se_file.read(reinterpret_cast<char*>(value.data()), value.size());
-        if (se_file.gcount() == 0) break;
-        Se_map[key] = value;
-    }
-
-    se_file.close();
-
-    // Step 11: Iterate over Con to Lcon
-    for (uint64_t i = Con; i <= Lcon; ++i) {
-        std::vector<uint8_t> buff{};
+    // Step 11: Iterate over first to last (last may be the largest counter)
+    for (uint64_t i = first; ; i += BATCH) {
+        size_t batch = std::min<uint64_t>(last - i, BATCH - 1) + 1;
 
         // Step 12: Keyw <- H(KTw || i)
-        // Hashes KTw || i to generate a unique key (Keyw) for this iteration
-        buff.insert(buff.end(), KTw.begin(), KTw.end());
-        buff.insert(buff.end(), reinterpret_cast<uint8_t*>(&i), reinterpret_cast<uint8_t*>(&i) + sizeof(i));
-        auto Keyw = hash::create(buff.data(), buff.size());
+        // Hashes KTw || i to generate a unique key (Keyw) for each iteration of the batch
+        for (size_t b = 0; b < batch; ++b) {
+            uint64_t epoch = i + b;
+            std::memcpy(KTw_i.data() + b * KTw_i_size + KTw.size(), &epoch, sizeof(epoch));
+        }
+        blake2b_batch(KTw_i.data(), KTw_i_size, batch, Keyw);
 
         // Step 13: Addrw <- H(Keyw || 1)
         // Derive Addrw used as a pointer to the encrypted entry in Se
-        uint8_t one = -1;
-        buff.clear();
-        buff.insert(buff.end(), Keyw.begin(), Keyw.end());
-        buff.insert(buff.end(), reinterpret_cast<uint8_t*>(&one), reinterpret_cast<uint8_t*>(&one) + sizeof(one));
-        auto Addrw = hash::create(buff.data(), buff.size());
-
-        buff.clear();
-        buff.insert(buff.end(), Addrw.begin(), Addrw.end());
-
-        // Check if Se[Addrw] exists
-        auto se_it = Se_map.find(buff);
-        if (se_it != Se_map.end()) {
-            // Step 15: (Eid || i || rn) <- Se[Addrw] ⊕ H(Keyw || 0)
-            std::vector<uint8_t> Eid_i_rn(64 + 8 + 64);
+        for (size_t b = 0; b < batch; ++b) {
+            std::memcpy(Keyw_one + b * (HASH_SIZE + 1), Keyw + b * HASH_SIZE, HASH_SIZE);
+            Keyw_one[b * (HASH_SIZE + 1) + HASH_SIZE] = 0xff;
+        }
+        blake2b_batch(Keyw_one, HASH_SIZE + 1, batch, Addrws);
+
+        for (size_t b = 0; b < batch; ++b) {
+            uint8_t* Addrw = Addrws + b * HASH_SIZE;
 
+            // Step 14: If Se[Addrw] != null
+            const uint8_t* se_value = se_table.find(Addrw);
+            if (!se_value) continue;
+
+            // Step 15: (Eid || i || rn) <- Se[Addrw] ⊕ H(Keyw || 0)
             // Extract Se[Addrw] and decrypt it using mask H(Keyw || 0)
+            // NOTE: only computed on a hit, most epochs don't contain the keyword.
             uint8_t zero = 0;
-            buff.clear();
-            buff.insert(buff.end(), Keyw.begin(), Keyw.end());
-            buff.insert(buff.end(), reinterpret_cast<uint8_t*>(&zero), reinterpret_cast<uint8_t*>(&zero) + sizeof(zero));
+            buff.assign(Keyw + b * HASH_SIZE, Keyw + (b + 1) * HASH_SIZE);
+            buff.push_back(zero);
             auto mask = hash::create(buff.data(), buff.size());
 
-            for (size_t j = 0; j < Eid_i_rn.size(); ++j) {
-                Eid_i_rn[j] = se_it->second[j];
-            }
-            for (size_t j = 0; j < mask.size(); ++j) {
-                Eid_i_rn[j] ^= mask[j];
-            }
-
-            // Step 16: ID2 <- ID2 ∪ {Eid || i}
-            // Store encrypted results for the client to decrypt later.
-            ID2.insert(ID2.end(), Eid_i_rn.begin(), Eid_i_rn.begin() + 64 + 8);
-
-            // Step 17: Delete Se[Addrw]
-            // Ensures forward security by removing the processed entry
-            Se_map.erase(se_it);
-
             // Step 18-22: Follow rn chain
-            std::vector<uint8_t> rn(Eid_i_rn.begin() + 64 + 8, Eid_i_rn.end());
-            while (!std::all_of(rn.begin(), rn.end(), [](uint8_t b) { return b == 0; })) {  // rn != 0
-                // Compute next Addrw
-                for (size_t i = 0; i < 64; ++i) Addrw[i] ^= rn[i];
-
-                buff.clear();
-                buff.insert(buff.end(), Addrw.begin(), Addrw.end());
-
-                // Repeat decryption and add to ID2
-                se_it = Se_map.find(buff);
-                if (se_it == Se_map.end()) break;
-
-                for (size_t j = 0; j < Eid_i_rn.size(); ++j) {
-                    Eid_i_rn[j] = se_it->second[j];
-                }
+            // NOTE: the entries are erased by step 2, a chain is bounded by the size
+            // of Se so that a cyclic one cannot loop forever.
+            for (size_t length = 0; se_value && length < se_table.size(); ++length) {
+                std::memcpy(Eid_i_rn.data(), se_value, Eid_i_rn.size());
                 for (size_t j = 0; j < mask.size(); ++j) {
                     Eid_i_rn[j] ^= mask[j];
                 }
 
-                ID2.insert(ID2.end(), Eid_i_rn.begin(), Eid_i_rn.begin() + 64 + 8);
-                rn.assign(Eid_i_rn.begin() + 64 + 8, Eid_i_rn.end());
-                Se_map.erase(se_it);
+                // Steps 16-17 are applied by the caller, in epoch order.
+                results.ID2.insert(results.ID2.end(), Eid_i_rn.begin(), Eid_i_rn.begin() + 64 + 8);
+                results.Addrw.emplace_back();
+                std::memcpy(results.Addrw.back().data(), Addrw, SeTable::KEY_SIZE);
+
+                const uint8_t* rn = Eid_i_rn.data() + 64 + 8;
+                if (std::all_of(rn, rn + 64, [](uint8_t b) { return b == 0; })) break;  // rn == 0
+
+                // Compute next Addrw
+                for (size_t j = 0; j < 64; ++j) Addrw[j] ^= rn[j];
+                se_value = se_table.find(Addrw);
             }
         }
-    }
 
-    newCon = Lcon + 1;
-    std::cout << "[1/2] Search Step 1 completed for user: " << user_id << "\n";
-    return true;
+        if (last - i < BATCH) break;
+    }
 }
 
-
 // NOTE: Refer to the paper's search algorithm pseudocode for the steps cited below
 bool DSSEProtocol::search_finalize(const std::string& user_id,
-                                   const std::vector<uint8_t>& tw,  // Transformed keyword (location in Sr)
-                                   const std::vector<uint8_t>& ID1, // Final results from the client after filtering
-                                   uint64_t Con) {                  // Counter tracking previous search instances
-    if (!create_user_directory(user_id)) return false;
-
-    fs::path sr_path = storage_path / user_id / "Sr.enc";
-
-    std::unordered_map<std::vector<uint8_t>, std::vector<uint8_t>, VectorHash> Sr_map;
-
-    std::ifstream sr_file(sr_path, std::ios::binary);
-    if (!sr_file) {
-        std::cerr << "[ERROR] Failed to open Sr file.\n";
-        sr_file.close();
+                                   const std::vector<SearchFinal>& finals,  // tw, final results from the client after filtering and what step 1 read, per keyword
+                                   uint64_t Con,                            // Counter tracking previous search instances
+                                   std::vector<uint8_t>* intersection) {  // Output (optional): results in Sr of all the keywords
+    for (const SearchFinal& final : finals) {
+        if (final.tw.size() != SrLog::KEY_SIZE) {
+            log_error("Invalid tw size");
+            return false;
+        }
+    }
+    TraceSpan span("search_finalize");
+
+    Stopwatch load;
+    TraceSpan load_span("load_indexes");
+    // The indexes walked by step 1, pinned since
+    std::shared_ptr<UserIndex> index = !finals.empty() && finals.front().base.index ? finals.front().base.index
+                                                                                    : get_user_index(user_id);
+    load_span.end();
+    Metrics::instance().phase(MetricOp::finalize, Phase::se_load, load.elapsed_ns());
+    if (!index) {
+        log_error("Failed to open the indexes");
         return false;
     }
+    Stopwatch rewrite;
+    TraceSpan write_span("write_sr");
+    std::lock_guard lock(index->mutex);
+
+    std::vector<std::vector<uint32_t>> stored;  // Results now in Sr of each keyword, to intersect
+    for (const SearchFinal& final : finals) {
+        const std::vector<uint8_t>& tw = final.tw;
+        const SearchBase& base = final.base;
+
+        // Step 31: Store plaintext search results
+        // The UUIDs are stored as their ordinals in the user's dictionary, new ones assigned.
+        uint64_t base_con = SYSTEM_CONSTANT;
+        std::vector<uint32_t> base_ids, ids;
+        if (!base.Sr_value.empty() && !UserIndex::parse_sr_value(base.Sr_value, base_con, base_ids)) {
+            log_error("Malformed Sr record", "user", user_id);
+            return false;
+        }
+        const uint32_t assigned = index->ids.size();
+        if (!index->ids.assign(final.ID1.data(), final.ID1.size() / DocStore::UUID_SIZE, ids)) {
+            log_error("Failed to update Sr");
+            return false;
+        }
+        posting_list::sort(ids, index->ids.size());
+        if (final.changes) {
+            // Like the client, the removals are applied after the insertions.
+            std::vector<uint32_t> removed, merged;
+            index->ids.find(final.removed.data(), final.removed.size() / DocStore::UUID_SIZE, removed);
+            posting_list::sort(removed, index->ids.size());
+            std::set_union(base_ids.begin(), base_ids.end(), ids.begin(), ids.end(), std::back_inserter(merged));
+            ids.clear();
+            std::set_difference(merged.begin(), merged.end(), removed.begin(), removed.end(), std::back_inserter(ids));
+        }
+        uint64_t stored_con = Con;
+
+        // Sr[tw] serves as its own version: if it changed since step 1, another search
+        // of tw was finalized meanwhile, and replacing its results would lose the ones
+        // of the Se entries it deleted.
+        std::vector<uint8_t> current;
+        if (!index->sr.get(tw.data(), current) || current.size() < sizeof(Con)) current.clear();
+        if (current != base.Sr_value) {
+            uint64_t their_con = stored_con;
+            std::vector<uint32_t> their_ids;
+            if (!current.empty() && !UserIndex::parse_sr_value(current, their_con, their_ids)) {
+                log_error("Malformed Sr record", "user", user_id);
+                return false;
+            }
+            ids = merge_search_results(base_ids, ids, their_ids);
+            // The next search walks the epochs from the latest searched one: the oldest
+            // of the two is kept, so that none is skipped.
+            stored_con = std::max(stored_con, their_con);
+            log_info("Merged concurrent search results", "user", user_id);
+        }
 
-    // Load Sr into memory
-    while (!sr_file.eof()) {
-        // TODO: read checks.
-        std::vector<uint8_t> t(32);
-        sr_file.read(reinterpret_cast<char*>(t.data()), t.size());
-        if (sr_file.gcount() == 0) break;
-        
-        size_t length;
-        sr_file.read(reinterpret_cast<char*>(&length), sizeof(length));
-        if (sr_file.gcount() == 0) break;
+        // The client picks the counter of an update before sending it: one applied since
+        // step 1 may belong to an epoch older than Con, walked before it existed. The next
+        // search then walks up to the previous counter again.
+        if (index->se_updates != base.se_updates) stored_con = std::max(stored_con, base_con);
 
-        std::vector<uint8_t> value(length);
-        sr_file.read(reinterpret_cast<char*>(value.data()), value.size());
+        // The new dictionary entries are logged before the record using them.
+        if (index->ids.size() > assigned) {
+            std::vector<uint8_t> entries = index->ids.serialize(assigned);
+            if (!index->wal.append(Wal::Type::uuid_put, entries.data(), entries.size())) {
+                log_error("Failed to update Sr");
+                return false;
+            }
+        }
 
-        if (sr_file.gcount() == 0) break;
-        Sr_map[t] = value;
+        // Append the new Sr[tw], superseding the previous one
+        std::vector<uint8_t> value = UserIndex::sr_value(stored_con, ids);
+        if (!index->sr.put(tw.data(), value)) {
+            log_error("Failed to update Sr");
+            return false;
+        }
+        if (intersection) stored.push_back(std::move(ids));
+
+        // Step 17: Delete Se[Addrw]
+        // Ensures forward security by removing the processed entries, now that their
+        // results are in Sr[tw]: both are logged by the same record.
+        // NOTE: a concurrent search of the keyword may have deleted them first.
+        uint32_t record = SrLog::KEY_SIZE + value.size();
+        std::vector<uint8_t> logged(sizeof(record));
+        std::memcpy(logged.data(), &record, sizeof(record));
+        logged.insert(logged.end(), tw.begin(), tw.end());
+        logged.insert(logged.end(), value.begin(), value.end());
+        for (const auto& Addrw : base.Addrw) {
+            if (index->se.erase(Addrw.data())) logged.insert(logged.end(), Addrw.begin(), Addrw.end());
+        }
+        if (!index->wal.append(Wal::Type::sr_final, logged.data(), logged.size())) {
+            log_error("Failed to update Sr");
+            return false;
+        }
     }
+    if (intersection) index->ids.expand(intersect_search_results(std::move(stored)), *intersection);
+    cache.update_charge(user_id, index->memory_usage());
+    Metrics::instance().phase(MetricOp::finalize, Phase::sr_rewrite, rewrite.elapsed_ns());
 
-    sr_file.close();
+    log_info("Search completed", "user", user_id, "keywords", finals.size());
+    return true;
+}
 
-    // Step 31: Store plaintext search results
-    // Update Sr[tw] with the new values
-    auto& value = Sr_map[tw];
-    value.clear();
-    value.insert(value.end(), reinterpret_cast<uint8_t*>(&Con), 
-                      reinterpret_cast<uint8_t*>(&Con) + sizeof(Con));
-    value.insert(value.end(), ID1.begin(), ID1.end());
+std::vector<uint32_t> DSSEProtocol::intersect_search_results(std::vector<std::vector<uint32_t>> lists) {
+    if (lists.empty()) return {};
+    std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) { return a.size() < b.size(); });
+
+    // The lists are sorted: each candidate is looked up from the position of the previous one.
+    std::vector<uint32_t> candidates = std::move(lists.front());
+    for (size_t l = 1; l < lists.size() && !candidates.empty(); ++l) {
+        auto position = lists[l].begin();
+        size_t kept = 0;
+        for (uint32_t candidate : candidates) {
+            position = std::lower_bound(position, lists[l].end(), candidate);
+            if (position == lists[l].end()) break;
+            if (*position == candidate) candidates[kept++] = candidate;
+        }
+        candidates.resize(kept);
+    }
+    return candidates;
+}
 
-    // Overwrite Sr file
-    std::ofstream sr_out(sr_path, std::ios::binary | std::ios::trunc);
-    if (!sr_out) {
-        std::cerr << "[ERROR] Failed to overwrite Sr.\n";
-        sr_out.close();
+std::vector<uint32_t> DSSEProtocol::merge_search_results(const std::vector<uint32_t>& base,
+                                                         const std::vector<uint32_t>& ours,
+                                                         const std::vector<uint32_t>& theirs) {
+    std::vector<uint32_t> added, removed, merged, result;
+    std::set_difference(ours.begin(), ours.end(), base.begin(), base.end(), std::back_inserter(added));
+    std::set_difference(base.begin(), base.end(), ours.begin(), ours.end(), std::back_inserter(removed));
+    std::set_union(theirs.begin(), theirs.end(), added.begin(), added.end(), std::back_inserter(merged));
+    std::set_difference(merged.begin(), merged.end(), removed.begin(), removed.end(), std::back_inserter(result));
+    return result;
+}
+
+// Wait until the modifications of the user's indexes are durable
+bool DSSEProtocol::commit(const std::string& user_id, UserIndex& index) {
+    // NOTE: the indexes are not held during the sync, the other requests keep appending.
+    if (!index.wal.commit()) {
+        log_error("Failed to commit the modifications", "user", user_id);
         return false;
     }
-    for (const auto& [key, value] : Sr_map) {
-        sr_out.write(reinterpret_cast<const char*>(key.data()), key.size());
-        size_t length = value.size();
-        sr_out.write(reinterpret_cast<const char*>(&length), sizeof(length));
-        sr_out.write(reinterpret_cast<const char*>(value.data()), value.size());
-    }
-
-    sr_out.close();
 
-    std::cout << "[✓] Search completed for user: " << user_id << "\n";
+    if (index.wal.size() > WAL_CHECKPOINT_SIZE) {
+        std::lock_guard lock(index.mutex);
+        if (!index.checkpoint()) {
+            log_error("Failed to checkpoint the indexes", "user", user_id);
+            return false;
+        }
+    }
     return true;
 }
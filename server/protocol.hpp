@@ -1,29 +1,87 @@
 #pragma once
 
+#include <array>
 #include <string>
 #include <vector>
-#include <unordered_map>
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include "config.hpp"
+#include "user_cache.hpp"
+#include "thread_pool.hpp"
 
 namespace fs = std::filesystem;
 
 constexpr uint64_t SYSTEM_CONSTANT = -2ULL;
 
-// Custom hash function for std::vector<uint8_t> to use in std::unordered_map
-struct VectorHash {
-    std::size_t operator()(const std::vector<uint8_t>& vec) const {
-        std::size_t hash = 0;
-        for (uint8_t byte : vec) {
-            hash = (hash * 31) + byte;
-        }
-        return hash;
-    }
-};
+// Background compaction of the Se tables, Sr logs and document segments
+constexpr size_t COMPACTION_BATCH = 4096;                       // Slots copied per step
+constexpr auto COMPACTION_PAUSE = std::chrono::milliseconds(5); // Pause between steps
+constexpr auto COMPACTION_INTERVAL = std::chrono::seconds(10);  // Pause between scans
+
+// Legacy per-document files are imported in batches of this size
+constexpr size_t LEGACY_IMPORT_BATCH = 16 << 20;
+
+// Maximum number of documents requested by a fetch
+constexpr uint64_t FETCH_MAX_DOCUMENTS = 1 << 20;
+
+// Maximum number of keywords of a batch search
+constexpr uint64_t SEARCH_MAX_KEYWORDS = 1 << 12;
+
+// Minimum number of epochs walked by a search task
+constexpr uint64_t SEARCH_MIN_EPOCHS = 256;
+
+// The indexes of a user are checkpointed once their write-ahead log exceeds this size
+constexpr size_t WAL_CHECKPOINT_SIZE = 64 << 20;
 
 // DSSE Protocol - Handles server-side storage and updates
 class DSSEProtocol {
 public:
-    explicit DSSEProtocol(const fs::path& base_storage_path);
+    // What step 1 of a search read, checked again by step 2
+    struct SearchBase {
+        std::vector<uint8_t> Sr_value;  // Sr[tw] (empty if none)
+        uint64_t se_updates = 0;        // UserIndex::se_updates when Se was walked
+        // Addrw of the entries of Se found, deleted by step 2 when it writes Sr[tw]
+        std::vector<std::array<uint8_t, SeTable::KEY_SIZE>> Addrw;
+        // The user's indexes walked: held until step 2, the user is never evicted
+        // while it has searches to finalize.
+        std::shared_ptr<UserIndex> index;
+    };
+
+    // A document received in place (see begin_document)
+    struct PendingDocument {
+        // The user's indexes: held until the document is finished, the user is never
+        // evicted while its record is being written.
+        std::shared_ptr<UserIndex> index;
+        std::unique_ptr<DocStore::Pending> record;
+    };
+
+    // A keyword searched: tw (location in Sr) and KTw
+    struct SearchQuery {
+        std::vector<uint8_t> tw;
+        std::vector<uint8_t> KTw;
+    };
+    // Step 1 results of a keyword
+    struct SearchResults {
+        std::vector<uint8_t> ID1;  // Previous search results (explicit index Sr)
+        std::vector<uint8_t> ID2;  // Encrypted results retrieved from Se
+        uint64_t newCon = 0;       // Updated counter for consistency across searches
+        SearchBase base;
+    };
+    // Step 2 of a keyword: the results confirmed by the client
+    struct SearchFinal {
+        std::vector<uint8_t> tw;
+        std::vector<uint8_t> ID1;      // UUIDs, or those added to the results of step 1 (changes)
+        std::vector<uint8_t> removed;  // UUIDs removed from the results of step 1 (changes)
+        bool changes = false;          // Conjunctive search: the results are (base ∪ ID1) \ removed
+        SearchBase base;  // Read by its step 1
+    };
+
+    explicit DSSEProtocol(const ServerConfig& config);
 
     // Process Se and Sr received from the client
     bool init_encrypted_index(const std::string& user_id, 
@@ -37,28 +95,119 @@ public:
     // Store encrypted documents
     bool store_encrypted_document(const std::string& user_id, 
                                   const std::vector<uint8_t>& document_data);
+
+    // Store an encrypted document written straight to its segment, without holding the
+    // user's indexes: begin_document reserves its record (header is UUID(128) + length(64)),
+    // the document is written to record->fd at record->offset + DocStore::HEADER_SIZE,
+    // then finish_document indexes it if it was written.
+    bool begin_document(const std::string& user_id, const uint8_t* header, PendingDocument& document);
+    bool finish_document(const std::string& user_id, PendingDocument& document, bool written);
+
+    // Delete encrypted documents, given their UUIDs
+    bool remove_encrypted_documents(const std::string& user_id,
+                                    const std::vector<uint8_t>& uuids);
     
-    // Search for a keyword in the encrypted index
+    // Locate the encrypted documents with the given UUIDs, to be streamed from their
+    // segments without holding the user's indexes
+    std::unique_ptr<DocStore::Snapshot> fetch_documents(const std::string& user_id,
+                                                        const std::vector<uint8_t>& uuids);
+
+    // Search for keywords in the encrypted index, one result per query. The keywords
+    // are searched together: the indexes are loaded and locked once, the epochs of all
+    // of them walked by the same parallel loop. Step 1 only reads the indexes: the
+    // entries found are deleted by step 2 (see SearchBase::Addrw).
     // Step 1: Process search request and return ID1 & ID2
-    bool search_keyword(const std::string& user_id,
-                        const std::vector<uint8_t>& tw,
-                        const std::vector<uint8_t>& KTw,
-                        uint64_t Con,
-                        std::vector<uint8_t>& ID1,
-                        std::vector<uint8_t>& ID2,
-                        uint64_t& newCon);
-
-    // Step 2: Finalize search results and update Sr
+    // A conjunctive search passes intersection: ID1 is left empty, and if no keyword
+    // has new entries (ID2) their results in Sr are up to date, intersection is set to
+    // the UUIDs in all of them.
+    bool search_keywords(const std::string& user_id,
+                         const std::vector<SearchQuery>& queries,
+                         uint64_t Con,
+                         std::vector<SearchResults>& results,
+                         std::optional<std::vector<uint8_t>>* intersection = nullptr);
+
+    // Step 2: Finalize search results and update Sr, for the keywords of a step 1
+    // The entries of Se found by step 1 are deleted with the write of Sr[tw], logged
+    // by the same record.
+    // If another search of tw was finalized since step 1, the documents added and
+    // removed by this one are merged into its results instead of replacing them.
+    // intersection (if given): set to the UUIDs in the results of every keyword now in Sr.
     bool search_finalize(const std::string& user_id,
-                         const std::vector<uint8_t>& tw,
-                         const std::vector<uint8_t>& ID1,
-                         uint64_t Con);
+                         const std::vector<SearchFinal>& finals,
+                         uint64_t Con,
+                         std::vector<uint8_t>* intersection = nullptr);
+
+    // Moves the storage of a user to another user id, unless the latter has one.
+    // Called before serving the users.
+    bool rename_user(const std::string& from, const std::string& to);
+    // Whether the user has a storage
+    bool has_user(const std::string& user_id);
+
+    // Returns the user's indexes from the cache (nullptr on failure)
+    std::shared_ptr<UserIndex> get_user_index(const std::string& user_id);
+
+    // Wait until the modifications of the user's indexes are durable, before
+    // acknowledging them. The commits of concurrent requests share a sync.
+    // The caller keeps index since the modifications: the user can't be closed
+    // meanwhile, and the sync threads never wait for the cache.
+    bool commit(const std::string& user_id, UserIndex& index);
+
+    // Sets how the evicted users are closed (see UserCache::set_closer)
+    void set_index_closer(UserCache::Closer closer) { cache.set_closer(std::move(closer)); }
+
+    UserCache::Stats cache_stats() const { return cache.stats(); }
+
+    // Sizes of the indexes of a resident user
+    struct UserStats {
+        std::string user_id;
+        size_t se_entries;      // Live entries of Se
+        size_t se_bytes;        // Size of the Se table file
+        size_t sr_keywords;     // Keywords with results in Sr
+        size_t sr_bytes;        // Size of the Sr log
+        size_t documents;
+        size_t document_bytes;  // Size of the document segments
+        size_t memory;          // Memory charged to the cache
+    };
+    std::vector<UserStats> user_stats() const;
 
 private:
     fs::path storage_path;
+    std::chrono::microseconds commit_window;
+
+    UserCache cache;  // Resident indexes of the users
+    ThreadPool search_pool;  // Walks the epochs of the searches
+
+    // Entries of Se found by the walk of a range of epochs
+    struct EpochResults {
+        std::vector<uint8_t> ID2;                                   // Eid || Con of each entry
+        std::vector<std::array<uint8_t, SeTable::KEY_SIZE>> Addrw;  // Addrw of each entry
+    };
+
+    // NOTE: declared last, it must be stopped before the indexes are destroyed.
+    std::jthread compactor;
 
     // Helpers
     bool is_valid_filename(const std::string& name);
     bool create_user_directory(const std::string& user_id);
-    std::string uuid_to_hex(const std::vector<uint8_t>& uuid);
+    bool open_se_table(const std::string& user_id, SeTable& table);
+    bool open_sr_log(const std::string& user_id, UserIndex& index);
+    bool open_doc_store(const std::string& user_id, DocStore& store);
+    std::shared_ptr<UserIndex> load_user_index(const std::string& user_id);
+    // Compacts the Se tables with too many tombstones and the Sr logs with too many
+    // superseded records, throttled to leave room to the requests
+    void compaction_loop(std::stop_token stop);
+    void compact_se(const std::string& user_id, UserIndex& index, std::stop_token stop);
+    void compact_sr(const std::string& user_id, UserIndex& index);
+    void compact_docs(const std::string& user_id, UserIndex& index);
+    // Walks the epochs [first, last] of a keyword in Se, without modifying it
+    static void walk_epochs(const SeTable& se_table, const std::vector<uint8_t>& KTw,
+                            uint64_t first, uint64_t last, EpochResults& results);
+    // Three-way merge of the results of a keyword (sorted ordinals): applies the
+    // changes from base to ours onto theirs
+    static std::vector<uint32_t> merge_search_results(const std::vector<uint32_t>& base,
+                                                      const std::vector<uint32_t>& ours,
+                                                      const std::vector<uint32_t>& theirs);
+    // The ordinals in all the lists (sorted): the smallest one is filtered by the
+    // others, in increasing size, until none is left
+    static std::vector<uint32_t> intersect_search_results(std::vector<std::vector<uint32_t>> lists);
 };
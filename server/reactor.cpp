@@ -0,0 +1,188 @@
+#include "reactor.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+// Events handled per epoll_wait call
+static constexpr int MAX_EVENTS = 64;
+
+Reactor::Reactor(size_t threads_count) {
+    if (threads_count == 0) threads_count = std::max(1u, std::thread::hardware_concurrency());
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    // Level-triggered and never read: once signaled it wakes every thread.
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_fd == -1 || stop_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &event) != 0) {
+        log_error("Failed to create the event loop", "error", std::strerror(errno));
+        return;
+    }
+
+    threads.reserve(threads_count);
+    for (size_t i = 0; i < threads_count; ++i) threads.emplace_back([this] { run(); });
+}
+
+Reactor::~Reactor() {
+    stop();
+    if (stop_fd != -1) ::close(stop_fd);
+    if (epoll_fd != -1) ::close(epoll_fd);
+}
+
+void Reactor::stop() {
+    if (threads.empty()) return;
+
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        log_error("Failed to stop the event loop");
+        return;
+    }
+    for (std::thread& thread : threads) thread.join();
+    threads.clear();
+}
+
+void Reactor::run() {
+    epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            log_error("Event loop failed", "error", std::strerror(errno));
+            return;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (!events[i].data.ptr) return;
+            // Errors and hang-ups resume the coroutine too, its next operation fails.
+            std::coroutine_handle<>::from_address(events[i].data.ptr).resume();
+        }
+    }
+}
+
+bool Reactor::Readiness::await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    epoll_event event{};
+    event.events = events | EPOLLONESHOT | EPOLLRDHUP;
+    event.data.ptr = awaiter.address();
+
+    // NOTE: once watched the coroutine may be resumed by another thread at any
+    // time, the awaiter must not be touched after a successful epoll_ctl.
+    int op = registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    registered = true;
+    if (epoll_ctl(reactor.epoll_fd, op, fd, &event) == 0) return true;
+
+    registered = op == EPOLL_CTL_MOD;
+    ok = false;
+    log_error("Failed to watch socket", "error", std::strerror(errno));
+    return false;
+}
+
+AsyncSocket::AsyncSocket(Reactor& reactor, int fd) : reactor(reactor), fd(fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        log_error("Failed to make socket non-blocking");
+        ::close(fd);
+        this->fd = -1;
+    }
+}
+
+AsyncSocket::~AsyncSocket() {
+    // Closing the socket removes it from the epoll instance.
+    if (fd != -1) ::close(fd);
+}
+
+Task<bool> AsyncSocket::read_exact(void* buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = ::read(fd, static_cast<uint8_t*>(buf) + done, size - done);
+        if (r > 0) {
+            done += r;
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r < 0 && errno == EAGAIN) {
+            if (!co_await reactor.wait(fd, EPOLLIN, registered)) co_return false;
+        } else {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+Task<bool> AsyncSocket::write_all(const void* buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = ::send(fd, static_cast<const uint8_t*>(buf) + done, size - done, MSG_NOSIGNAL);
+        if (r > 0) {
+            done += r;
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r < 0 && errno == EAGAIN) {
+            if (!co_await reactor.wait(fd, EPOLLOUT, registered)) co_return false;
+        } else {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+Task<bool> AsyncSocket::send_file(int in_fd, uint64_t offset, size_t size) {
+    off_t position = offset;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = sendfile(fd, in_fd, &position, size - done);
+        if (r > 0) {
+            done += r;
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r < 0 && errno == EAGAIN) {
+            if (!co_await reactor.wait(fd, EPOLLOUT, registered)) co_return false;
+        } else {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+Task<bool> AsyncSocket::receive_file(int out_fd, uint64_t offset, size_t size) {
+    // splice moves pages between a descriptor and a pipe.
+    // NOTE: only the socket side may block, the pipe is drained to the file at once.
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) co_return false;
+
+    loff_t position = offset;
+    size_t done = 0;
+    bool ok = true;
+    while (ok && done < size) {
+        ssize_t in = splice(fd, nullptr, pipe_fds[1], nullptr, size - done,
+                            SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && errno == EAGAIN) {
+            ok = co_await reactor.wait(fd, EPOLLIN, registered);
+            continue;
+        }
+        if (in <= 0) {
+            ok = false;
+            break;
+        }
+        for (ssize_t out = 0; out < in; ) {
+            ssize_t r = splice(pipe_fds[0], nullptr, out_fd, &position, in - out, SPLICE_F_MOVE);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                ok = false;
+                break;
+            }
+            out += r;
+        }
+        done += in;
+    }
+
+    ::close(pipe_fds[0]);
+    ::close(pipe_fds[1]);
+    co_return ok;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "coro.hpp"
+
+// epoll event loop resuming the coroutines waiting for their sockets.
+// Its threads share a single epoll instance: a socket is watched with EPOLLONESHOT
+// by the coroutine waiting for it, so an event resumes exactly one coroutine, on
+// the thread which received it.
+class Reactor {
+public:
+    // Runs the loop on `threads` threads (0: one per core).
+    explicit Reactor(size_t threads);
+    ~Reactor();
+
+    // Stops the threads. The coroutines still waiting are never resumed, the
+    // sockets can still be watched (without effect) until the reactor is destroyed.
+    void stop();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    size_t size() const { return threads.size(); }
+
+    // Suspends the awaiting coroutine until fd is ready for the events (EPOLLIN or
+    // EPOLLOUT), or fails. registered tells whether fd was added to the epoll instance.
+    // Returns false if fd could not be watched.
+    struct Readiness {
+        Reactor& reactor;
+        int fd;
+        uint32_t events;
+        bool& registered;
+        bool ok = true;
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> awaiter) noexcept;
+        bool await_resume() const noexcept { return ok; }
+    };
+    Readiness wait(int fd, uint32_t events, bool& registered) { return {*this, fd, events, registered}; }
+
+private:
+    int epoll_fd = -1;
+    int stop_fd = -1;  // eventfd waking every thread when the reactor stops
+    std::vector<std::thread> threads;
+
+    void run();
+};
+
+// Non-blocking socket whose operations suspend the calling coroutine until the
+// socket is ready, instead of blocking its thread.
+class AsyncSocket {
+public:
+    // Takes ownership of fd, which is switched to non-blocking mode.
+    AsyncSocket(Reactor& reactor, int fd);
+    ~AsyncSocket();
+
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+    explicit operator bool() const { return fd != -1; }
+    int handle() const { return fd; }
+
+    // Exactly size bytes, false if the connection is closed or fails first
+    Task<bool> read_exact(void* buf, size_t size);
+    Task<bool> write_all(const void* buf, size_t size);
+    // Copies size bytes at offset of in_fd to the socket in the kernel
+    Task<bool> send_file(int in_fd, uint64_t offset, size_t size);
+    // Copies size bytes from the socket to out_fd at offset in the kernel
+    Task<bool> receive_file(int out_fd, uint64_t offset, size_t size);
+
+private:
+    Reactor& reactor;
+    int fd;
+    bool registered = false;
+};
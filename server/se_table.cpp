@@ -0,0 +1,338 @@
+#include "se_table.hpp"
+#include "logger.hpp"
+#include "storage_engine.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+SeTable::~SeTable() {
+    close();
+}
+
+bool SeTable::open(const fs::path& path) {
+    close();
+    file_path = path;
+
+    std::error_code ec;
+    if (!StorageEngine::instance().exists(path, ec)) {
+        // A new table is synced at once, its header must survive a crash.
+        return map_file(path, INITIAL_CAPACITY, true) && sync();
+    }
+    return map_file(path, 0, false);
+}
+
+void SeTable::close() {
+    abort_compaction();
+
+    if (base) {
+        munmap(base, mapped_size);
+        base = nullptr;
+        mapped_size = 0;
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool SeTable::map_file(const fs::path& path, uint64_t capacity, bool create) {
+    fd = StorageEngine::instance().open(path, create ? O_CREAT | O_TRUNC : 0);
+    if (fd == -1) {
+        log_error("Cannot open Se table", "path", path);
+        return false;
+    }
+
+    if (create) {
+        mapped_size = file_size_for(capacity);
+        if (ftruncate(fd, mapped_size) != 0) {
+            log_error("Cannot allocate Se table", "path", path);
+            close();
+            return false;
+        }
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            log_error("Corrupted Se table", "path", path);
+            close();
+            return false;
+        }
+        mapped_size = st.st_size;
+    }
+
+    void* addr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        log_error("Cannot map Se table", "path", path);
+        base = nullptr;
+        close();
+        return false;
+    }
+    base = static_cast<uint8_t*>(addr);
+
+    if (create) {
+        std::memcpy(header()->magic, MAGIC, sizeof(MAGIC));
+        header()->capacity = capacity;
+        header()->count = 0;
+        header()->tombstones = 0;
+        header()->seed = flat::random_seed();
+        std::memset(ctrl(), flat::EMPTY, capacity);
+        return true;
+    }
+    if (std::memcmp(header()->magic, UNSEEDED_MAGIC, sizeof(UNSEEDED_MAGIC)) == 0) return upgrade();
+
+    // Validate an existing table.
+    uint64_t cap = header()->capacity;
+    if (std::memcmp(header()->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        cap < flat::GROUP_SIZE || (cap & (cap - 1)) != 0 ||
+        mapped_size != file_size_for(cap)) {
+        log_error("Corrupted Se table", "path", path);
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool SeTable::upgrade() {
+    // The fields before the seed are the same.
+    uint64_t cap = header()->capacity, count = header()->count;
+    if (cap < flat::GROUP_SIZE || (cap & (cap - 1)) != 0 ||
+        mapped_size != UNSEEDED_HEADER_SIZE + cap * (1 + sizeof(Slot))) {
+        log_error("Corrupted Se table", "path", file_path);
+        close();
+        return false;
+    }
+
+    fs::path tmp_path = file_path;
+    tmp_path += ".tmp";
+
+    SeTable upgraded;
+    upgraded.file_path = tmp_path;
+    if (!upgraded.map_file(tmp_path, capacity_for(count), true)) {
+        close();
+        return false;
+    }
+
+    const int8_t* control = reinterpret_cast<const int8_t*>(base + UNSEEDED_HEADER_SIZE);
+    const Slot* table = reinterpret_cast<const Slot*>(base + UNSEEDED_HEADER_SIZE + cap);
+    for (uint64_t i = 0; i < cap; ++i) {
+        if (flat::is_full(control[i])) upgraded.place(table[i].key, table[i].value);
+    }
+    if (!take_over(upgraded)) {
+        close();
+        return false;
+    }
+    log_info("Upgraded Se table", "path", file_path, "entries", count);
+    return true;
+}
+
+bool SeTable::sync() {
+    if (!base) return false;
+    if (msync(base, mapped_size, MS_SYNC) != 0) {
+        log_error("Failed to sync Se table", "path", file_path);
+        return false;
+    }
+    return true;
+}
+
+size_t SeTable::size() const {
+    return base ? header()->count : 0;
+}
+
+size_t SeTable::capacity() const {
+    return base ? header()->capacity : 0;
+}
+
+size_t SeTable::tombstones() const {
+    return base ? header()->tombstones : 0;
+}
+
+size_t SeTable::find_slot(const uint8_t* key) const {
+    const uint64_t key_hash = hash(key);
+    const int8_t tag = flat::h2(key_hash);
+    const int8_t* control = ctrl();
+    const Slot* table = slots();
+
+    // The load factor guarantees a group with an empty slot.
+    for (flat::ProbeSeq seq(key_hash, header()->capacity / flat::GROUP_SIZE); ; seq.next()) {
+        flat::Group group(control + seq.offset());
+        for (size_t bit : group.match(tag)) {
+            size_t i = seq.offset() + bit;
+            if (std::memcmp(table[i].key, key, KEY_SIZE) == 0) return i;
+        }
+        if (group.match_empty()) return NPOS;
+    }
+}
+
+size_t SeTable::find_free(uint64_t hash) const {
+    const int8_t* control = ctrl();
+    for (flat::ProbeSeq seq(hash, header()->capacity / flat::GROUP_SIZE); ; seq.next()) {
+        if (flat::BitMask free = flat::Group(control + seq.offset()).match_empty_or_deleted()) {
+            return seq.offset() + free.lowest();
+        }
+    }
+}
+
+void SeTable::place(const uint8_t* key, const uint8_t* value) {
+    const uint64_t key_hash = hash(key);
+    size_t i = find_free(key_hash);
+
+    if (ctrl()[i] == flat::DELETED) --header()->tombstones;
+    ctrl()[i] = flat::h2(key_hash);
+    std::memcpy(slots()[i].key, key, KEY_SIZE);
+    std::memcpy(slots()[i].value, value, VALUE_SIZE);
+    ++header()->count;
+}
+
+const uint8_t* SeTable::find(const uint8_t* key) const {
+    if (!base) return nullptr;
+
+    size_t i = find_slot(key);
+    return i == NPOS ? nullptr : slots()[i].value;
+}
+
+bool SeTable::insert(const uint8_t* key, const uint8_t* value) {
+    if (!base) return false;
+
+    if (size_t i = find_slot(key); i != NPOS) {
+        std::memcpy(slots()[i].value, value, VALUE_SIZE);
+    } else {
+        // Keep the load factor (tombstones included) below 3/4.
+        if ((header()->count + header()->tombstones + 1) * 4 > header()->capacity * 3 &&
+            !rehash(capacity_for(header()->count + 1))) {
+            return false;
+        }
+        place(key, value);
+    }
+
+    if (shadow && !shadow->insert(key, value)) abort_compaction();
+    return true;
+}
+
+bool SeTable::insert_serialized(const uint8_t* data, size_t size) {
+    if (size % ENTRY_SIZE != 0) {
+        log_error("Invalid Se size");
+        return false;
+    }
+
+    for (size_t i = 0; i < size; i += ENTRY_SIZE) {
+        if (!insert(data + i, data + i + KEY_SIZE)) return false;
+    }
+    return true;
+}
+
+bool SeTable::erase(const uint8_t* key) {
+    if (!base) return false;
+
+    size_t i = find_slot(key);
+    if (i == NPOS) return false;
+
+    // Wipe the entry: it must not be recoverable from the file.
+    std::memset(&slots()[i], 0, sizeof(Slot));
+    ctrl()[i] = flat::DELETED;
+    --header()->count;
+    ++header()->tombstones;
+
+    if (shadow) shadow->erase(key);
+    return true;
+}
+
+bool SeTable::rehash(uint64_t capacity) {
+    // A rehash drops every tombstone, a running compaction is useless.
+    abort_compaction();
+
+    fs::path tmp_path = file_path;
+    tmp_path += ".tmp";
+
+    SeTable rehashed;
+    rehashed.file_path = tmp_path;
+    if (!rehashed.map_file(tmp_path, capacity, true)) return false;
+
+    const int8_t* control = ctrl();
+    const Slot* table = slots();
+    for (uint64_t i = 0; i < header()->capacity; ++i) {
+        if (flat::is_full(control[i])) rehashed.place(table[i].key, table[i].value);
+    }
+
+    return take_over(rehashed);
+}
+
+bool SeTable::take_over(SeTable& other) {
+    // The new table must be durable before it replaces the current one.
+    if (!other.sync()) return false;
+
+    std::error_code ec;
+    StorageEngine::instance().rename(other.file_path, file_path, ec);
+    if (ec) {
+        log_error("Failed to replace Se table", "error", ec.message());
+        return false;
+    }
+
+    // Take over the new mapping.
+    close();
+    std::swap(fd, other.fd);
+    std::swap(base, other.base);
+    std::swap(mapped_size, other.mapped_size);
+    return true;
+}
+
+bool SeTable::needs_compaction() const {
+    if (!base || shadow) return false;
+
+    // Either the tombstones lengthen the probe sequences or the file can shrink.
+    return header()->tombstones * 4 >= header()->capacity ||
+           capacity_for(header()->count) < header()->capacity / 2;
+}
+
+bool SeTable::begin_compaction() {
+    if (!base) return false;
+    if (shadow) return true;
+
+    shadow = std::make_unique<SeTable>();
+    shadow->file_path = file_path;
+    shadow->file_path += ".compact";
+    if (!shadow->map_file(shadow->file_path, capacity_for(header()->count), true)) {
+        shadow.reset();
+        return false;
+    }
+    compaction_cursor = 0;
+    return true;
+}
+
+bool SeTable::compaction_step(size_t count) {
+    if (!shadow) return false;
+
+    const int8_t* control = ctrl();
+    const Slot* table = slots();
+    uint64_t end = std::min<uint64_t>(compaction_cursor + count, header()->capacity);
+    for (; compaction_cursor < end; ++compaction_cursor) {
+        const Slot& slot = table[compaction_cursor];
+        if (flat::is_full(control[compaction_cursor]) && !shadow->insert(slot.key, slot.value)) {
+            abort_compaction();
+            return false;
+        }
+    }
+    return compaction_cursor == header()->capacity;
+}
+
+bool SeTable::finish_compaction(CompactionStats& stats) {
+    if (!shadow || compaction_cursor != header()->capacity) return false;
+
+    std::unique_ptr<SeTable> compacted = std::move(shadow);
+    stats.bytes_before = mapped_size;
+    stats.bytes_after = compacted->mapped_size;
+    stats.tombstones = header()->tombstones;
+
+    return take_over(*compacted);
+}
+
+void SeTable::abort_compaction() {
+    if (!shadow) return;
+
+    fs::path path = shadow->file_path;
+    shadow.reset();
+
+    std::error_code ec;
+    StorageEngine::instance().remove(path, ec);
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include "flat_table.hpp"
+
+namespace fs = std::filesystem;
+
+// Persistent open-addressing hash table storing the encrypted index Se.
+// The table file is memory-mapped, so a lookup only touches the groups it probes
+// and an insertion updates the table in place (see flat_table.hpp for the probing).
+// Deleted entries are wiped and left as tombstones until the table is rehashed
+// or compacted. The keys are hashed with the seed of the table, random for every
+// file written (a table of the previous format is rehashed when opened).
+//
+// File layout: Header || capacity * control byte || capacity * Slot
+// Slot: Addrw (64) || Eid ⊕ H(Keyw || 0) (64) || Con (8) || rn (64)
+class SeTable {
+public:
+    static constexpr size_t KEY_SIZE = 64;               // Addrw
+    static constexpr size_t VALUE_SIZE = 64 + 8 + 64;    // (Eid ⊕ mask) || Con || rn
+    static constexpr size_t ENTRY_SIZE = KEY_SIZE + VALUE_SIZE;
+
+    // Outcome of a completed compaction
+    struct CompactionStats {
+        size_t bytes_before;   // Size of the table file before the compaction
+        size_t bytes_after;    // Size of the compacted table file
+        uint64_t tombstones;   // Tombstones dropped
+    };
+
+    SeTable() = default;
+    ~SeTable();
+
+    SeTable(const SeTable&) = delete;
+    SeTable& operator=(const SeTable&) = delete;
+
+    // Opens the table stored at path, creating an empty one if it doesn't exist.
+    bool open(const fs::path& path);
+    void close();
+    bool is_open() const { return base != nullptr; }
+
+    // Returns the value stored for Addrw, or nullptr if there is none.
+    // The pointer is valid until the next insertion or deletion.
+    const uint8_t* find(const uint8_t* key) const;
+
+    // Inserts (or overwrites) the entry Addrw -> value.
+    bool insert(const uint8_t* key, const uint8_t* value);
+
+    // Inserts every serialized Addrw || value entry of data.
+    bool insert_serialized(const uint8_t* data, size_t size);
+
+    // Deletes the entry Addrw, leaving a tombstone. Returns false if there is none.
+    bool erase(const uint8_t* key);
+
+    // Writes the modified pages of the mapping back to the file.
+    bool sync();
+
+    size_t size() const;
+    size_t capacity() const;
+    size_t tombstones() const;
+    size_t file_size() const { return mapped_size; }
+
+    // Incremental compaction: the live entries are copied in steps into a fresh
+    // table file, which then replaces the current one. Insertions and deletions
+    // performed in the meantime are mirrored to the new table.
+    bool needs_compaction() const;
+    bool begin_compaction();
+    // Copies the next `count` slots. Returns true once every slot is copied.
+    bool compaction_step(size_t count);
+    bool finish_compaction(CompactionStats& stats);
+    void abort_compaction();
+    bool is_compacting() const { return shadow != nullptr; }
+
+private:
+    static constexpr char MAGIC[8] = {'D', 'S', 'S', 'E', 'S', 'e', 'T', '4'};
+    // Tables hashing the first bytes of the keys, their header without the seed
+    static constexpr char UNSEEDED_MAGIC[8] = {'D', 'S', 'S', 'E', 'S', 'e', 'T', '3'};
+    static constexpr size_t UNSEEDED_HEADER_SIZE = 32;
+    static constexpr size_t INITIAL_CAPACITY = 1024;  // Must be a power of two.
+
+    struct Header {
+        char magic[8];
+        uint64_t capacity;    // Number of slots, power of two.
+        uint64_t count;       // Number of live entries.
+        uint64_t tombstones;  // Number of deleted entries.
+        uint64_t seed;        // Seed of the key hashes.
+    };
+
+    struct Slot {
+        uint8_t key[KEY_SIZE];
+        uint8_t value[VALUE_SIZE];
+    };
+
+    static constexpr size_t NPOS = -1;
+
+    fs::path file_path;
+    int fd = -1;
+    uint8_t* base = nullptr;
+    size_t mapped_size = 0;
+
+    // Compaction in progress
+    std::unique_ptr<SeTable> shadow;
+    uint64_t compaction_cursor = 0;
+
+    Header* header() const { return reinterpret_cast<Header*>(base); }
+    int8_t* ctrl() const { return reinterpret_cast<int8_t*>(base + sizeof(Header)); }
+    Slot* slots() const { return reinterpret_cast<Slot*>(base + sizeof(Header) + header()->capacity); }
+
+    static size_t file_size_for(uint64_t capacity) { return sizeof(Header) + capacity * (1 + sizeof(Slot)); }
+    // Smallest capacity keeping `entries` entries below half load
+    static uint64_t capacity_for(uint64_t entries) { return flat::capacity_for(entries, INITIAL_CAPACITY); }
+
+    // Maps a file holding a table with the given capacity (new files are zero-filled).
+    bool map_file(const fs::path& path, uint64_t capacity, bool create);
+    // Rehashes every live entry into a table with the given capacity.
+    bool rehash(uint64_t capacity);
+    // Replaces the current table (file and mapping) with other.
+    bool take_over(SeTable& other);
+    // Rewrites a table of the previous format (UNSEEDED_MAGIC) in the current one.
+    bool upgrade();
+    uint64_t hash(const uint8_t* key) const { return flat::hash_bytes(key, KEY_SIZE, header()->seed); }
+    // Returns the slot holding key, or NPOS.
+    size_t find_slot(const uint8_t* key) const;
+    // Returns the slot where an entry with the given hash can be inserted.
+    size_t find_free(uint64_t hash) const;
+    // Fills a free slot (the key must be absent).
+    void place(const uint8_t* key, const uint8_t* value);
+};
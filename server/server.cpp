@@ -1,161 +1,987 @@
 #include "server.hpp"
 #include <sockpp/unix_acceptor.h>
 #include <sockpp/unix_stream_socket.h>
-#include <iostream>
 #include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-DSSEServer::DSSEServer(const std::string& storage_path) : protocol(storage_path) {}
+static ComputePool::Pinning parse_pinning(const std::string& pinning) {
+    if (pinning == "none") return ComputePool::Pinning::none;
+    if (pinning == "node") return ComputePool::Pinning::node;
+    return ComputePool::Pinning::core;
+}
+
+static std::string uid_user(uid_t uid) {
+    return "user_" + std::to_string(uid);
+}
+
+// The user is the owner of the connected process, as told by the kernel.
+static bool peer_user(int fd, std::string& user_id) {
+    ucred credentials;
+    socklen_t size = sizeof(credentials);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0) return false;
+    user_id = uid_user(credentials.uid);
+    return true;
+}
+
+// Kind of request of an operation code, if measured
+static std::optional<MetricOp> metric_op(uint32_t code) {
+    switch (code) {
+        case OP_UPDATE: return MetricOp::update;
+        case OP_SEARCH:
+        case OP_SEARCH_BATCH:
+        case OP_SEARCH_AND: return MetricOp::search;
+        case OP_SEARCH_FINALIZE: return MetricOp::finalize;
+        case OP_FETCH: return MetricOp::fetch;
+        default: return std::nullopt;
+    }
+}
+
+// Search query of a session: t (256) + KT (256) + Con (64), or for a batch or conjunctive search
+// Con (64) + count (64) + t + KT of each keyword
+static bool parse_queries(const std::vector<uint8_t>& payload, bool batch,
+                          std::vector<DSSEProtocol::SearchQuery>& queries, uint64_t& Con) {
+    const uint8_t* data = payload.data();
+    uint64_t count = 1;
+    if (batch) {
+        if (payload.size() < sizeof(Con) + sizeof(count)) return false;
+        std::memcpy(&Con, data, sizeof(Con));
+        std::memcpy(&count, data + sizeof(Con), sizeof(count));
+        data += sizeof(Con) + sizeof(count);
+        if (count == 0 || count > SEARCH_MAX_KEYWORDS ||
+            payload.size() != sizeof(Con) + sizeof(count) + count * (32 + 32)) return false;
+    } else {
+        if (payload.size() != 32 + 32 + sizeof(Con)) return false;
+        std::memcpy(&Con, data + 32 + 32, sizeof(Con));
+    }
+    queries.resize(count);
+    for (auto& query : queries) {
+        query.tw.assign(data, data + 32);
+        query.KTw.assign(data + 32, data + 64);
+        data += 64;
+    }
+    return true;
+}
+
+// Takes count (8 bytes) + count UUIDs from the data left
+static bool take_uuids(const uint8_t*& data, size_t& remaining, std::vector<uint8_t>& uuids) {
+    uint64_t count;
+    if (remaining < sizeof(count)) return false;
+    std::memcpy(&count, data, sizeof(count));
+    data += sizeof(count);
+    remaining -= sizeof(count);
+    if (count > remaining / DocStore::UUID_SIZE) return false;
+    uuids.assign(data, data + count * DocStore::UUID_SIZE);
+    data += count * DocStore::UUID_SIZE;
+    remaining -= count * DocStore::UUID_SIZE;
+    return true;
+}
+
+// Step 2 of a search of a session: ID1 count (8 bytes) + ID1 of each keyword + Con (64).
+// For a conjunctive search, the UUIDs added then removed (count + UUIDs each) of each
+// keyword + Con: the results of step 1 are changed with them.
+static bool parse_finals(const std::vector<uint8_t>& payload, Session::PendingSearch& pending, uint64_t& Con) {
+    const uint8_t* data = payload.data();
+    size_t remaining = payload.size();
+    for (auto& final : pending.keywords) {
+        if (!take_uuids(data, remaining, final.ID1)) return false;
+        if (pending.conjunctive && !take_uuids(data, remaining, final.removed)) return false;
+        final.changes = pending.conjunctive;
+    }
+    if (remaining != sizeof(Con)) return false;
+    std::memcpy(&Con, data, sizeof(Con));
+    return true;
+}
+
+// Writes the results of a conjunctive search: count (8 bytes) + UUIDs
+static Task<bool> write_uuids(AsyncSocket& sock, const std::vector<uint8_t>& uuids) {
+    uint64_t count = uuids.size() / DocStore::UUID_SIZE;
+    bool written = co_await sock.write_all(&count, sizeof(count));
+    if (written) written = co_await sock.write_all(uuids.data(), uuids.size());
+    co_return written;
+}
+
+// Reads from the socket, adding the time it took to elapsed (nanoseconds)
+static Task<bool> read_timed(AsyncSocket& sock, void* data, size_t size, uint64_t& elapsed) {
+    Stopwatch reading;
+    bool received = co_await sock.read_exact(data, size);
+    elapsed += reading.elapsed_ns();
+    co_return received;
+}
+
+DSSEServer::DSSEServer(const ServerConfig& config)
+    : protocol(config),
+      admission({config.max_requests, config.max_inflight, config.user_requests, config.user_inflight}),
+      max_update(config.max_update),
+      max_request(config.max_request),
+      reactor(config.workers),
+      compute(config.shards, parse_pinning(config.pinning), config.sync_threads, config.load_report > 0) {
+    // The servers before the peer credentials served every client as LEGACY_USER:
+    // its storage is moved only to the uid given, no peer uid reaches it otherwise.
+    if (!config.legacy_uid.empty()) {
+        protocol.rename_user(LEGACY_USER, uid_user(std::stoul(config.legacy_uid)));
+    } else if (protocol.has_user(LEGACY_USER)) {
+        log_warning("Storage of the legacy user not served, see --legacy-uid", "user", LEGACY_USER);
+    }
+    // The evicted users are checkpointed by the sync threads, not by the requests
+    // evicting them (which may hold the indexes of another user).
+    protocol.set_index_closer([this](std::function<void()> close) {
+        compute.post_sync(std::move(close), ComputePool::Priority::bulk);
+    });
+
+    if (config.load_report > 0) {
+        std::chrono::seconds interval(config.load_report);
+        reporter = std::jthread([this, interval](std::stop_token stop) { report_load(stop, interval); });
+    }
+    metrics_server = std::jthread([this](std::stop_token stop) { serve_metrics(stop); });
+}
+
+DSSEServer::~DSSEServer() {
+    // No coroutine is resumed by the event loop anymore, then the compute pool
+    // resumes the ones already scheduled.
+    reporter = {};
+    metrics_server = {};
+    reactor.stop();
+    // The users evicted from now on are closed at once: the ones already posted run
+    // before the sync threads stop.
+    protocol.set_index_closer(nullptr);
+    compute.stop();
+}
 
 void DSSEServer::start() {
-    std::cout << "[+] Starting DSSE Server on " << SOCK_ADDR << "\n";
+    log_info("Starting DSSE Server", "address", std::string_view(SOCK_ADDR + 1), "event_loop_threads", reactor.size(),
+             "shards", compute.size(), "sync_threads", compute.sync_size());
 
     sockpp::unix_acceptor acc(sockpp::unix_address(SOCK_ADDR));
     if (!acc) {
-        std::cerr << "[ERROR] Failed to create socket: " << acc.last_error_str() << "\n";
+        log_error("Failed to create socket", "error", acc.last_error_str());
         return;
     }
 
     while (true) {
         sockpp::unix_stream_socket client_sock = acc.accept();
         if (!client_sock) {
-            std::cerr << "[ERROR] Accept failed: " << acc.last_error_str() << "\n";
+            log_error("Accept failed", "error", acc.last_error_str());
             continue;
         }
 
-        std::cout << "[+] Client connected.\n";
-        handle_client(std::move(client_sock));
+        log_debug("Client connected");
+        serve(client_sock.release());
     }
 }
 
-// Ensures full message reception
-bool DSSEServer::receive_exact(sockpp::unix_stream_socket& sock, void* buf, size_t len) {
-    size_t received = 0;
-    while (received < len) {
-        ssize_t r = sock.read(static_cast<uint8_t*>(buf) + received, len - received);
-        if (r <= 0) return false;
-        received += r;
+// Logs the load of the shards which ran tasks since the previous report
+void DSSEServer::report_load(std::stop_token stop, std::chrono::seconds interval) {
+    std::mutex wait_mutex;
+    std::condition_variable_any wakeup;
+    std::vector<ComputePool::Load> previous(compute.size(), ComputePool::Load{});
+
+    while (!stop.stop_requested()) {
+        std::unique_lock lock(wait_mutex);
+        if (wakeup.wait_for(lock, stop, interval, [] { return false; }) || stop.stop_requested()) return;
+
+        for (size_t shard = 0; shard < compute.size(); ++shard) {
+            ComputePool::Load load = compute.load(shard);
+            uint64_t tasks = load.tasks - previous[shard].tasks;
+            if (tasks == 0) continue;
+
+            double busy = 100.0 * (load.busy_ns - previous[shard].busy_ns) / std::chrono::nanoseconds(interval).count();
+            log_info("Shard load", "shard", shard, "tasks", tasks, "busy_percent", busy, "queued", load.queued,
+                     "hottest_user", load.hot_key, "hottest_user_tasks", load.hot_key_tasks);
+            previous[shard] = load;
+        }
     }
-    return true;
+}
+
+std::string DSSEServer::metrics_text() {
+    std::string out;
+    Metrics::instance().render(out);
+
+    UserCache::Stats cache = protocol.cache_stats();
+    append_family(out, "dsse_cache_hits_total", "counter", "Requests finding the indexes of their user resident");
+    append_sample(out, "dsse_cache_hits_total", "", cache.hits);
+    append_family(out, "dsse_cache_misses_total", "counter", "Requests loading the indexes of their user");
+    append_sample(out, "dsse_cache_misses_total", "", cache.misses);
+    append_family(out, "dsse_cache_evictions_total", "counter", "Users evicted from the cache");
+    append_sample(out, "dsse_cache_evictions_total", "", cache.evictions);
+    append_family(out, "dsse_cache_memory_bytes", "gauge", "Memory charged to the resident users");
+    append_sample(out, "dsse_cache_memory_bytes", "", cache.memory);
+    append_family(out, "dsse_cache_users", "gauge", "Resident users");
+    append_sample(out, "dsse_cache_users", "", cache.users);
+
+    Admission::Usage usage = admission.usage();
+    append_family(out, "dsse_inflight_requests", "gauge", "Requests in progress");
+    append_sample(out, "dsse_inflight_requests", "", usage.requests);
+    append_family(out, "dsse_inflight_bytes", "gauge", "Memory held by the requests in progress");
+    append_sample(out, "dsse_inflight_bytes", "", usage.bytes);
+
+    struct UserGauge {
+        std::string_view name;
+        std::string_view help;
+        size_t DSSEProtocol::UserStats::*value;
+    };
+    static constexpr UserGauge user_gauges[] = {
+        {"dsse_user_se_entries", "Live entries of the user's Se", &DSSEProtocol::UserStats::se_entries},
+        {"dsse_user_se_bytes", "Size of the user's Se table", &DSSEProtocol::UserStats::se_bytes},
+        {"dsse_user_sr_keywords", "Keywords with results in the user's Sr", &DSSEProtocol::UserStats::sr_keywords},
+        {"dsse_user_sr_bytes", "Size of the user's Sr log", &DSSEProtocol::UserStats::sr_bytes},
+        {"dsse_user_documents", "Documents of the user", &DSSEProtocol::UserStats::documents},
+        {"dsse_user_document_bytes", "Size of the user's document segments", &DSSEProtocol::UserStats::document_bytes},
+        {"dsse_user_memory_bytes", "Memory charged to the user in the cache", &DSSEProtocol::UserStats::memory},
+    };
+    // Only the resident users, whose indexes are open
+    std::vector<DSSEProtocol::UserStats> users = protocol.user_stats();
+    for (const UserGauge& gauge : user_gauges) {
+        append_family(out, gauge.name, "gauge", gauge.help);
+        for (const DSSEProtocol::UserStats& user : users) {
+            append_sample(out, gauge.name, "user=\"" + label_value(user.user_id) + "\"", user.*gauge.value);
+        }
+    }
+    return out;
+}
+
+// Serves one connection at a time: the metrics are rendered in a few milliseconds.
+// The spans of the tracer are served the same way, on demand.
+// NOTE: the socket is bound here, sockpp::unix_address can't hold an abstract name.
+void DSSEServer::serve_metrics(std::stop_token stop) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, METRICS_SOCK_ADDR, sizeof(METRICS_SOCK_ADDR) - 1);
+    socklen_t address_size = offsetof(sockaddr_un, sun_path) + sizeof(METRICS_SOCK_ADDR) - 1;
+
+    sockpp::unix_stream_socket acceptor(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!acceptor || ::bind(acceptor.handle(), reinterpret_cast<sockaddr*>(&address), address_size) != 0 ||
+        ::listen(acceptor.handle(), 16) != 0) {
+        log_error("Failed to create the metrics socket", "error", std::strerror(errno));
+        return;
+    }
+
+    while (!stop.stop_requested()) {
+        // Wakes up regularly to see the stop request
+        pollfd acceptable{acceptor.handle(), POLLIN, 0};
+        if (::poll(&acceptable, 1, 200) <= 0) continue;
+        sockpp::unix_stream_socket client(::accept4(acceptor.handle(), nullptr, nullptr, SOCK_CLOEXEC));
+        if (!client) continue;
+
+        timeval timeout{METRICS_SEND_TIMEOUT_MS / 1000, METRICS_SEND_TIMEOUT_MS % 1000 * 1000};
+        ::setsockopt(client.handle(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // An HTTP scraper sends its request first, read up to the blank line: the
+        // other clients only read.
+        std::string request;
+        pollfd readable{client.handle(), POLLIN, 0};
+        while (request.size() < 4096 && request.find("\r\n\r\n") == std::string::npos &&
+               ::poll(&readable, 1, METRICS_REQUEST_WAIT_MS) > 0) {
+            char buffer[1024];
+            ssize_t received = client.read(buffer, sizeof(buffer));
+            if (received <= 0) break;
+            request.append(buffer, received);
+        }
+
+        // GET /trace: the tracing spans instead
+        bool trace = request.starts_with("GET /trace");
+        std::string body = trace ? Tracer::instance().dump() : metrics_text();
+        if (request.starts_with("GET ")) {
+            std::string header = std::string("HTTP/1.0 200 OK\r\nContent-Type: ") +
+                                 (trace ? "application/json" : "text/plain; version=0.0.4") + "\r\n"
+                                 "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+            body.insert(0, header);
+        }
+        // NOTE: a scraper too slow to read them loses them after the timeout.
+        client.write_n(body.data(), body.size());
+    }
+}
+
+// Runs on the accepting thread until the connection first waits
+Detached DSSEServer::serve(int fd) {
+    AsyncSocket sock(reactor, fd);
+    if (!sock) co_return;
+
+    // A failed request must not stop the server.
+    try {
+        co_await handle_client(sock);
+    } catch (const std::exception& e) {
+        log_error("Exception while handling client", "error", e.what());
+    }
+    log_debug("Closing client connection");
 }
 
 // Handle client requests
-void DSSEServer::handle_client(sockpp::unix_stream_socket client_sock) {
-    // opcode is 4 byte:
-    // 0: add
-    // 1: remove
-    // 2: search
-    // uint8_t opcode;
+Task<void> DSSEServer::handle_client(AsyncSocket& sock) {
+    // opcode is 4 byte (see frame.hpp)
     uint32_t opcode;
-    if (!receive_exact(client_sock, &opcode, sizeof(opcode))) {
-        std::cerr << "[ERROR] Failed to receive operation code.\n";
-        return;
+    if (!co_await sock.read_exact(&opcode, sizeof(opcode))) {
+        log_error("Failed to receive operation code");
+        co_return;
+    }
+
+    std::string user_id;
+    if (!peer_user(sock.handle(), user_id)) {
+        log_error("Failed to identify the client user");
+        co_return;
     }
+    TraceContext trace{Tracer::instance().new_track(), 0, user_id};
+
+    if (opcode == OP_SESSION) {
+        log_info("Opening session", "user", user_id);
+        co_await handle_session(sock, user_id);
 
-    std::string user_id = "test_user";  // TODO: Authenticate user
+    } else if (opcode == OP_UPDATE) {
+        RequestTimer timer(MetricOp::update);
+        // NOTE: without a response, a refused update is only told by the closed connection.
+        auto ticket = admission.admit(user_id, UPDATE_BUFFER_SIZE);
+        if (!ticket) {
+            log_warning("Server busy, refusing the update", "user", user_id);
+            timer.refuse();
+            co_return;
+        }
+        TraceSpan span("update", trace);
+        bool received = co_await receive_update(sock, user_id, std::nullopt, trace);
+        if (received) timer.succeed();
 
-    if (opcode == 0) {  // Handle Update
-        std::cout << "[+] Handling UPDATE request.\n";
+    } else if (opcode == OP_SEARCH || opcode == OP_SEARCH_BATCH || opcode == OP_SEARCH_AND) {
+        co_await handle_search(sock, user_id, static_cast<Opcode>(opcode), trace);
 
-        // Receive encrypted index size
-        uint64_t index_size;
-        if (!receive_exact(client_sock, &index_size, sizeof(index_size))) {
-            std::cerr << "[ERROR] Failed to receive index size.\n";
-            return;
+    } else if (opcode == OP_FETCH) {
+        log_debug("Handling FETCH request");
+        Metrics& metrics = Metrics::instance();
+        RequestTimer timer(MetricOp::fetch);
+        TraceSpan fetch_span("fetch", trace);
+
+        // Receive the UUIDs: count (8 bytes) + UUID (16 bytes) each
+        uint64_t count;
+        Stopwatch receiving;
+        if (!co_await sock.read_exact(&count, sizeof(count)) || count > FETCH_MAX_DOCUMENTS) {
+            log_error("Failed to receive document count");
+            co_return;
+        }
+        auto ticket = admission.admit(user_id, count * DocStore::UUID_SIZE);
+        if (!ticket) {
+            log_warning("Server busy, refusing the fetch", "user", user_id);
+            timer.refuse();
+            co_await sock.write_all(&BUSY_SIZE, sizeof(BUSY_SIZE));
+            co_return;
         }
-        
-        // Receive encrypted index update (Se)
-        std::vector<uint8_t> Se_data(index_size);
-        if (!receive_exact(client_sock, Se_data.data(), Se_data.size())) {
-            std::cerr << "[ERROR] Failed to receive encrypted index Se.\n";
-            return;
+        std::vector<uint8_t> uuids(count * DocStore::UUID_SIZE);
+        if (!co_await sock.read_exact(uuids.data(), uuids.size())) {
+            log_error("Failed to receive document UUIDs");
+            co_return;
         }
+        metrics.phase(MetricOp::fetch, Phase::receive, receiving.elapsed_ns());
+        metrics.received(MetricOp::fetch, sizeof(opcode) + sizeof(count) + uuids.size());
 
-        // Receive document data size
-        uint64_t total_doc_size;
-        if (!receive_exact(client_sock, &total_doc_size, sizeof(total_doc_size))) {
-            std::cerr << "[ERROR] Failed to receive total document size.\n";
-            return;
+        TraceSpan queue_span("wait_shard", trace);
+        co_await compute.schedule(user_id, ComputePool::Priority::latency);
+        queue_span.end();
+        TraceSpan locate_span("locate_documents", trace);
+        auto snapshot = protocol.fetch_documents(user_id, uuids);
+        locate_span.end();
+        if (!snapshot) {
+            log_error("Fetch failed");
+            co_return;
         }
 
-        // Receive encrypted documents
-        std::vector<uint8_t> doc_data(total_doc_size);
-        if (!receive_exact(client_sock, doc_data.data(), doc_data.size())) {
-            std::cerr << "[ERROR] Failed to receive encrypted documents.\n";
-            return;
+        // Send response: count (8 bytes) + the stored record of each document
+        Stopwatch sending;
+        TraceSpan send_span("send", trace);
+        if (!co_await sock.write_all(&count, sizeof(count))) {
+            log_error("Failed to send document count");
+            co_return;
         }
+        if (!co_await send_documents(sock, *snapshot)) {
+            log_error("Failed to send documents");
+            co_return;
+        }
+        metrics.phase(MetricOp::fetch, Phase::send, sending.elapsed_ns());
+        metrics.sent(MetricOp::fetch, sizeof(count) + documents_size(*snapshot));
+        timer.succeed();
 
-        protocol.update_encrypted_index(user_id, Se_data);
-        protocol.store_encrypted_document(user_id, doc_data);
-        std::cout << "[✓] Update processed for user: " << user_id << "\n";
+        log_info("Sent encrypted documents", "user", user_id, "documents", count);
 
-    } else if (opcode == 2) {  // Handle Search
-        std::cout << "[+] Handling SEARCH request.\n";
+    } else {
+        log_error("Invalid operation code");
+    }
+}
 
-        // Receive search query: t (256) + KT (256) + Con (64)
-        std::vector<uint8_t> t(32), KT(32);
-        uint64_t Con;
-        if (!receive_exact(client_sock, t.data(), t.size()) ||
-            !receive_exact(client_sock, KT.data(), KT.size()) ||
-            !receive_exact(client_sock, &Con, sizeof(Con))) {
-            std::cerr << "[ERROR] Failed to receive search parameters.\n";
-            return;
+// A single search is t (256) + KT (256) + Con (64), a batch or conjunctive search
+// Con (64) + count (64) + t + KT of each keyword, on the same connection:
+// - a search is answered with ID1 size (8 bytes) + ID2 size (8 bytes) + ID1 + ID2 of
+//   each keyword, then confirmed by ID1 count (8 bytes) + ID1 of each keyword + Con (64)
+// - a conjunctive search is answered with ID2 size + ID2 of each keyword. If none of
+//   them has new entries, its results follow: count (8 bytes) + UUIDs. Otherwise they
+//   answer the confirmation: the UUIDs added, then removed, of each keyword
+//   (count + UUIDs each) + Con.
+Task<void> DSSEServer::handle_search(AsyncSocket& sock, const std::string& user_id, Opcode opcode,
+                                     const TraceContext& trace) {
+    log_debug("Handling SEARCH request");
+    Metrics& metrics = Metrics::instance();
+    RequestTimer timer(MetricOp::search);
+    const bool batch = opcode != OP_SEARCH;
+    const bool conjunctive = opcode == OP_SEARCH_AND;
+
+    uint64_t Con, count = 1;
+    uint64_t receiving = 0;  // Time spent reading from the socket
+    if (batch) {
+        bool received = co_await read_timed(sock, &Con, sizeof(Con), receiving);
+        if (received) received = co_await read_timed(sock, &count, sizeof(count), receiving);
+        if (!received || count == 0 || count > SEARCH_MAX_KEYWORDS) {
+            log_error("Failed to receive search keyword count");
+            co_return;
+        }
+    }
+
+    auto ticket = admission.admit(user_id, count * (32 + 32) + sizeof(Con));
+    if (!ticket) {
+        log_warning("Server busy, refusing the search", "user", user_id);
+        timer.refuse();
+        co_await sock.write_all(&BUSY_SIZE, sizeof(BUSY_SIZE));
+        co_return;
+    }
+    TraceSpan search_span("search", trace);
+
+    // Receive search query: t (256) + KT (256) of each keyword
+    std::vector<DSSEProtocol::SearchQuery> queries(count);
+    TraceSpan receive_span("receive", trace);
+    for (auto& query : queries) {
+        query.tw.resize(32);
+        query.KTw.resize(32);
+        bool received = co_await read_timed(sock, query.tw.data(), query.tw.size(), receiving);
+        if (received) received = co_await read_timed(sock, query.KTw.data(), query.KTw.size(), receiving);
+        if (!received) {
+            log_error("Failed to receive search parameters");
+            co_return;
         }
+    }
+    if (!batch) {
+        bool received = co_await read_timed(sock, &Con, sizeof(Con), receiving);
+        if (!received) {
+            log_error("Failed to receive search parameters");
+            co_return;
+        }
+    }
+    receive_span.end();
+    metrics.phase(MetricOp::search, Phase::receive, receiving);
+    metrics.received(MetricOp::search, sizeof(uint32_t) + (batch ? sizeof(count) : 0) + count * (32 + 32) + sizeof(Con));
 
-        std::cout << "[+] Searching.\n";
+    // Step 1: Perform search and send results back
+    std::vector<DSSEProtocol::SearchResults> results;
+    std::optional<std::vector<uint8_t>> intersection;  // Set if no keyword has new entries
+    bool found = co_await search(user_id, queries, Con, results, trace, conjunctive ? &intersection : nullptr);
+    if (!found) co_return;
 
-        // Step 1: Perform search and send results back
-        std::vector<uint8_t> ID1, ID2;
-        uint64_t newCon;
-        if (!protocol.search_keyword(user_id, t, KT, Con, ID1, ID2, newCon)) {
-            std::cerr << "[ERROR] Search failed.\n";
-            return;
+    // Send response: ID1 size (8 bytes) + ID2 size (8 bytes) + ID1 + ID2 of each keyword,
+    // only ID2 size + ID2 for a conjunctive search
+    uint64_t sent = 0;
+    const bool settled = intersection.has_value();
+    Stopwatch sending;
+    TraceSpan send_span("send", trace);
+    for (const auto& result : results) {
+        uint64_t sizes[2] = {result.ID1.size(), result.ID2.size()};
+        bool written;
+        if (conjunctive) {
+            written = co_await sock.write_all(&sizes[1], sizeof(sizes[1]));
+            sent += sizeof(sizes[1]) + result.ID2.size();
+        } else {
+            written = co_await sock.write_all(sizes, sizeof(sizes));
+            if (written) written = co_await sock.write_all(result.ID1.data(), result.ID1.size());
+            sent += sizeof(sizes) + result.ID1.size() + result.ID2.size();
         }
+        if (written) written = co_await sock.write_all(result.ID2.data(), result.ID2.size());
+        if (!written) {
+            log_error("Failed to send search results");
+            co_return;
+        }
+    }
+    if (settled) {
+        // The results in Sr are up to date: they were intersected right away.
+        bool written = co_await write_uuids(sock, *intersection);
+        if (!written) {
+            log_error("Failed to send search results");
+            co_return;
+        }
+        sent += sizeof(uint64_t) + intersection->size();
+    }
+    send_span.end();
+    search_span.end();
+    metrics.phase(MetricOp::search, Phase::send, sending.elapsed_ns());
+    metrics.sent(MetricOp::search, sent);
+    timer.succeed();
+    if (settled) {
+        log_info("Conjunctive search answered from Sr", "user", user_id, "keywords", count);
+        co_return;
+    }
 
-        // Send response: ID1 size (8 bytes) + ID2 size (8 bytes) + ID1 + ID2 + newCon (64)
-        // Send ID1 size (8 bytes) + ID2 size (8 bytes)
-        size_t ID1_size = ID1.size();
-        size_t ID2_size = ID2.size();
-        if (!client_sock.write(&ID1_size, sizeof(ID1_size)) ||
-            !client_sock.write(&ID2_size, sizeof(ID2_size))) {
-            std::cerr << "[ERROR] Failed to send search response sizes.\n";
-            return;
+    log_debug("Search step 1 response sent, waiting for the client confirmation");
+
+    // Step 2: Receive final confirmation: ID1 of each keyword, or the UUIDs added and
+    // removed of each keyword for a conjunctive search, + Con
+    uint64_t size;
+    TraceSpan wait_span("wait_finalize", trace);
+    if (!co_await sock.read_exact(&size, sizeof(size))) {
+        log_error("Failed to receive final ID1 size");
+        co_return;
+    }
+    wait_span.end();
+    // Timed from here: the client checked the results meanwhile.
+    RequestTimer finalize_timer(MetricOp::finalize);
+    TraceSpan finalize_span("finalize", trace);
+
+    std::vector<DSSEProtocol::SearchFinal> finals(count);
+    std::vector<Admission::Ticket> final_tickets;
+    uint64_t final_size = 0;  // Of the UUIDs of all the keywords, at most max_request
+    uint64_t final_receiving = 0;
+    TraceSpan final_receive_span("receive", trace);
+    for (size_t i = 0; i < count; ++i) {
+        DSSEProtocol::SearchFinal& final = finals[i];
+        final.tw = std::move(queries[i].tw);
+        final.base = std::move(results[i].base);
+        final.changes = conjunctive;
+
+        for (size_t j = 0; j < (conjunctive ? 2 : 1); ++j) {
+            if (i > 0 || j > 0) {
+                bool received = co_await read_timed(sock, &size, sizeof(size), final_receiving);
+                if (!received) {
+                    log_error("Failed to receive final ID1 size");
+                    co_return;
+                }
+            }
+            if (size > (max_request - final_size) / 16) {
+                log_error("Final search results too large");
+                co_return;
+            }
+            final_size += size * 16;
+
+            // Never refused: it completes a search already answered, whose user stays resident until then.
+            final_tickets.push_back(admission.force(user_id, size * 16));
+            std::vector<uint8_t>& list = j == 0 ? final.ID1 : final.removed;
+            list.resize(size * 16);
+            bool received = co_await read_timed(sock, list.data(), list.size(), final_receiving);
+            if (!received) {
+                log_error("Failed to receive final search results");
+                co_return;
+            }
         }
-        // Send ID1 and ID2
-        if (client_sock.write(ID1.data(), ID1.size()) != ID1.size() ||
-            client_sock.write(ID2.data(), ID2.size()) != ID2.size()) {
-            std::cerr << "[ERROR] Failed to send search results.\n";
-            return;
+    }
+    uint64_t final_Con;
+    bool received = co_await read_timed(sock, &final_Con, sizeof(final_Con), final_receiving);
+    if (!received) {
+        log_error("Failed to receive final search results");
+        co_return;
+    }
+    final_receive_span.end();
+    metrics.phase(MetricOp::finalize, Phase::receive, final_receiving);
+    metrics.received(MetricOp::finalize, count * (conjunctive ? 2 : 1) * sizeof(size) + final_size + sizeof(final_Con));
+
+    // Intersected as stored, with the results of concurrent searches merged
+    std::vector<uint8_t> matches;
+    bool finalized = co_await finalize_search(user_id, finals, final_Con, trace, conjunctive ? &matches : nullptr);
+    if (!finalized) co_return;
+
+    if (conjunctive) {
+        Stopwatch final_sending;
+        TraceSpan final_send_span("send", trace);
+        bool written = co_await write_uuids(sock, matches);
+        if (!written) {
+            log_error("Failed to send search results");
+            co_return;
         }
+        metrics.phase(MetricOp::finalize, Phase::send, final_sending.elapsed_ns());
+        metrics.sent(MetricOp::finalize, sizeof(uint64_t) + matches.size());
+    }
+    finalize_timer.succeed();
+}
 
-        std::cout << "[✓] Search step 1 response sent. Waiting for client confirmation...\n";
+// Reads the frames of a session until it is closed. The updates are received here,
+// in order, as their data is streamed to the storage; the other requests are read
+// whole and run apart, answering as soon as they are done.
+// A request refused by the admission control is skipped and answered as busy, the
+// session goes on.
+Task<void> DSSEServer::handle_session(AsyncSocket& sock, const std::string& user_id) {
+    auto session = std::make_shared<Session>(reactor, sock.handle(), user_id);
+    if (!*session) co_return;
 
-        // Step 2: Receive final confirmation (ID1 + Con)
-        size_t final_ID1_size;
-        if (!receive_exact(client_sock, &final_ID1_size, sizeof(final_ID1_size))) {
-            std::cerr << "[ERROR] Failed to receive final ID1 size.\n";
-            return;
+    Frame frame;
+    while (co_await sock.read_exact(&frame, sizeof(frame))) {
+        if (frame.code == OP_UPDATE) {
+            RequestTimer timer(MetricOp::update);
+            TraceContext trace{Tracer::instance().new_track(), frame.request_id, user_id};
+            TraceSpan span("update", trace);
+            if (frame.size > max_update) {
+                log_error("Update too large");
+                Session::respond(session, frame.request_id, STATUS_FAILED);
+                co_return;
+            }
+            auto ticket = admission.admit(user_id, std::min<uint64_t>(frame.size, UPDATE_BUFFER_SIZE));
+            if (!ticket) {
+                timer.refuse();
+                bool skipped = co_await skip_busy(sock, session, frame);
+                if (!skipped) co_return;
+                continue;
+            }
+            bool received = co_await receive_update(sock, user_id, frame.size, trace);
+            if (!received) {
+                // The rest of the frame can't be told from the next one.
+                Session::respond(session, frame.request_id, STATUS_FAILED);
+                co_return;
+            }
+            timer.succeed();
+            Session::respond(session, frame.request_id, STATUS_OK);
+            continue;
         }
 
-        std::vector<uint8_t> final_ID1(final_ID1_size * 16);
-        uint64_t final_Con;
-        if (!receive_exact(client_sock, final_ID1.data(), final_ID1.size()) ||
-            !receive_exact(client_sock, &final_Con, sizeof(final_Con))) {
-            std::cerr << "[ERROR] Failed to receive final search results.\n";
-            return;
+        if (frame.size > max_request) {
+            log_error("Session request too large");
+            co_return;
+        }
+        std::optional<Admission::Ticket> ticket;
+        if (frame.code == OP_SEARCH_FINALIZE) {
+            // Never refused: it completes a search already answered, whose user stays resident until then.
+            ticket = admission.force(user_id, frame.size);
+        } else {
+            ticket = admission.admit(user_id, frame.size);
+        }
+        std::optional<MetricOp> op = metric_op(frame.code);
+        if (!ticket) {
+            if (op) Metrics::instance().request(*op, Outcome::busy, 0);
+            bool skipped = co_await skip_busy(sock, session, frame);
+            if (!skipped) co_return;
+            continue;
         }
+        std::vector<uint8_t> payload(frame.size);
+        Stopwatch receiving;
+        TraceContext trace{Tracer::instance().new_track(), frame.request_id, user_id};
+        TraceSpan receive_span("receive", trace);
+        if (!co_await sock.read_exact(payload.data(), payload.size())) {
+            log_error("Failed to receive session request");
+            co_return;
+        }
+        receive_span.end();
+        if (op) {
+            Metrics::instance().phase(*op, Phase::receive, receiving.elapsed_ns());
+            Metrics::instance().received(*op, sizeof(frame) + payload.size());
+        }
+        run_request(session, frame, std::move(payload), std::move(*ticket), trace);
+    }
+}
+
+// NOTE: a refused update is still read, without being stored: its end can't be
+// found otherwise.
+Task<bool> DSSEServer::skip_busy(AsyncSocket& sock, std::shared_ptr<Session> session, Frame frame) {
+    log_warning("Server busy, refusing a request", "user", session->user_id);
+
+    std::vector<uint8_t> buffer(std::min<uint64_t>(frame.size, SKIP_BUFFER_SIZE));
+    for (uint64_t remaining = frame.size; remaining > 0; ) {
+        size_t size = std::min<uint64_t>(remaining, buffer.size());
+        bool received = co_await sock.read_exact(buffer.data(), size);
+        if (!received) co_return false;
+        remaining -= size;
+    }
+    Session::respond(std::move(session), frame.request_id, STATUS_BUSY);
+    co_return true;
+}
+
+// Runs a search, finalization or fetch of a session, then queues its response
+Detached DSSEServer::run_request(std::shared_ptr<Session> session, Frame frame, std::vector<uint8_t> payload,
+                                 Admission::Ticket ticket, TraceContext trace) {
+    Session::Response response{{frame.request_id, 0, STATUS_FAILED}, {}, nullptr, std::move(ticket),
+                               metric_op(frame.code), {}, trace};
+    TraceSpan span(frame.code == OP_SEARCH_FINALIZE ? "finalize" : frame.code == OP_FETCH ? "fetch" : "search", trace);
+    const std::string& user_id = session->user_id;
+
+    // Appends the raw bytes of a value to the response
+    auto append = [&](const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        response.body.insert(response.body.end(), bytes, bytes + size);
+    };
+    // Appends the results of a conjunctive search: count + UUIDs
+    auto append_uuids = [&](const std::vector<uint8_t>& uuids) {
+        uint64_t count = uuids.size() / DocStore::UUID_SIZE;
+        append(&count, sizeof(count));
+        append(uuids.data(), uuids.size());
+    };
+
+    try {
+        std::vector<DSSEProtocol::SearchQuery> queries;
+        uint64_t Con;
+        if ((frame.code == OP_SEARCH || frame.code == OP_SEARCH_BATCH || frame.code == OP_SEARCH_AND) &&
+            parse_queries(payload, frame.code != OP_SEARCH, queries, Con)) {
+            const bool conjunctive = frame.code == OP_SEARCH_AND;
+            std::vector<DSSEProtocol::SearchResults> results;
+            std::optional<std::vector<uint8_t>> intersection;  // Set if no keyword has new entries
+            bool found = co_await search(user_id, queries, Con, results, trace, conjunctive ? &intersection : nullptr);
+            if (found) {
+                // ID1 size + ID2 size + ID1 + ID2 of each keyword, only ID2 size + ID2
+                // for a conjunctive search
+                Session::PendingSearch pending{{}, conjunctive};
+                for (size_t i = 0; i < results.size(); ++i) {
+                    size_t ID1_size = results[i].ID1.size(), ID2_size = results[i].ID2.size();
+                    if (!conjunctive) append(&ID1_size, sizeof(ID1_size));
+                    append(&ID2_size, sizeof(ID2_size));
+                    if (!conjunctive) append(results[i].ID1.data(), results[i].ID1.size());
+                    append(results[i].ID2.data(), results[i].ID2.size());
+                    pending.keywords.push_back({std::move(queries[i].tw), {}, {}, false, std::move(results[i].base)});
+                }
+                if (intersection) {
+                    // The results in Sr are up to date: they were intersected right away.
+                    append_uuids(*intersection);
+                } else {
+                    // Parked before it is answered: step 2 can't arrive earlier.
+                    session->park_search(frame.request_id, std::move(pending));
+                }
+                response.frame.code = STATUS_OK;
+            }
+
+        } else if (frame.code == OP_SEARCH_FINALIZE) {
+            // ID1 count + ID1 of each keyword + Con (64), or the changes of each keyword
+            // for a conjunctive search
+            auto pending = session->take_search(frame.request_id);
+            if (pending && parse_finals(payload, *pending, Con)) {
+                // Intersected as stored, with the results of concurrent searches merged
+                std::vector<uint8_t> matches;
+                bool finalized = co_await finalize_search(user_id, pending->keywords, Con, trace,
+                                                          pending->conjunctive ? &matches : nullptr);
+                if (finalized) {
+                    if (pending->conjunctive) append_uuids(matches);
+                    response.frame.code = STATUS_OK;
+                }
+            }
+
+        } else if (frame.code == OP_FETCH && payload.size() >= sizeof(uint64_t)) {
+            // count + UUID (128) each
+            uint64_t count;
+            std::memcpy(&count, payload.data(), sizeof(count));
+            if (count <= FETCH_MAX_DOCUMENTS && payload.size() == sizeof(count) + count * DocStore::UUID_SIZE) {
+                std::vector<uint8_t> uuids(payload.begin() + sizeof(count), payload.end());
+                TraceSpan queue_span("wait_shard", trace);
+                co_await compute.schedule(user_id, ComputePool::Priority::latency);
+                queue_span.end();
+                TraceSpan locate_span("locate_documents", trace);
+                response.documents = protocol.fetch_documents(user_id, uuids);
+                locate_span.end();
+                if (response.documents) {
+                    append(&count, sizeof(count));
+                    response.frame.code = STATUS_OK;
+                }
+            }
 
-        // Finalize search
-        if (!protocol.search_finalize(user_id, t, final_ID1, final_Con)) {
-            std::cerr << "[ERROR] Search finalization failed.\n";
-            return;
+        } else {
+            log_error("Invalid session request");
         }
+    } catch (const std::exception& e) {
+        log_error("Exception while handling session request", "error", e.what());
+        response.documents.reset();
+        response.body.clear();
+        response.frame.code = STATUS_FAILED;
+    }
 
-        std::cout << "[✓] Search successfully finalized.\n";
+    if (response.frame.code != STATUS_OK) response.body.clear();
+    response.frame.size = response.body.size() + (response.documents ? documents_size(*response.documents) : 0);
+    span.end();
+    Session::respond(std::move(session), std::move(response));
+}
 
-    } else {
-        std::cerr << "[ERROR] Invalid operation code.\n";
+// Receives an update: index size (8 bytes) + Se' + documents size (8 bytes) + documents.
+// In a session its total size is known in advance and checked. The index and the
+// documents together must not exceed max_update.
+Task<bool> DSSEServer::receive_update(AsyncSocket& sock, const std::string& user_id, std::optional<uint64_t> size,
+                                      const TraceContext& trace) {
+    log_debug("Handling UPDATE request");
+    uint64_t receiving = 0;  // Time spent reading from the socket
+
+    // Receive encrypted index size
+    uint64_t index_size;
+    bool received = co_await read_timed(sock, &index_size, sizeof(index_size), receiving);
+    if (!received) {
+        log_error("Failed to receive index size");
+        co_return false;
+    }
+
+    if (index_size % SeTable::ENTRY_SIZE != 0 || index_size > max_update ||
+        (size && (*size < 2 * sizeof(uint64_t) || index_size > *size - 2 * sizeof(uint64_t)))) {
+        log_error("Invalid encrypted index size");
+        co_return false;
+    }
+
+    // The upload is processed as it arrives, through a buffer of fixed size.
+    std::vector<uint8_t> buffer;
+    buffer.reserve(UPDATE_BUFFER_SIZE);
+
+    // Receive encrypted index update (Se), inserted in chunks of whole entries
+    const uint64_t chunk_size = UPDATE_BUFFER_SIZE / SeTable::ENTRY_SIZE * SeTable::ENTRY_SIZE;
+    for (uint64_t remaining = index_size; remaining > 0; ) {
+        buffer.resize(std::min(remaining, chunk_size));
+        received = co_await read_timed(sock, buffer.data(), buffer.size(), receiving);
+        if (!received) {
+            log_error("Failed to receive encrypted index Se");
+            co_return false;
+        }
+        co_await compute.schedule(user_id, ComputePool::Priority::bulk);
+        TraceSpan span("insert_se", trace);
+        if (!protocol.update_encrypted_index(user_id, buffer)) {
+            log_error("Failed to update encrypted index Se");
+            co_return false;
+        }
+        remaining -= buffer.size();
+    }
+
+    // Receive document data size
+    uint64_t total_doc_size;
+    received = co_await read_timed(sock, &total_doc_size, sizeof(total_doc_size), receiving);
+    if (!received) {
+        log_error("Failed to receive total document size");
+        co_return false;
+    }
+    if (total_doc_size > max_update - index_size ||
+        (size && total_doc_size != *size - 2 * sizeof(uint64_t) - index_size)) {
+        log_error("Invalid document data size");
+        co_return false;
+    }
+
+    // Receive encrypted documents: UUID(128) + length(64) + document(length) each.
+    // The small ones are batched in the buffer, the others spliced to the store.
+    // NOTE: flush runs on the compute pool.
+    auto flush = [&] {
+        TraceSpan span("store_documents", trace);
+        bool stored = buffer.empty() || protocol.store_encrypted_document(user_id, buffer);
+        buffer.clear();
+        return stored;
+    };
+    buffer.clear();
+    for (uint64_t remaining = total_doc_size; remaining > 0; ) {
+        uint8_t header[DocStore::HEADER_SIZE];
+        uint64_t length;
+        if (remaining >= sizeof(header)) {
+            received = co_await read_timed(sock, header, sizeof(header), receiving);
+        }
+        if (remaining < sizeof(header) || !received) {
+            log_error("Failed to receive document header");
+            co_return false;
+        }
+        std::memcpy(&length, header + DocStore::UUID_SIZE, sizeof(length));
+        remaining -= sizeof(header);
+        if (length > remaining) {
+            log_error("Invalid document data format");
+            co_return false;
+        }
+        remaining -= length;
+
+        if (length >= UPDATE_SPLICE_MIN) {
+            // Keep the order of the documents.
+            co_await compute.schedule(user_id, ComputePool::Priority::bulk);
+            DSSEProtocol::PendingDocument document;
+            bool begun = flush() && protocol.begin_document(user_id, header, document);
+            if (!begun) {
+                log_error("Failed to store encrypted documents");
+                co_return false;
+            }
+            Stopwatch splicing;
+            TraceSpan splice_span("splice_document", trace);
+            bool written = co_await sock.receive_file(document.record->fd, document.record->offset + DocStore::HEADER_SIZE, length);
+            splice_span.end();
+            receiving += splicing.elapsed_ns();
+            // The document is synced before it is indexed.
+            co_await compute.schedule_sync(ComputePool::Priority::bulk);
+            if (!protocol.finish_document(user_id, document, written)) {
+                log_error("Failed to store encrypted documents");
+                co_return false;
+            }
+            continue;
+        }
+
+        if (buffer.size() + sizeof(header) + length > UPDATE_BUFFER_SIZE) {
+            co_await compute.schedule(user_id, ComputePool::Priority::bulk);
+            if (!flush()) {
+                log_error("Failed to store encrypted documents");
+                co_return false;
+            }
+        }
+        size_t record = buffer.size();
+        buffer.resize(record + sizeof(header) + length);
+        std::memcpy(buffer.data() + record, header, sizeof(header));
+        received = co_await read_timed(sock, buffer.data() + record + sizeof(header), length, receiving);
+        if (!received) {
+            log_error("Failed to receive encrypted documents");
+            co_return false;
+        }
+    }
+    co_await compute.schedule(user_id, ComputePool::Priority::bulk);
+    if (!flush()) {
+        log_error("Failed to store encrypted documents");
+        co_return false;
+    }
+    std::shared_ptr<UserIndex> index = protocol.get_user_index(user_id);
+    if (!index) {
+        log_error("Failed to open the indexes");
+        co_return false;
     }
+    TraceSpan commit_span("commit", trace);
+    co_await compute.schedule_sync(ComputePool::Priority::bulk);
+    if (!protocol.commit(user_id, *index)) co_return false;
+    commit_span.end();
 
-    std::cout << "[+] Closing client connection.\n";
+    Metrics& metrics = Metrics::instance();
+    metrics.phase(MetricOp::update, Phase::receive, receiving);
+    metrics.received(MetricOp::update, 2 * sizeof(uint64_t) + index_size + total_doc_size);
+    log_info("Update processed", "user", user_id);
+    co_return true;
 }
 
+// Search step 1, on the shard of the user
+Task<bool> DSSEServer::search(const std::string& user_id, const std::vector<DSSEProtocol::SearchQuery>& queries,
+                              uint64_t Con, std::vector<DSSEProtocol::SearchResults>& results,
+                              const TraceContext& trace, std::optional<std::vector<uint8_t>>* intersection) {
+    log_debug("Searching");
+
+    TraceSpan queue_span("wait_shard", trace);
+    co_await compute.schedule(user_id, ComputePool::Priority::latency);
+    queue_span.end();
+    bool found;
+    {
+        TraceScope scope(trace);
+        found = protocol.search_keywords(user_id, queries, Con, results, intersection);
+    }
+    if (!found) {
+        log_error("Search failed");
+        co_return false;
+    }
+    // Nothing to commit: step 1 only reads the indexes.
+    co_return true;
+}
+
+// Search step 2: stores the results confirmed by the client (ID1 of each keyword + Con)
+Task<bool> DSSEServer::finalize_search(const std::string& user_id, const std::vector<DSSEProtocol::SearchFinal>& finals,
+                                       uint64_t Con, const TraceContext& trace,
+                                       std::vector<uint8_t>* intersection) {
+    TraceSpan queue_span("wait_shard", trace);
+    co_await compute.schedule(user_id, ComputePool::Priority::latency);
+    queue_span.end();
+    bool finalized;
+    {
+        TraceScope scope(trace);
+        finalized = protocol.search_finalize(user_id, finals, Con, intersection);
+    }
+    if (!finalized) {
+        log_error("Search finalization failed");
+        co_return false;
+    }
+    std::shared_ptr<UserIndex> index = protocol.get_user_index(user_id);
+    if (!index) {
+        log_error("Failed to open the indexes");
+        co_return false;
+    }
+    TraceSpan commit_span("commit", trace);
+    co_await compute.schedule_sync(ComputePool::Priority::latency);
+    if (!protocol.commit(user_id, *index)) {
+        log_error("Search finalization failed");
+        co_return false;
+    }
+    commit_span.end();
+
+    log_info("Search successfully finalized");
+    co_return true;
+}
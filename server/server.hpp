@@ -1,22 +1,96 @@
 #pragma once
 
-#include <sockpp/unix_stream_socket.h>
 #include <sockpp/unix_acceptor.h>
 #include "protocol.hpp"
+#include "config.hpp"
+#include "coro.hpp"
+#include "reactor.hpp"
+#include "compute_pool.hpp"
+#include "session.hpp"
+#include "admission.hpp"
+#include "frame.hpp"
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <stop_token>
+#include <thread>
 #include <vector>
-#include <iostream>
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 
 #define SOCK_ADDR "\0dsse_apocm"  // Abstract namespace Unix socket
+#define METRICS_SOCK_ADDR "\0dsse_apocm_metrics"
+// User of every client of the servers before the peer credentials
+#define LEGACY_USER "test_user"
 
+// An update is received in a buffer of this size, whatever the size of the upload
+constexpr size_t UPDATE_BUFFER_SIZE = 1 << 20;
+// Documents from this size are spliced from the socket to their segment, the
+// smaller ones are stored in batches from the buffer
+constexpr uint64_t UPDATE_SPLICE_MIN = 64 << 10;
+// Bytes refused requests are skipped by
+constexpr size_t SKIP_BUFFER_SIZE = 64 << 10;
+// A scraper of the metrics sending an HTTP request does it within this time
+constexpr int METRICS_REQUEST_WAIT_MS = 100;
+// Longest wait for a scraper reading the metrics
+constexpr int METRICS_SEND_TIMEOUT_MS = 1000;
+
+// Connections are accepted by the thread calling start() and handled by coroutines:
+// they wait for their socket on the event loop (reactor) and run the requests on
+// the shard of the compute pool owning their user, so that a few threads serve any
+// number of slow or idle clients. The user is the owner of the client process.
+// A connection serves one request, or many in a session (see frame.hpp).
+// The requests are admitted under limits on their number and memory (see
+// admission.hpp), the sizes announced by the clients are checked against the
+// largest allowed before anything is allocated, and the shards run the searches
+// and fetches ahead of the updates.
+// The metrics are served on a second socket (METRICS_SOCK_ADDR), by a thread of
+// their own: each connection gets them once in the Prometheus text format, as an
+// HTTP response if it sends a GET request. GET /trace returns the tracing spans
+// instead (see trace.hpp).
 class DSSEServer {
 public:
-    explicit DSSEServer(const std::string& storage_path);
+    explicit DSSEServer(const ServerConfig& config);
+    ~DSSEServer();
     void start();
 
 private:
     DSSEProtocol protocol;  // Handles encrypted index & document storage
-    void handle_client(sockpp::unix_stream_socket client_sock);
-    bool receive_exact(sockpp::unix_stream_socket& sock, void* buf, size_t len);
+    Admission admission;
+    const uint64_t max_update;
+    const uint64_t max_request;  // Requests read whole
+    // NOTE: declared after the protocol, they are stopped before it is destroyed.
+    Reactor reactor;
+    ComputePool compute;
+    std::jthread reporter;  // Reports the load of the shards
+    std::jthread metrics_server;
+
+    // Handles a connection until it is closed
+    Detached serve(int fd);
+    Task<void> handle_client(AsyncSocket& sock);
+    // Both steps of a search (single, batch or conjunctive) without a session
+    Task<void> handle_search(AsyncSocket& sock, const std::string& user_id, Opcode opcode, const TraceContext& trace);
+    Task<void> handle_session(AsyncSocket& sock, const std::string& user_id);
+    Detached run_request(std::shared_ptr<Session> session, Frame frame, std::vector<uint8_t> payload,
+                         Admission::Ticket ticket, TraceContext trace);
+    // Skips the rest of a refused request of a session and answers it as busy
+    Task<bool> skip_busy(AsyncSocket& sock, std::shared_ptr<Session> session, Frame frame);
+
+    // The steps of the requests, shared by both protocols, traced in the track of trace
+    // size: of the whole update, if known in advance
+    Task<bool> receive_update(AsyncSocket& sock, const std::string& user_id, std::optional<uint64_t> size,
+                              const TraceContext& trace);
+    // intersection (conjunctive search): see DSSEProtocol::search_keywords and search_finalize
+    Task<bool> search(const std::string& user_id, const std::vector<DSSEProtocol::SearchQuery>& queries, uint64_t Con,
+                      std::vector<DSSEProtocol::SearchResults>& results, const TraceContext& trace,
+                      std::optional<std::vector<uint8_t>>* intersection = nullptr);
+    Task<bool> finalize_search(const std::string& user_id, const std::vector<DSSEProtocol::SearchFinal>& finals,
+                               uint64_t Con, const TraceContext& trace, std::vector<uint8_t>* intersection = nullptr);
+    void report_load(std::stop_token stop, std::chrono::seconds interval);
+    void serve_metrics(std::stop_token stop);
+    // The metrics of the requests, the resident users and the admission control
+    std::string metrics_text();
 };
 
 
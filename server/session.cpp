@@ -0,0 +1,100 @@
+#include "session.hpp"
+#include "logger.hpp"
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+Task<bool> send_documents(AsyncSocket& sock, const DocStore::Snapshot& snapshot) {
+    for (const auto& record : snapshot.records) {
+        bool sent;
+        if (record.fd == -1) {
+            uint8_t missing[DocStore::HEADER_SIZE];
+            std::memcpy(missing, record.uuid.data(), DocStore::UUID_SIZE);
+            std::memset(missing + DocStore::UUID_SIZE, 0xff, sizeof(missing) - DocStore::UUID_SIZE);
+            sent = co_await sock.write_all(missing, sizeof(missing));
+        } else {
+            sent = co_await sock.send_file(record.fd, record.offset, record.size);
+        }
+        if (!sent) co_return false;
+    }
+    co_return true;
+}
+
+uint64_t documents_size(const DocStore::Snapshot& snapshot) {
+    uint64_t size = 0;
+    for (const auto& record : snapshot.records) size += record.fd == -1 ? DocStore::HEADER_SIZE : record.size;
+    return size;
+}
+
+Session::Session(Reactor& reactor, int fd, std::string user_id)
+    : user_id(std::move(user_id)), out(reactor, ::dup(fd)) {}
+
+Detached Session::respond(std::shared_ptr<Session> session, Response response) {
+    {
+        std::lock_guard lock(session->mutex);
+        if (session->broken) co_return;
+        session->responses.push_back(std::move(response));
+        if (session->writing) co_return;
+        session->writing = true;
+    }
+
+    for (;;) {
+        Response next;
+        {
+            std::lock_guard lock(session->mutex);
+            if (session->responses.empty()) {
+                session->writing = false;
+                co_return;
+            }
+            next = std::move(session->responses.front());
+            session->responses.pop_front();
+        }
+
+        Stopwatch sending;
+        TraceSpan span("send", next.trace);
+        bool sent = co_await session->write(next);
+        span.end();
+        if (next.op) {
+            Metrics& metrics = Metrics::instance();
+            metrics.phase(*next.op, Phase::send, sending.elapsed_ns());
+            metrics.sent(*next.op, sizeof(next.frame) + next.frame.size);
+            metrics.request(*next.op, sent && next.frame.code == STATUS_OK ? Outcome::ok : Outcome::failed,
+                            next.started.elapsed_ns());
+        }
+        if (!sent) {
+            log_error("Failed to send a response, closing the session");
+            std::lock_guard lock(session->mutex);
+            session->broken = true;
+            session->responses.clear();
+            session->writing = false;
+            // Wakes the connection waiting for the next request.
+            ::shutdown(session->out.handle(), SHUT_RDWR);
+            co_return;
+        }
+    }
+}
+
+void Session::respond(std::shared_ptr<Session> session, uint64_t request_id, Status status) {
+    respond(std::move(session), Response{{request_id, 0, status}, {}, nullptr, std::nullopt, std::nullopt, {}, {}});
+}
+
+Task<bool> Session::write(const Response& response) {
+    bool sent = co_await out.write_all(&response.frame, sizeof(response.frame));
+    if (sent) sent = co_await out.write_all(response.body.data(), response.body.size());
+    if (sent && response.documents) sent = co_await send_documents(out, *response.documents);
+    co_return sent;
+}
+
+void Session::park_search(uint64_t request_id, PendingSearch search) {
+    std::lock_guard lock(mutex);
+    searches.insert_or_assign(request_id, std::move(search));
+}
+
+std::optional<Session::PendingSearch> Session::take_search(uint64_t request_id) {
+    std::lock_guard lock(mutex);
+    auto it = searches.find(request_id);
+    if (it == searches.end()) return std::nullopt;
+    PendingSearch search = std::move(it->second);
+    searches.erase(it);
+    return search;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "frame.hpp"
+#include "admission.hpp"
+#include "coro.hpp"
+#include "reactor.hpp"
+#include "protocol.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+// Sends the stored records of a snapshot (UUID + length + document), or UUID +
+// UINT64_MAX for the missing documents. The records are copied from the segments
+// to the socket by the kernel.
+Task<bool> send_documents(AsyncSocket& sock, const DocStore::Snapshot& snapshot);
+// Bytes sent by send_documents
+uint64_t documents_size(const DocStore::Snapshot& snapshot);
+
+// State of a connection carrying many requests (see frame.hpp), shared by the
+// requests in progress.
+// The responses are queued and written one at a time by the request finding the
+// socket free. They are written to a duplicate of the connection, watched apart:
+// a response can wait for the socket while the connection waits for the next request.
+class Session {
+public:
+    struct Response {
+        Frame frame;
+        std::vector<uint8_t> body;
+        std::unique_ptr<DocStore::Snapshot> documents;  // Sent after the body, if any
+        std::optional<Admission::Ticket> ticket;        // The request is in progress until it is sent
+        std::optional<MetricOp> op;                     // Request recorded once it is sent
+        Stopwatch started;                              // Since the request was read
+        TraceContext trace;                             // Its sending is traced in it
+    };
+
+    // Search between its two steps: tw and the base of each keyword, their ID1 come with
+    // step 2 (a conjunctive search keeps the ones of step 1, changed by step 2)
+    struct PendingSearch {
+        std::vector<DSSEProtocol::SearchFinal> keywords;
+        bool conjunctive = false;
+    };
+
+    // Writes to a duplicate of fd (which stays owned by the caller).
+    Session(Reactor& reactor, int fd, std::string user_id);
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    explicit operator bool() const { return static_cast<bool>(out); }
+
+    const std::string user_id;
+
+    // Queues a response, then writes the queued ones unless another request does.
+    // A failed write shuts the connection down and drops the other responses.
+    static Detached respond(std::shared_ptr<Session> session, Response response);
+    static void respond(std::shared_ptr<Session> session, uint64_t request_id, Status status);
+
+    void park_search(uint64_t request_id, PendingSearch search);
+    std::optional<PendingSearch> take_search(uint64_t request_id);
+
+private:
+    AsyncSocket out;
+
+    std::mutex mutex;
+    std::deque<Response> responses;
+    bool writing = false;  // A request is writing the queued responses
+    bool broken = false;
+    std::unordered_map<uint64_t, PendingSearch> searches;
+
+    Task<bool> write(const Response& response);
+};
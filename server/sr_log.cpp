@@ -0,0 +1,273 @@
+#include "sr_log.hpp"
+#include "file_io.hpp"
+#include "io_batch.hpp"
+#include "logger.hpp"
+#include "storage_engine.hpp"
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+SrLog::Compaction::~Compaction() {
+    if (source_fd != -1) ::close(source_fd);
+    if (target_fd != -1) {
+        ::close(target_fd);
+        std::error_code ec;
+        StorageEngine::instance().remove(target_path, ec);
+    }
+}
+
+SrLog::~SrLog() {
+    close();
+}
+
+bool SrLog::open(const fs::path& path) {
+    close();
+    file_path = path;
+
+    fd = StorageEngine::instance().open(path, O_CREAT);
+    if (fd == -1) {
+        log_error("Cannot open Sr log", "path", path);
+        return false;
+    }
+
+    if (!scan(fd, 0, index, end, live)) {
+        log_error("Failed to read Sr log", "path", path);
+        close();
+        return false;
+    }
+    return true;
+}
+
+void SrLog::close() {
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    index.clear();
+    end = live = 0;
+    ++generation;
+}
+
+bool SrLog::scan(int fd, uint64_t from, Index& index, uint64_t& end, uint64_t& live) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+    const uint64_t size = st.st_size;
+
+    uint64_t offset = from;
+    uint8_t header[HEADER_SIZE];
+    while (offset + HEADER_SIZE <= size) {
+        if (!read_at(fd, header, HEADER_SIZE, offset)) return false;
+
+        uint64_t length;
+        std::memcpy(&length, header + KEY_SIZE, sizeof(length));
+        if (length > size - offset - HEADER_SIZE) break;
+
+        Key key;
+        std::memcpy(key.data(), header, KEY_SIZE);
+
+        // A later record supersedes the previous one.
+        auto [location, inserted] = index.try_emplace(key, Location{offset, length});
+        if (!inserted) {
+            live -= HEADER_SIZE + location->length;
+            *location = Location{offset, length};
+        }
+        live += HEADER_SIZE + length;
+        offset += HEADER_SIZE + length;
+    }
+
+    if (offset != size) {
+        log_warning("Truncating partial Sr record");
+        if (ftruncate(fd, offset) != 0) return false;
+    }
+    end = offset;
+    return true;
+}
+
+bool SrLog::get(const uint8_t* tw, std::vector<uint8_t>& value) const {
+    Key key;
+    std::memcpy(key.data(), tw, KEY_SIZE);
+
+    const Location* location = index.find(key);
+    if (!location) return false;
+
+    value.resize(location->length);
+    if (!read_at(fd, value.data(), value.size(), location->offset + HEADER_SIZE)) {
+        log_error("Failed to read Sr record");
+        return false;
+    }
+    return true;
+}
+
+std::vector<SrLog::Key> SrLog::keys() const {
+    std::vector<Key> result;
+    result.reserve(index.size());
+    index.for_each([&](const Key& key, const Location&) { result.push_back(key); });
+    return result;
+}
+
+bool SrLog::put(const uint8_t* tw, const std::vector<uint8_t>& value) {
+    if (fd == -1) return false;
+
+    std::vector<uint8_t> record(HEADER_SIZE + value.size());
+    uint64_t length = value.size();
+    std::memcpy(record.data(), tw, KEY_SIZE);
+    std::memcpy(record.data() + KEY_SIZE, &length, sizeof(length));
+    std::memcpy(record.data() + HEADER_SIZE, value.data(), value.size());
+
+    if (!write_at(fd, record.data(), record.size(), end)) {
+        log_error("Failed to append Sr record");
+        return false;
+    }
+
+    Key key;
+    std::memcpy(key.data(), tw, KEY_SIZE);
+    auto [location, inserted] = index.try_emplace(key, Location{end, length});
+    if (!inserted) {
+        live -= HEADER_SIZE + location->length;
+        *location = Location{end, length};
+    }
+    live += record.size();
+    end += record.size();
+    return true;
+}
+
+bool SrLog::reset(const std::vector<uint8_t>& serialized) {
+    if (fd == -1) return false;
+
+    index.clear();
+    end = live = 0;
+    ++generation;
+
+    if (ftruncate(fd, 0) != 0 || !write_at(fd, serialized.data(), serialized.size(), 0)) {
+        log_error("Failed to write Sr log");
+        return false;
+    }
+    return scan(fd, 0, index, end, live);
+}
+
+bool SrLog::sync() {
+    if (fd == -1) return false;
+    if (!StorageEngine::instance().sync(fd)) {
+        log_error("Failed to sync Sr log", "path", file_path);
+        return false;
+    }
+    return true;
+}
+
+bool SrLog::needs_compaction() const {
+    uint64_t dead = end - live;
+    return fd != -1 && dead >= MIN_DEAD_BYTES && dead >= live;
+}
+
+std::unique_ptr<SrLog::Compaction> SrLog::begin_compaction() {
+    if (fd == -1) return nullptr;
+
+    auto compaction = std::make_unique<Compaction>();
+    compaction->generation = generation;
+    compaction->snapshot_end = end;
+    compaction->target_path = file_path;
+    compaction->target_path += ".compact";
+
+    compaction->source_fd = dup(fd);
+    compaction->target_fd = StorageEngine::instance().open(compaction->target_path, O_CREAT | O_TRUNC);
+    if (compaction->source_fd == -1 || compaction->target_fd == -1) {
+        log_error("Cannot start Sr compaction");
+        return nullptr;
+    }
+
+    // Copy the records in log order for sequential reads.
+    compaction->records.reserve(index.size());
+    index.for_each([&](const Key& key, const Location& location) {
+        compaction->records.emplace_back(key, location);
+    });
+    std::sort(compaction->records.begin(), compaction->records.end(),
+              [](const auto& a, const auto& b) { return a.second.offset < b.second.offset; });
+    return compaction;
+}
+
+bool SrLog::compaction_copy(Compaction& compaction) {
+    // NOTE: the log is append-only, the records before snapshot_end are immutable.
+    // The records of a chunk are read in one batch, then written at once: they are
+    // contiguous in the compacted log.
+    std::vector<uint8_t> chunk;
+    IoBatch batch;
+    for (size_t first = 0; first < compaction.records.size(); ) {
+        size_t last = first, size = 0;
+        do {
+            size += HEADER_SIZE + compaction.records[last++].second.length;
+        } while (last < compaction.records.size() && size < COPY_CHUNK_SIZE);
+
+        chunk.resize(size);
+        for (size_t i = first, position = 0; i < last; ++i) {
+            const Location& location = compaction.records[i].second;
+            batch.read(compaction.source_fd, chunk.data() + position, HEADER_SIZE + location.length, location.offset);
+            position += HEADER_SIZE + location.length;
+        }
+        if (!batch.submit() || !write_at(compaction.target_fd, chunk.data(), size, compaction.end)) {
+            log_error("Failed to copy Sr records");
+            return false;
+        }
+
+        for (; first < last; ++first) {
+            const auto& [key, location] = compaction.records[first];
+            compaction.index.try_emplace(key, Location{compaction.end, location.length});
+            compaction.end += HEADER_SIZE + location.length;
+            compaction.live += HEADER_SIZE + location.length;
+        }
+    }
+    compaction.records.clear();
+
+    // The bulk of the sync doesn't hold the indexes either.
+    if (!StorageEngine::instance().sync(compaction.target_fd)) {
+        log_error("Failed to sync compacted Sr log");
+        return false;
+    }
+    return true;
+}
+
+bool SrLog::finish_compaction(Compaction& compaction, CompactionStats& stats) {
+    // The log was replaced in the meantime.
+    if (compaction.generation != generation) return false;
+
+    // Copy the records appended since the compaction began.
+    uint64_t tail_start = compaction.end;
+    std::vector<uint8_t> chunk(64 * 1024);
+    for (uint64_t offset = compaction.snapshot_end; offset < end; ) {
+        size_t size = std::min<uint64_t>(chunk.size(), end - offset);
+        if (!read_at(fd, chunk.data(), size, offset) ||
+            !write_at(compaction.target_fd, chunk.data(), size, tail_start + offset - compaction.snapshot_end)) {
+            log_error("Failed to copy Sr tail");
+            return false;
+        }
+        offset += size;
+    }
+    if (!scan(compaction.target_fd, tail_start, compaction.index, compaction.end, compaction.live)) {
+        return false;
+    }
+
+    // The compacted log must be durable before it replaces the current one.
+    if (!StorageEngine::instance().sync(compaction.target_fd)) {
+        log_error("Failed to sync compacted Sr log");
+        return false;
+    }
+
+    std::error_code ec;
+    StorageEngine::instance().rename(compaction.target_path, file_path, ec);
+    if (ec) {
+        log_error("Failed to replace Sr log", "error", ec.message());
+        return false;
+    }
+
+    stats.bytes_before = end;
+    stats.bytes_after = compaction.end;
+
+    ::close(fd);
+    fd = compaction.target_fd;
+    compaction.target_fd = -1;
+    index = std::move(compaction.index);
+    end = compaction.end;
+    live = compaction.live;
+    ++generation;
+    return true;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <vector>
+#include "flat_table.hpp"
+
+namespace fs = std::filesystem;
+
+// Append-only log storing the explicit index Sr.
+// Every update appends a record which supersedes the previous ones for the same tw,
+// an in-memory index keeps the location of the latest record of each tw.
+// Lookups and updates cost a single read or write, superseded records are
+// dropped by compaction.
+//
+// Record: tw (32) || length (8) || value (length), where value is Con (8) || posting
+// list (see UserIndex), or Con (8) || ID1 (UUIDs) in the legacy Sr.enc
+class SrLog {
+public:
+    static constexpr size_t KEY_SIZE = 32;               // tw
+    static constexpr size_t HEADER_SIZE = KEY_SIZE + 8;  // tw || length
+
+    using Key = std::array<uint8_t, KEY_SIZE>;
+
+    // Outcome of a completed compaction
+    struct CompactionStats {
+        size_t bytes_before;  // Size of the log before the compaction
+        size_t bytes_after;   // Size of the compacted log
+    };
+
+    // State of a running compaction (see begin_compaction)
+    struct Compaction;
+
+    SrLog() = default;
+    ~SrLog();
+
+    SrLog(const SrLog&) = delete;
+    SrLog& operator=(const SrLog&) = delete;
+
+    // Opens the log stored at path (created if it doesn't exist) and indexes its records.
+    // A partially written trailing record is truncated.
+    bool open(const fs::path& path);
+    void close();
+    bool is_open() const { return fd != -1; }
+
+    // Reads the latest value of Sr[tw]. Returns false if there is none.
+    bool get(const uint8_t* tw, std::vector<uint8_t>& value) const;
+
+    // The tw of every record
+    std::vector<Key> keys() const;
+
+    // Appends the record Sr[tw] = value.
+    bool put(const uint8_t* tw, const std::vector<uint8_t>& value);
+
+    // Replaces the whole log with serialized records.
+    bool reset(const std::vector<uint8_t>& serialized);
+
+    // Writes the appended records back to the file.
+    bool sync();
+
+    size_t size() const { return index.size(); }
+    size_t file_size() const { return end; }
+    size_t live_bytes() const { return live; }
+    // Memory held by the in-memory index
+    size_t memory_usage() const { return index.memory_usage(); }
+
+    // Compaction: the live records are copied into a fresh log without holding the
+    // user's indexes, the records appended in the meantime are then copied by
+    // finish_compaction, which replaces the log.
+    bool needs_compaction() const;
+    // Called while holding the indexes.
+    std::unique_ptr<Compaction> begin_compaction();
+    // Called without holding the indexes.
+    static bool compaction_copy(Compaction& compaction);
+    // Called while holding the indexes.
+    bool finish_compaction(Compaction& compaction, CompactionStats& stats);
+
+private:
+    // Minimum amount of superseded bytes worth a compaction
+    static constexpr size_t MIN_DEAD_BYTES = 64 * 1024;
+    // Records read in one batch by a compaction copy
+    static constexpr size_t COPY_CHUNK_SIZE = 1 << 20;
+
+    // Location of a record in the log
+    struct Location {
+        uint64_t offset;  // Offset of the record
+        uint64_t length;  // Length of the value
+    };
+
+    using Index = flat::FlatMap<Key, Location>;
+
+    fs::path file_path;
+    int fd = -1;
+    uint64_t end = 0;         // Size of the log
+    uint64_t live = 0;        // Bytes of the latest records
+    uint64_t generation = 0;  // Incremented when the log is replaced
+    Index index;
+
+    // Indexes the records in [from, file end) of fd, truncating a partial trailing record.
+    static bool scan(int fd, uint64_t from, Index& index, uint64_t& end, uint64_t& live);
+};
+
+struct SrLog::Compaction {
+    uint64_t generation = 0;   // Generation of the log being compacted
+    int source_fd = -1;        // Duplicate of the log descriptor
+    int target_fd = -1;
+    fs::path target_path;
+    uint64_t snapshot_end = 0; // Size of the log when the compaction began
+    std::vector<std::pair<Key, Location>> records;  // Live records before snapshot_end
+
+    // The compacted log
+    Index index;
+    uint64_t end = 0;
+    uint64_t live = 0;
+
+    ~Compaction();
+};
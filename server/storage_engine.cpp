@@ -0,0 +1,157 @@
+#include "storage_engine.hpp"
+#include "file_io.hpp"
+#include <cerrno>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static std::unique_ptr<StorageEngine> engine = std::make_unique<FileStorage>();
+
+StorageEngine& StorageEngine::instance() {
+    return *engine;
+}
+
+bool StorageEngine::use(const std::string& name) {
+    if (name == "file") {
+        engine = std::make_unique<FileStorage>();
+    } else if (name == "memory") {
+        engine = std::make_unique<MemoryStorage>();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool StorageEngine::read_file(const fs::path& path, std::vector<uint8_t>& content) {
+    int fd = open(path, 0);
+    struct stat st;
+    bool ok = fd != -1 && fstat(fd, &st) == 0;
+    if (ok) {
+        content.resize(st.st_size);
+        ok = read_at(fd, content.data(), content.size(), 0);
+    }
+    if (fd != -1) ::close(fd);
+    return ok;
+}
+
+int FileStorage::open(const fs::path& path, int flags) {
+    return ::open(path.c_str(), O_RDWR | O_CLOEXEC | flags, 0600);
+}
+
+bool FileStorage::exists(const fs::path& path, std::error_code& ec) {
+    return fs::exists(path, ec);
+}
+
+bool FileStorage::remove(const fs::path& path, std::error_code& ec) {
+    return fs::remove(path, ec);
+}
+
+void FileStorage::rename(const fs::path& from, const fs::path& to, std::error_code& ec) {
+    fs::rename(from, to, ec);
+}
+
+std::vector<fs::path> FileStorage::list(const fs::path& dir, std::error_code& ec) {
+    std::vector<fs::path> paths;
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        if (entry.is_regular_file(ec)) paths.push_back(entry.path());
+    }
+    return paths;
+}
+
+bool FileStorage::create_directories(const fs::path& dir, std::error_code& ec) {
+    return fs::create_directories(dir, ec);
+}
+
+bool FileStorage::sync(int fd) {
+    return fdatasync(fd) == 0;
+}
+
+bool FileStorage::sync_directory(const fs::path& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool synced = fd != -1 && fsync(fd) == 0;
+    if (fd != -1) ::close(fd);
+    return synced;
+}
+
+MemoryStorage::~MemoryStorage() {
+    for (const auto& [name, fd] : files) ::close(fd);
+}
+
+int MemoryStorage::open(const fs::path& path, int flags) {
+    std::lock_guard lock(mutex);
+    std::string name = path.lexically_normal().native();
+
+    auto it = files.find(name);
+    if (it == files.end()) {
+        if (!(flags & O_CREAT)) {
+            errno = ENOENT;
+            return -1;
+        }
+        int fd = memfd_create(path.filename().c_str(), MFD_CLOEXEC);
+        if (fd == -1) return -1;
+        it = files.emplace(name, fd).first;
+    }
+
+    // The caller closes its own descriptor, the file stays until removed.
+    // NOTE: reopened, not duplicated: like a file opened twice, the descriptors don't
+    // share their open file description, nor its locks.
+    int fd = ::open(("/proc/self/fd/" + std::to_string(it->second)).c_str(), O_RDWR | O_CLOEXEC);
+    if (fd != -1 && (flags & O_TRUNC) && ftruncate(fd, 0) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool MemoryStorage::exists(const fs::path& path, std::error_code& ec) {
+    std::lock_guard lock(mutex);
+    ec.clear();
+    return files.contains(path.lexically_normal().native());
+}
+
+bool MemoryStorage::remove(const fs::path& path, std::error_code& ec) {
+    std::lock_guard lock(mutex);
+    ec.clear();
+    auto it = files.find(path.lexically_normal().native());
+    if (it == files.end()) return false;
+    ::close(it->second);
+    files.erase(it);
+    return true;
+}
+
+void MemoryStorage::rename(const fs::path& from, const fs::path& to, std::error_code& ec) {
+    std::lock_guard lock(mutex);
+    auto it = files.find(from.lexically_normal().native());
+    if (it == files.end()) {
+        ec = std::make_error_code(std::errc::no_such_file_or_directory);
+        return;
+    }
+    ec.clear();
+    int fd = it->second;
+    files.erase(it);
+
+    auto [target, inserted] = files.try_emplace(to.lexically_normal().native(), fd);
+    if (!inserted) {
+        ::close(target->second);
+        target->second = fd;
+    }
+}
+
+std::vector<fs::path> MemoryStorage::list(const fs::path& dir, std::error_code& ec) {
+    std::lock_guard lock(mutex);
+    ec.clear();
+    fs::path parent = dir.lexically_normal();
+    std::vector<fs::path> paths;
+    for (const auto& [name, fd] : files) {
+        fs::path path = name;
+        if (path.parent_path() == parent) paths.push_back(std::move(path));
+    }
+    return paths;
+}
+
+bool MemoryStorage::create_directories(const fs::path&, std::error_code& ec) {
+    ec.clear();
+    return true;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Where the files of the users' indexes live. Se, Sr, the UUID dictionary, the
+// document segments and the write-ahead logs are files the indexes map, read and
+// write through descriptors, and the documents are spliced between them and the
+// sockets: an engine names, creates, replaces and removes the files, and makes them
+// durable. One engine serves the whole process, chosen at startup before any index
+// is opened:
+// - file: the storage directory, one directory per user (the default)
+// - memory: anonymous memory files, lost when the server exits; no disk I/O, for
+//   benchmarks and tests
+class StorageEngine {
+public:
+    virtual ~StorageEngine() = default;
+
+    // Opens the file at path for reading and writing. flags: O_CREAT, O_TRUNC.
+    // Returns a descriptor owned by the caller, or -1 (errno set).
+    virtual int open(const fs::path& path, int flags) = 0;
+    virtual bool exists(const fs::path& path, std::error_code& ec) = 0;
+    // Removes the file at path, if any. The descriptors open on it keep it.
+    virtual bool remove(const fs::path& path, std::error_code& ec) = 0;
+    // Replaces the file at to, if any, with the one at from
+    virtual void rename(const fs::path& from, const fs::path& to, std::error_code& ec) = 0;
+    // The files in dir
+    virtual std::vector<fs::path> list(const fs::path& dir, std::error_code& ec) = 0;
+    virtual bool create_directories(const fs::path& dir, std::error_code& ec) = 0;
+    // Makes the data written to fd durable
+    virtual bool sync(int fd) = 0;
+    // Makes the files created, replaced or removed in dir durable
+    virtual bool sync_directory(const fs::path& dir) = 0;
+
+    // Reads the whole file at path (the legacy files are imported this way)
+    bool read_file(const fs::path& path, std::vector<uint8_t>& content);
+
+    static StorageEngine& instance();
+    // Selects the engine of the process by name: file or memory.
+    // Returns false if there is no such engine.
+    static bool use(const std::string& name);
+};
+
+class FileStorage final : public StorageEngine {
+public:
+    int open(const fs::path& path, int flags) override;
+    bool exists(const fs::path& path, std::error_code& ec) override;
+    bool remove(const fs::path& path, std::error_code& ec) override;
+    void rename(const fs::path& from, const fs::path& to, std::error_code& ec) override;
+    std::vector<fs::path> list(const fs::path& dir, std::error_code& ec) override;
+    bool create_directories(const fs::path& dir, std::error_code& ec) override;
+    bool sync(int fd) override;
+    bool sync_directory(const fs::path& dir) override;
+};
+
+// Each file is a memfd: the indexes map, read, write and splice it like a file on
+// the disk, and it is never written back. The directories are implied by the paths
+// of the files, the syncs do nothing.
+// NOTE: the files are outside the cache budget, in the shared memory of the process.
+class MemoryStorage final : public StorageEngine {
+public:
+    MemoryStorage() = default;
+    ~MemoryStorage() override;
+
+    MemoryStorage(const MemoryStorage&) = delete;
+    MemoryStorage& operator=(const MemoryStorage&) = delete;
+
+    int open(const fs::path& path, int flags) override;
+    bool exists(const fs::path& path, std::error_code& ec) override;
+    bool remove(const fs::path& path, std::error_code& ec) override;
+    void rename(const fs::path& from, const fs::path& to, std::error_code& ec) override;
+    std::vector<fs::path> list(const fs::path& dir, std::error_code& ec) override;
+    bool create_directories(const fs::path& dir, std::error_code& ec) override;
+    bool sync(int) override { return true; }
+    bool sync_directory(const fs::path&) override { return true; }
+
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, int> files;  // Descriptor of each file, by normalized path
+};
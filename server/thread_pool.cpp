@@ -0,0 +1,66 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back([this] { worker_loop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (std::thread& worker : workers) worker.join();
+}
+
+size_t ThreadPool::claim(Job& job) {
+    size_t i = job.next++;
+    // Every task is claimed, the job leaves the queue.
+    if (job.next == job.count) std::erase(jobs, &job);
+    return i;
+}
+
+void ThreadPool::run(size_t count, const std::function<void(size_t)>& task) {
+    if (count == 0) return;
+    if (count == 1 || workers.empty()) {
+        for (size_t i = 0; i < count; ++i) task(i);
+        return;
+    }
+
+    Job job{task, count, 0, count};
+    std::unique_lock lock(mutex);
+    jobs.push_back(&job);
+    wakeup.notify_all();
+
+    while (job.next < job.count) {
+        size_t i = claim(job);
+        lock.unlock();
+        task(i);
+        lock.lock();
+        --job.pending;
+    }
+
+    // The job lives on this stack: wait for the tasks claimed by the workers.
+    done.wait(lock, [&] { return job.pending == 0; });
+}
+
+void ThreadPool::worker_loop() {
+    std::unique_lock lock(mutex);
+    while (true) {
+        wakeup.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (stopping) return;
+
+        Job& job = *jobs.front();
+        size_t i = claim(job);
+        lock.unlock();
+        job.task(i);
+        lock.lock();
+        if (--job.pending == 0) done.notify_all();
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed pool of threads running the tasks of parallel loops.
+// The calling thread takes part in its own loop, so a loop always progresses
+// even when the workers are busy with the loops of other callers.
+class ThreadPool {
+public:
+    // Runs loops on `threads` threads, the caller included (0: one per core).
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of threads running a loop, the caller included
+    size_t size() const { return workers.size() + 1; }
+
+    // Calls task(i) for every i in [0, count), returns once every call is done.
+    // NOTE: task must not throw.
+    void run(size_t count, const std::function<void(size_t)>& task);
+
+private:
+    // A loop being run
+    struct Job {
+        const std::function<void(size_t)>& task;
+        size_t count;
+        size_t next = 0;     // Next task to claim
+        size_t pending;      // Tasks not done yet
+    };
+
+    std::mutex mutex;
+    std::condition_variable wakeup;  // Signals a new job or the stop
+    std::condition_variable done;    // Signals a completed task
+    std::deque<Job*> jobs;           // Jobs with unclaimed tasks
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void worker_loop();
+    // Claims the next task of the job. Called while holding mutex.
+    size_t claim(Job& job);
+};
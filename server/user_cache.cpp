@@ -0,0 +1,127 @@
+#include "user_cache.hpp"
+#include "logger.hpp"
+
+UserCache::UserCache(size_t budget, Loader loader)
+    : budget(budget), loader(std::move(loader)) {}
+
+std::shared_ptr<UserIndex> UserCache::get(const std::string& user_id) {
+    Evicted evicted;
+    std::shared_ptr<UserIndex> index;
+    {
+        std::unique_lock lock(mutex);
+        // A user being closed is reloaded once its files are released.
+        settled.wait(lock, [&] { return !busy.contains(user_id); });
+
+        auto it = entries.find(user_id);
+        if (it != entries.end()) {
+            ++hits;
+            lru.splice(lru.begin(), lru, it->second.lru);
+            return it->second.index;
+        }
+
+        ++misses;
+        // Loaded without holding the cache: the other requests of the user wait.
+        busy.insert(user_id);
+        lock.unlock();
+        try {
+            index = loader(user_id);
+        } catch (...) {
+            lock.lock();
+            busy.erase(user_id);
+            settled.notify_all();
+            throw;
+        }
+        lock.lock();
+        busy.erase(user_id);
+        settled.notify_all();
+        if (!index) return nullptr;
+
+        lru.push_front(user_id);
+        size_t charge = index->memory_usage();
+        entries.emplace(user_id, Entry{index, charge, lru.begin()});
+        memory += charge;
+
+        evict(evicted);
+    }
+    close(evicted);
+    return index;
+}
+
+void UserCache::update_charge(const std::string& user_id, size_t charge) {
+    Evicted evicted;
+    {
+        std::lock_guard lock(mutex);
+
+        auto it = entries.find(user_id);
+        if (it == entries.end()) return;
+
+        memory = memory - it->second.charge + charge;
+        it->second.charge = charge;
+
+        evict(evicted);
+    }
+    close(evicted);
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<UserIndex>>> UserCache::snapshot() const {
+    std::lock_guard lock(mutex);
+
+    std::vector<std::pair<std::string, std::shared_ptr<UserIndex>>> result;
+    result.reserve(entries.size());
+    for (auto& [user_id, entry] : entries) result.emplace_back(user_id, entry.index);
+    return result;
+}
+
+UserCache::Stats UserCache::stats() const {
+    std::lock_guard lock(mutex);
+    return {hits, misses, evictions, memory, entries.size()};
+}
+
+void UserCache::evict(Evicted& evicted) {
+    for (auto it = lru.end(); memory > budget && it != lru.begin(); ) {
+        --it;
+        auto entry = entries.find(*it);
+
+        // Users in use by a request (or by the compaction) stay resident.
+        if (entry->second.index.use_count() > 1) continue;
+
+        evicted.emplace_back(*it, std::move(entry->second.index));
+        busy.insert(*it);
+        memory -= entry->second.charge;
+        ++evictions;
+
+        log_info("Evicted indexes", "user", *it, "hits", hits.load(), "misses", misses.load());
+        entries.erase(entry);
+        it = lru.erase(it);
+    }
+}
+
+void UserCache::set_closer(Closer closer) {
+    std::lock_guard lock(mutex);
+    this->closer = std::move(closer);
+}
+
+void UserCache::close(Evicted& evicted) {
+    if (evicted.empty()) return;
+
+    // The last references: the indexes are checkpointed and their files closed.
+    // NOTE: the caller may hold the indexes of another user, they wait for no disk.
+    auto release = [this, evicted = std::move(evicted)]() mutable {
+        for (auto& [user_id, index] : evicted) index.reset();
+
+        std::lock_guard lock(mutex);
+        for (const auto& [user_id, index] : evicted) busy.erase(user_id);
+        settled.notify_all();
+    };
+
+    Closer run;
+    {
+        std::lock_guard lock(mutex);
+        run = closer;
+    }
+    if (run) {
+        run(std::move(release));
+    } else {
+        release();
+    }
+}
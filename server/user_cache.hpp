@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "user_index.hpp"
+
+// Cache of the users' indexes, kept in memory across connections.
+// Every modification is written through to the index files and logged, so
+// evicting a user only checkpoints its indexes and drops its memory. When the
+// total memory exceeds the budget the least recently used users not currently
+// in use are evicted.
+// A user is loaded and closed (checkpointed) without holding the cache, and never
+// while another instance of its indexes is open: the requests of the user wait.
+// The evicted users are closed by the closer, away from the thread evicting them.
+class UserCache {
+public:
+    // Opens the indexes of a user (nullptr on failure)
+    using Loader = std::function<std::shared_ptr<UserIndex>(const std::string& user_id)>;
+    // Runs the closing of evicted users (their checkpoint), without waiting for it
+    using Closer = std::function<void(std::function<void()> close)>;
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t memory;  // Memory charged to the resident users
+        size_t users;   // Resident users
+    };
+
+    UserCache(size_t budget, Loader loader);
+
+    // Returns the indexes of the user, loading them on a miss. Waits while the user
+    // is being loaded or closed by another thread.
+    std::shared_ptr<UserIndex> get(const std::string& user_id);
+
+    // Updates the memory charged to a resident user.
+    // Called while holding the user's indexes, after they are modified.
+    void update_charge(const std::string& user_id, size_t charge);
+
+    // Sets the closer (none: the evicted users are closed by the thread evicting them,
+    // after releasing the cache).
+    void set_closer(Closer closer);
+
+    // The resident users
+    std::vector<std::pair<std::string, std::shared_ptr<UserIndex>>> snapshot() const;
+
+    Stats stats() const;
+
+private:
+    struct Entry {
+        std::shared_ptr<UserIndex> index;
+        size_t charge;
+        std::list<std::string>::iterator lru;
+    };
+
+    const size_t budget;
+    const Loader loader;
+
+    // The indexes of an evicted user, closed once the cache is released
+    using Evicted = std::vector<std::pair<std::string, std::shared_ptr<UserIndex>>>;
+
+    mutable std::mutex mutex;
+    std::list<std::string> lru;  // Most recently used first
+    std::unordered_map<std::string, Entry> entries;
+    size_t memory = 0;
+    std::unordered_set<std::string> busy;  // Users being loaded or closed
+    std::condition_variable settled;       // Notified when a user is no longer busy
+    Closer closer;
+
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+    std::atomic<uint64_t> evictions = 0;
+
+    // Evicts the least recently used users until the budget is met.
+    // The evicted indexes are moved to evicted, their users busy until close(evicted).
+    void evict(Evicted& evicted);
+    // Closes the evicted indexes through the closer, without holding the cache
+    void close(Evicted& evicted);
+};
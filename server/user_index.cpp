@@ -0,0 +1,121 @@
+#include "user_index.hpp"
+#include "logger.hpp"
+#include "posting_list.hpp"
+#include <cstring>
+#include <vector>
+
+UserIndex::~UserIndex() {
+    // The indexes are no longer in use: no lock needed.
+    if (!checkpoint()) log_error("Failed to checkpoint the indexes");
+}
+
+bool UserIndex::recover() {
+    size_t replayed = 0;
+    bool ok = wal.replay([&](Wal::Type type, const uint8_t* payload, size_t size) {
+        ++replayed;
+        return apply(type, payload, size);
+    });
+    if (!ok) {
+        log_error("Failed to replay the write-ahead log");
+        // The log is kept for another attempt: the indexes must not be checkpointed.
+        wal.close();
+        return false;
+    }
+    if (replayed == 0) return true;
+
+    log_info("Replayed logged modifications", "records", replayed);
+    return checkpoint();
+}
+
+bool UserIndex::checkpoint() {
+    if (!wal.is_open()) return true;
+
+    if (!se.sync() || !ids.sync() || !sr.sync() || !docs.sync()) {
+        log_error("Failed to sync the index files");
+        return false;
+    }
+    return wal.reset();
+}
+
+// NOTE: the index files may already hold the modification (or a part of it), so
+// applying it again must lead to the same state.
+bool UserIndex::apply(Wal::Type type, const uint8_t* payload, size_t size) {
+    switch (type) {
+    case Wal::Type::se_insert:
+        return se.insert_serialized(payload, size);
+
+    case Wal::Type::se_erase:
+        if (size % SeTable::KEY_SIZE != 0) return false;
+        for (size_t i = 0; i < size; i += SeTable::KEY_SIZE) se.erase(payload + i);
+        return true;
+
+    case Wal::Type::sr_put:
+        if (size < SrLog::KEY_SIZE) return false;
+        return put_sr_uuids(payload, payload + SrLog::KEY_SIZE, size - SrLog::KEY_SIZE);
+
+    case Wal::Type::uuid_put:
+        return ids.restore(payload, size);
+
+    case Wal::Type::sr_list:
+        if (size < SrLog::KEY_SIZE) return false;
+        return sr.put(payload, std::vector<uint8_t>(payload + SrLog::KEY_SIZE, payload + size));
+
+    case Wal::Type::sr_final: {
+        uint32_t record;
+        if (size < sizeof(record)) return false;
+        std::memcpy(&record, payload, sizeof(record));
+        if (record < SrLog::KEY_SIZE || record > size - sizeof(record) ||
+            (size - sizeof(record) - record) % SeTable::KEY_SIZE != 0) {
+            return false;
+        }
+        const uint8_t* tw = payload + sizeof(record);
+        if (!sr.put(tw, std::vector<uint8_t>(tw + SrLog::KEY_SIZE, tw + record))) return false;
+        for (size_t i = sizeof(record) + record; i < size; i += SeTable::KEY_SIZE) se.erase(payload + i);
+        return true;
+    }
+
+    case Wal::Type::doc_put:
+        return docs.put_batch(payload, size);
+
+    case Wal::Type::doc_erase:
+        if (size % DocStore::UUID_SIZE != 0) return false;
+        return docs.erase_batch(payload, size / DocStore::UUID_SIZE) >= 0;
+
+    case Wal::Type::doc_record: {
+        uint64_t length, offset;
+        uint32_t segment;
+        if (size != DocStore::HEADER_SIZE + sizeof(segment) + sizeof(offset)) return false;
+        std::memcpy(&length, payload + DocStore::UUID_SIZE, sizeof(length));
+        std::memcpy(&segment, payload + DocStore::HEADER_SIZE, sizeof(segment));
+        std::memcpy(&offset, payload + DocStore::HEADER_SIZE + sizeof(segment), sizeof(offset));
+        return docs.restore_record(payload, length, segment, offset);
+    }
+    }
+
+    log_error("Unknown logged modification");
+    return false;
+}
+
+bool UserIndex::put_sr_uuids(const uint8_t* tw, const uint8_t* value, size_t size) {
+    uint64_t con;
+    if (size < sizeof(con)) return false;
+    std::memcpy(&con, value, sizeof(con));
+
+    std::vector<uint32_t> ordinals;
+    if (!ids.assign(value + sizeof(con), (size - sizeof(con)) / DocStore::UUID_SIZE, ordinals)) return false;
+    posting_list::sort(ordinals, ids.size());
+    return sr.put(tw, sr_value(con, ordinals));
+}
+
+std::vector<uint8_t> UserIndex::sr_value(uint64_t con, const std::vector<uint32_t>& ordinals) {
+    std::vector<uint8_t> value(sizeof(con));
+    std::memcpy(value.data(), &con, sizeof(con));
+    posting_list::encode(ordinals, value);
+    return value;
+}
+
+bool UserIndex::parse_sr_value(const std::vector<uint8_t>& value, uint64_t& con, std::vector<uint32_t>& ordinals) {
+    if (value.size() < sizeof(con)) return false;
+    std::memcpy(&con, value.data(), sizeof(con));
+    return posting_list::decode(value.data() + sizeof(con), value.size() - sizeof(con), ordinals);
+}
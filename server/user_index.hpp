@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+#include "se_table.hpp"
+#include "sr_log.hpp"
+#include "uuid_dictionary.hpp"
+#include "doc_store.hpp"
+#include "wal.hpp"
+
+// Resident indexes of a user.
+// Every modification is logged to the write-ahead log, the index files are only
+// synced by a checkpoint (when the log grows too large, when a file is replaced,
+// and when the indexes are closed).
+struct UserIndex {
+    // Held exclusively by the modifications, shared by the searches walking Se
+    std::shared_mutex mutex;
+    SeTable se;
+    SrLog sr;          // Sr[tw] = Con || posting list of the ordinals of ID1 (see posting_list.hpp)
+    UuidDictionary ids;  // Ordinals of the UUIDs in Sr
+    DocStore docs;
+    Wal wal;
+    uint64_t se_updates = 0;  // Updates of Se applied since the indexes were opened
+
+    UserIndex() = default;
+    ~UserIndex();
+
+    UserIndex(const UserIndex&) = delete;
+    UserIndex& operator=(const UserIndex&) = delete;
+
+    // Applies the modifications logged since the last checkpoint, once the
+    // indexes and the log are open, then checkpoints them.
+    bool recover();
+
+    // Syncs the index files and empties the log. Called while holding the indexes.
+    bool checkpoint();
+
+    // Memory held by the indexes (the whole Se mapping is accounted)
+    size_t memory_usage() const {
+        return se.file_size() + sr.memory_usage() + ids.memory_usage() + docs.memory_usage();
+    }
+
+    // Sr[tw] = value in the legacy format, Con || UUIDs (Sr.enc, the sr_put records,
+    // the Sr sent by the client), its UUIDs assigned in the dictionary. Not logged.
+    bool put_sr_uuids(const uint8_t* tw, const uint8_t* value, size_t size);
+
+    // Values of Sr: Con || posting list
+    static std::vector<uint8_t> sr_value(uint64_t con, const std::vector<uint32_t>& ordinals);
+    // Returns false if value is malformed.
+    static bool parse_sr_value(const std::vector<uint8_t>& value, uint64_t& con, std::vector<uint32_t>& ordinals);
+
+private:
+    // Applies a logged modification
+    bool apply(Wal::Type type, const uint8_t* payload, size_t size);
+};
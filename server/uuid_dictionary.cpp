@@ -0,0 +1,156 @@
+#include "uuid_dictionary.hpp"
+#include "file_io.hpp"
+#include "logger.hpp"
+#include "storage_engine.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static_assert(sizeof(UuidDictionary::Uuid) == UuidDictionary::UUID_SIZE, "UUIDs are stored contiguously");
+
+UuidDictionary::~UuidDictionary() {
+    close();
+}
+
+bool UuidDictionary::open(const fs::path& path) {
+    close();
+    file_path = path;
+
+    fd = StorageEngine::instance().open(path, O_CREAT);
+    if (fd == -1) {
+        log_error("Cannot open UUID dictionary", "path", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        log_error("Failed to read UUID dictionary", "path", path);
+        close();
+        return false;
+    }
+    uint64_t count = st.st_size / UUID_SIZE;
+    if (count > UINT32_MAX) count = UINT32_MAX;
+    if (count * UUID_SIZE != static_cast<uint64_t>(st.st_size)) {
+        log_warning("Truncating partial UUID dictionary entry");
+        if (ftruncate(fd, count * UUID_SIZE) != 0) {
+            close();
+            return false;
+        }
+    }
+
+    uuids.resize(count);
+    if (!read_at(fd, uuids.data(), count * UUID_SIZE, 0)) {
+        log_error("Failed to read UUID dictionary", "path", path);
+        close();
+        return false;
+    }
+    return true;
+}
+
+void UuidDictionary::close() {
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    uuids.clear();
+    ordinals.clear();
+    mapped = false;
+}
+
+void UuidDictionary::map() {
+    if (mapped) return;
+    ordinals.reserve(uuids.size());
+    for (size_t i = 0; i < uuids.size(); ++i) ordinals.try_emplace(uuids[i], static_cast<uint32_t>(i));
+    mapped = true;
+}
+
+bool UuidDictionary::assign(const uint8_t* data, size_t count, std::vector<uint32_t>& result) {
+    if (fd == -1) return false;
+
+    map();
+    result.reserve(result.size() + count);
+    const size_t first = uuids.size();
+    Uuid uuid;
+    for (size_t i = 0; i < count; ++i) {
+        std::memcpy(uuid.data(), data + i * UUID_SIZE, UUID_SIZE);
+        if (uuids.size() == UINT32_MAX) {
+            log_error("UUID dictionary full");
+            truncate(first);
+            return false;
+        }
+        auto [ordinal, inserted] = ordinals.try_emplace(uuid, static_cast<uint32_t>(uuids.size()));
+        if (inserted) uuids.push_back(uuid);
+        result.push_back(*ordinal);
+    }
+
+    if (uuids.size() > first &&
+        !write_at(fd, uuids.data() + first, (uuids.size() - first) * UUID_SIZE, first * UUID_SIZE)) {
+        log_error("Failed to append to UUID dictionary");
+        truncate(first);
+        return false;
+    }
+    return true;
+}
+
+void UuidDictionary::find(const uint8_t* data, size_t count, std::vector<uint32_t>& result) {
+    map();
+    Uuid uuid;
+    for (size_t i = 0; i < count; ++i) {
+        std::memcpy(uuid.data(), data + i * UUID_SIZE, UUID_SIZE);
+        if (const uint32_t* ordinal = ordinals.find(uuid)) result.push_back(*ordinal);
+    }
+}
+
+void UuidDictionary::expand(const std::vector<uint32_t>& list, std::vector<uint8_t>& out) const {
+    size_t size = out.size();
+    out.resize(size + list.size() * UUID_SIZE);
+    for (uint32_t ordinal : list) {
+        if (ordinal >= uuids.size()) continue;
+        std::memcpy(out.data() + size, uuids[ordinal].data(), UUID_SIZE);
+        size += UUID_SIZE;
+    }
+    out.resize(size);
+}
+
+std::vector<uint8_t> UuidDictionary::serialize(uint32_t first) const {
+    size_t count = first < uuids.size() ? uuids.size() - first : 0;
+    std::vector<uint8_t> data(sizeof(first) + count * UUID_SIZE);
+    std::memcpy(data.data(), &first, sizeof(first));
+    if (count > 0) std::memcpy(data.data() + sizeof(first), uuids.data() + first, count * UUID_SIZE);
+    return data;
+}
+
+bool UuidDictionary::restore(const uint8_t* data, size_t size) {
+    uint32_t first;
+    if (fd == -1 || size < sizeof(first) || (size - sizeof(first)) % UUID_SIZE != 0) return false;
+    std::memcpy(&first, data, sizeof(first));
+    // The entries before first were synced by a checkpoint.
+    if (first > uuids.size()) return false;
+
+    if (!truncate(first)) return false;
+    std::vector<uint32_t> assigned;
+    if (!assign(data + sizeof(first), (size - sizeof(first)) / UUID_SIZE, assigned)) return false;
+    return uuids.size() == first + assigned.size();
+}
+
+bool UuidDictionary::truncate(uint32_t first) {
+    if (mapped) {
+        for (size_t i = first; i < uuids.size(); ++i) ordinals.erase(uuids[i]);
+    }
+    if (first < uuids.size()) uuids.resize(first);
+    if (ftruncate(fd, static_cast<uint64_t>(first) * UUID_SIZE) != 0) {
+        log_error("Failed to truncate UUID dictionary", "path", file_path);
+        return false;
+    }
+    return true;
+}
+
+bool UuidDictionary::sync() {
+    if (fd == -1) return false;
+    if (!StorageEngine::instance().sync(fd)) {
+        log_error("Failed to sync UUID dictionary", "path", file_path);
+        return false;
+    }
+    return true;
+}
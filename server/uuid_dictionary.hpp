@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+#include "doc_store.hpp"
+#include "flat_table.hpp"
+
+namespace fs = std::filesystem;
+
+// Dictionary of the UUIDs of a user's documents, mapped to dense 32-bit ordinals:
+// Sr stores the ordinals (see posting_list.hpp), the UUIDs are expanded only when
+// results are sent. Ordinals are assigned in order and never reused.
+// The file holds the UUID of each ordinal, in order: new ones are appended at once,
+// the file is synced by the checkpoints of the user's indexes. The searches only
+// expand ordinals: the map from the UUIDs to their ordinals is built when first
+// needed, by the finalization of a search.
+// NOTE: like the other index files, it may lose the entries appended since the last
+// checkpoint on a system crash; the write-ahead log restores them.
+//
+// Entry: UUID (16)
+class UuidDictionary {
+public:
+    static constexpr size_t UUID_SIZE = DocStore::UUID_SIZE;
+
+    using Uuid = DocStore::Uuid;
+
+    UuidDictionary() = default;
+    ~UuidDictionary();
+
+    UuidDictionary(const UuidDictionary&) = delete;
+    UuidDictionary& operator=(const UuidDictionary&) = delete;
+
+    // Opens the dictionary stored at path (created if it doesn't exist).
+    // A partially written trailing entry is truncated.
+    bool open(const fs::path& path);
+    void close();
+    bool is_open() const { return fd != -1; }
+
+    // Appends the ordinals of count UUIDs to ordinals, the new ones assigned and
+    // written with a single write.
+    bool assign(const uint8_t* uuids, size_t count, std::vector<uint32_t>& ordinals);
+
+    // Appends the ordinals of the UUIDs already assigned, the others are skipped.
+    void find(const uint8_t* uuids, size_t count, std::vector<uint32_t>& ordinals);
+
+    // Appends the UUIDs of ordinals to out, the unassigned ones are skipped.
+    void expand(const std::vector<uint32_t>& ordinals, std::vector<uint8_t>& out) const;
+
+    // The entries from ordinal first, serialized as first (4) || UUIDs
+    std::vector<uint8_t> serialize(uint32_t first) const;
+
+    // Restores serialized entries over the ones from their first ordinal on.
+    // Replays the write-ahead log.
+    bool restore(const uint8_t* data, size_t size);
+
+    // Writes the appended entries back to the file.
+    bool sync();
+
+    uint32_t size() const { return static_cast<uint32_t>(uuids.size()); }
+    size_t file_size() const { return uuids.size() * UUID_SIZE; }
+    size_t memory_usage() const { return uuids.capacity() * sizeof(Uuid) + ordinals.memory_usage(); }
+
+private:
+    fs::path file_path;
+    int fd = -1;
+    std::vector<Uuid> uuids;  // By ordinal
+    flat::FlatMap<Uuid, uint32_t> ordinals;  // Of every UUID once built
+    bool mapped = false;
+
+    // Builds ordinals if needed
+    void map();
+    // Drops the entries from ordinal first on
+    bool truncate(uint32_t first);
+};
@@ -0,0 +1,228 @@
+#include "wal.hpp"
+#include "file_io.hpp"
+#include "logger.hpp"
+#include "storage_engine.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+namespace {
+
+// CRC32C (Castagnoli), with the SSE 4.2 instruction when available
+uint32_t crc32c_table(uint32_t crc, const uint8_t* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+            t[i] = c;
+        }
+        return t;
+    }();
+    for (size_t i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+[[gnu::target("sse4.2")]]
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t size) {
+    uint64_t c = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    crc = c;
+    for (; size > 0; ++data, --size) crc = __builtin_ia32_crc32qi(crc, *data);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t size) {
+#if defined(__x86_64__)
+    static const bool sse42 = [] { __builtin_cpu_init(); return __builtin_cpu_supports("sse4.2"); }();
+    if (sse42) return ~crc32c_sse42(~crc, data, size);
+#endif
+    return ~crc32c_table(~crc, data, size);
+}
+
+// CRC of a record: size || type || payload
+uint32_t record_crc(const uint8_t* header, const uint8_t* payload, size_t size) {
+    return crc32c(crc32c(0, header + 4, Wal::HEADER_SIZE - 4), payload, size);
+}
+
+}  // namespace
+
+Wal::~Wal() {
+    close();
+}
+
+bool Wal::open(const fs::path& path, std::chrono::microseconds commit_window) {
+    close();
+    file_path = path;
+    window = commit_window;
+
+    fd = StorageEngine::instance().open(path, O_CREAT);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        log_error("Cannot open write-ahead log", "path", path);
+        close();
+        return false;
+    }
+    // Owned by one instance of the indexes at a time (released when closed): another one,
+    // in this process or another server, would replay and truncate it under the owner.
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        log_error("Write-ahead log in use", "path", path, "error", std::strerror(errno));
+        close();
+        return false;
+    }
+
+    std::lock_guard lock(mutex);
+    base = 0;
+    end = st.st_size;
+    durable = end;
+    return true;
+}
+
+void Wal::close() {
+    if (fd != -1) ::close(fd);
+    fd = -1;
+}
+
+bool Wal::replay(const std::function<bool(Type, const uint8_t*, size_t)>& f) {
+    if (fd == -1) return false;
+    std::lock_guard lock(mutex);
+
+    const uint64_t size = end - base;
+    uint64_t offset = 0;
+    std::vector<uint8_t> payload;
+    while (offset + HEADER_SIZE <= size) {
+        uint8_t header[HEADER_SIZE];
+        if (!read_at(fd, header, sizeof(header), offset)) return false;
+
+        uint32_t crc, length;
+        std::memcpy(&crc, header, sizeof(crc));
+        std::memcpy(&length, header + 4, sizeof(length));
+        if (length > size - offset - HEADER_SIZE) break;
+
+        payload.resize(length);
+        if (!read_at(fd, payload.data(), length, offset + HEADER_SIZE)) return false;
+        if (record_crc(header, payload.data(), length) != crc) break;
+
+        if (!f(static_cast<Type>(header[8]), payload.data(), length)) return false;
+        offset += HEADER_SIZE + length;
+    }
+
+    if (offset != size) {
+        log_warning("Truncating partial log record");
+        if (ftruncate(fd, offset) != 0 || !StorageEngine::instance().sync(fd)) return false;
+        end = base + offset;
+        durable = end;
+    }
+    return true;
+}
+
+bool Wal::append(Type type, const uint8_t* payload, size_t size) {
+    if (fd == -1 || size > UINT32_MAX) return false;
+
+    uint8_t header[HEADER_SIZE];
+    uint32_t length = size;
+    std::memcpy(header + 4, &length, sizeof(length));
+    header[8] = static_cast<uint8_t>(type);
+    uint32_t crc = record_crc(header, payload, size);
+    std::memcpy(header, &crc, sizeof(crc));
+
+    std::lock_guard lock(mutex);
+    const uint64_t offset = end - base;
+
+    // A single write in the common case.
+    iovec iov[2] = {{header, sizeof(header)}, {const_cast<uint8_t*>(payload), size}};
+    ssize_t written = pwritev(fd, iov, 2, offset);
+    bool ok = written == static_cast<ssize_t>(sizeof(header) + size);
+    if (!ok && written >= 0) {
+        // Finish a short write.
+        size_t done = written;
+        ok = true;
+        if (done < sizeof(header)) {
+            ok = write_at(fd, header + done, sizeof(header) - done, offset + done);
+            done = sizeof(header);
+        }
+        size_t sent = done - sizeof(header);
+        ok = ok && write_at(fd, payload + sent, size - sent, offset + done);
+    }
+    if (!ok) {
+        log_error("Failed to append to the write-ahead log");
+        // Drop the partial record, later records must not follow it.
+        if (ftruncate(fd, offset) != 0) log_error("Failed to truncate the write-ahead log");
+        return false;
+    }
+
+    end += sizeof(header) + size;
+    return true;
+}
+
+bool Wal::commit() {
+    std::unique_lock lock(mutex);
+    if (fd == -1) return false;
+
+    const uint64_t target = end;
+    while (durable < target) {
+        if (syncing) {
+            synced.wait(lock);
+            continue;
+        }
+
+        // This request syncs the log: the records appended until then are covered.
+        syncing = true;
+        if (window.count() > 0) {
+            lock.unlock();
+            std::this_thread::sleep_for(window);
+            lock.lock();
+        }
+        const uint64_t position = end;
+        lock.unlock();
+        bool ok = StorageEngine::instance().sync(fd);
+        lock.lock();
+
+        syncing = false;
+        if (ok) durable = std::max(durable, position);
+        synced.notify_all();
+        if (!ok) {
+            log_error("Failed to sync the write-ahead log");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Wal::reset() {
+    if (fd == -1) return false;
+
+    // The index files replaced by renaming must be durable before the log is emptied.
+    bool dir_synced = StorageEngine::instance().sync_directory(file_path.parent_path());
+
+    std::lock_guard lock(mutex);
+    // NOTE: the truncation is synced before anything is appended, otherwise stale
+    // records could be replayed after the new ones.
+    if (!dir_synced || ftruncate(fd, 0) != 0 || !StorageEngine::instance().sync(fd)) {
+        log_error("Failed to reset the write-ahead log");
+        return false;
+    }
+    base = end;
+    durable = end;
+    synced.notify_all();
+    return true;
+}
+
+size_t Wal::size() const {
+    std::lock_guard lock(mutex);
+    return end - base;
+}
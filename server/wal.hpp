@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+
+namespace fs = std::filesystem;
+
+// Write-ahead log of the modifications of a user's indexes.
+// A modification is applied to the indexes and appended to the log while holding
+// them, commit then waits for the log to be durable (the index files are not synced).
+// Commits are grouped: the first waiting request syncs the log for everyone, after
+// the commit window, and the requests arriving during the sync are covered by the next.
+// A checkpoint syncs the index files and empties the log. When the indexes are opened
+// the log is replayed and a partially written trailing record is truncated.
+//
+// Record: CRC32C of the rest (4) || size (4) || type (1) || payload (size)
+class Wal {
+public:
+    enum class Type : uint8_t {
+        se_insert = 1,   // Se entries: (Addrw || value)*
+        se_erase = 2,    // Se keys: Addrw*
+        sr_put = 3,      // Sr record of the legacy format: tw || Con || UUIDs
+        doc_put = 4,     // Documents: (UUID || length || document)*
+        doc_erase = 5,   // Document UUIDs: UUID*
+        doc_record = 6,  // Document written in place: UUID || length || segment (4) || offset (8)
+        uuid_put = 7,    // UUID dictionary entries: first ordinal (4) || UUIDs
+        sr_list = 8,     // Sr record: tw || Con || posting list (written before sr_final)
+        sr_final = 9,    // Search finalization: size (4) || Sr record (tw || Con || posting list) || Addrw*
+                         // of the Se entries it deletes
+    };
+
+    static constexpr size_t HEADER_SIZE = 4 + 4 + 1;
+
+    Wal() = default;
+    ~Wal();
+
+    Wal(const Wal&) = delete;
+    Wal& operator=(const Wal&) = delete;
+
+    // Opens the log stored at path (created if it doesn't exist), locked: fails if
+    // another Wal has it open.
+    bool open(const fs::path& path, std::chrono::microseconds commit_window);
+    void close();
+    bool is_open() const { return fd != -1; }
+
+    // Calls f(type, payload, size) for every record, in order, truncating a partial
+    // trailing record. Fails if f fails.
+    bool replay(const std::function<bool(Type, const uint8_t*, size_t)>& f);
+
+    // Appends a record. Called while holding the user's indexes.
+    bool append(Type type, const uint8_t* payload, size_t size);
+
+    // Waits until the records appended so far are durable.
+    // Called without holding the user's indexes, so that the other requests can append.
+    bool commit();
+
+    // Empties the log. Called while holding the user's indexes, once the index files
+    // are synced: the directory holding them is synced first.
+    bool reset();
+
+    size_t size() const;
+
+private:
+    fs::path file_path;
+    int fd = -1;
+    std::chrono::microseconds window{0};
+
+    mutable std::mutex mutex;
+    std::condition_variable synced;
+    bool syncing = false;  // A request is syncing the log
+    uint64_t base = 0;     // Position of the log file start (advanced by reset)
+    uint64_t end = 0;      // Position of the last record appended
+    uint64_t durable = 0;  // Position up to which the log is durable
+};
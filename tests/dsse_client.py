@@ -0,0 +1,117 @@
+# Client of the server's wire protocol for the tests, as client/protocol.cpp speaks it.
+# The cryptography is simulated: the server never checks it, the keys are random and
+# the entries of Se are built as the client builds them (Addrw chain, masked Eid).
+import hashlib
+import os
+import socket
+import struct
+
+# The server binds the abstract name dsse_apocm through sockpp: an all-zero address
+ADDR = b'\0' * 108
+SYSTEM_CONSTANT = (1 << 64) - 2
+
+
+def H(b):
+    return hashlib.blake2b(b, digest_size=64).digest()
+
+
+def xor(a, b):
+    return bytes(x ^ y for x, y in zip(a, b))
+
+
+def connect():
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(ADDR)
+    return s
+
+
+def recv_exact(s, n):
+    b = b''
+    while len(b) < n:
+        c = s.recv(n - len(b))
+        if not c:
+            raise EOFError('closed after %d/%d bytes' % (len(b), n))
+        b += c
+    return b
+
+
+def wait_close(s):
+    # The server closes the connection once the request is done
+    s.settimeout(5)
+    try:
+        s.recv(1)
+    except OSError:
+        pass
+    s.close()
+
+
+class Client:
+    def __init__(self):
+        self.con = SYSTEM_CONSTANT
+        self.kts = {}   # t, KT of each keyword
+        self.docs = {}  # Encrypted document of each UUID
+
+    def kt(self, w):
+        if w not in self.kts:
+            self.kts[w] = (os.urandom(32), os.urandom(32))
+        return self.kts[w]
+
+    # Se' and the documents of an update, con decremented
+    def build_add(self, index, docs):
+        conb = struct.pack('<Q', self.con)
+        se = {}
+        for w, uuids in index.items():
+            _, kt = self.kt(w)
+            key = H(kt + conb)
+            addr, mask = H(key + b'\xff'), H(key + b'\x00')
+            uuids = list(uuids)
+            for j, u in enumerate(uuids):
+                rn = bytes(64) if j == len(uuids) - 1 else os.urandom(64)
+                eid = os.urandom(40) + u + struct.pack('<Q', 0)
+                se[addr] = xor(mask, eid) + conb + rn
+                addr = xor(addr, rn)
+        data = b''
+        for u, content in docs.items():
+            body = os.urandom(40) + content
+            data += u + struct.pack('<Q', len(body)) + body
+            self.docs[u] = body
+        self.con -= 1
+        return b''.join(k + v for k, v in se.items()), data
+
+    def add(self, index, docs):
+        se, data = self.build_add(index, docs)
+        s = connect()
+        s.sendall(struct.pack('<IQ', 0, len(se)) + se + struct.pack('<Q', len(data)) + data)
+        wait_close(s)
+
+    # Step 1 of a search: the connection and the UUIDs found (ID1 and ID2)
+    def search_step1(self, w, con=None):
+        t, kt = self.kt(w)
+        s = connect()
+        s.sendall(struct.pack('<I', 2) + t + kt + struct.pack('<Q', self.con if con is None else con))
+        n1, n2 = struct.unpack('<QQ', recv_exact(s, 16))
+        ID1, ID2 = recv_exact(s, n1), recv_exact(s, n2)
+        found = set(ID1[i:i + 16] for i in range(0, n1, 16))
+        found.update(ID2[i + 40:i + 56] for i in range(0, n2, 72))
+        return s, found
+
+    def search(self, w, con=None):
+        s, found = self.search_step1(w, con)
+        s.sendall(struct.pack('<Q', len(found)) + b''.join(sorted(found)) +
+                  struct.pack('<Q', self.con if con is None else con))
+        wait_close(s)
+        return found
+
+    # The documents of the UUIDs, None if missing
+    def fetch(self, uuids):
+        s = connect()
+        s.sendall(struct.pack('<IQ', 3, len(uuids)) + b''.join(uuids))
+        n, = struct.unpack('<Q', recv_exact(s, 8))
+        assert n == len(uuids), 'fetch answered %d of %d' % (n, len(uuids))
+        found = {}
+        for _ in range(n):
+            u = recv_exact(s, 16)
+            size, = struct.unpack('<Q', recv_exact(s, 8))
+            found[u] = None if size == (1 << 64) - 1 else recv_exact(s, size)
+        s.close()
+        return found
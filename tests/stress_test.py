@@ -0,0 +1,151 @@
+# Concurrent mixed traffic of a user: updates and searches of the same keywords,
+# searches abandoned between their two steps, fetches. A search must find every
+# document acknowledged before it started and nothing never added; once the traffic
+# stops, and again after a restart, every keyword must have all its documents.
+#
+# python3 stress_test.py [server binary] [server options...]
+import os
+import random
+import signal
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from dsse_client import Client
+
+SERVER = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), '../server/server')
+OPTIONS = sys.argv[2:] or ['--workers=4', '--shards=4', '--cache-budget=1']
+KEYWORDS = ['k%d' % i for i in range(6)]
+UPDATERS, UPDATES = 3, 40
+SEARCHERS, SEARCHES = 4, 60
+ABANDONERS, ABANDONED = 2, 20
+FETCHERS, FETCHES = 2, 30
+
+storage = tempfile.mkdtemp(prefix='dsse_stress_')
+log = open(os.path.join(storage, 'server.log'), 'a')
+
+
+def start():
+    server = subprocess.Popen([os.path.abspath(SERVER), *OPTIONS], cwd=storage, stdout=log, stderr=subprocess.STDOUT)
+    time.sleep(0.5)
+    return server
+
+
+client = Client()
+lock = threading.Lock()   # Guards the client and the documents below
+epoch = threading.Lock()  # Held by an update until acknowledged: searches see whole epochs
+added = {w: set() for w in KEYWORDS}  # Sent, maybe not yet acknowledged
+acked = {w: set() for w in KEYWORDS}
+errors = []
+
+
+def update(seed):
+    rng = random.Random(seed)
+    for _ in range(UPDATES):
+        u = os.urandom(16)
+        words = rng.sample(KEYWORDS, rng.randint(1, 3))
+        with epoch:
+            with lock:
+                for w in words:
+                    added[w].add(u)
+                # Some documents large enough to be received in place (UPDATE_SPLICE_MIN)
+                size = rng.randint(64 << 10, 256 << 10) if rng.random() < 0.1 else rng.randint(0, 300)
+                se, data = {w: {u} for w in words}, {u: os.urandom(size)}
+            client.add(se, data)
+        with lock:
+            for w in words:
+                acked[w].add(u)
+
+
+def search(seed):
+    rng = random.Random(seed)
+    for _ in range(SEARCHES):
+        w = rng.choice(KEYWORDS)
+        with epoch, lock:
+            before, con = set(acked[w]), client.con
+        found = client.search(w, con)
+        with lock:
+            allowed = set(added[w])
+        if not before <= found:
+            errors.append('search of %s lost %d documents' % (w, len(before - found)))
+        if not found <= allowed:
+            errors.append('search of %s found %d documents never added' % (w, len(found - allowed)))
+
+
+# The client goes away after step 1: the documents found must still be found later.
+def abandon(seed):
+    rng = random.Random(seed)
+    for _ in range(ABANDONED):
+        w = rng.choice(KEYWORDS)
+        with epoch, lock:
+            before, con = set(acked[w]), client.con
+        s, found = client.search_step1(w, con)
+        if not before <= found:
+            errors.append('abandoned search of %s lost %d documents' % (w, len(before - found)))
+        time.sleep(rng.random() / 100)
+        s.close()
+
+
+def fetch(seed):
+    rng = random.Random(seed)
+    for _ in range(FETCHES):
+        with lock:
+            uuids = list(set().union(*acked.values()))
+            expected = {u: client.docs[u] for u in uuids}
+        uuids = rng.sample(uuids, min(len(uuids), 16)) + [os.urandom(16)]
+        found = client.fetch(uuids)
+        if found.pop(uuids[-1]) is not None:
+            errors.append('fetch found a document never added')
+        if any(found[u] != expected[u] for u in uuids[:-1]):
+            errors.append('fetch returned a wrong document')
+
+
+def run(target, seed):
+    try:
+        target(seed)
+    except Exception as e:
+        errors.append('%s: %r' % (target.__name__, e))
+
+
+def check(when):
+    for w in KEYWORDS:
+        found = client.search(w)
+        if found != acked[w]:
+            errors.append('%s: %s has %d of %d documents' % (when, w, len(found & acked[w]), len(acked[w])))
+
+
+server = start()
+threads = []
+for target, count in ((update, UPDATERS), (search, SEARCHERS), (abandon, ABANDONERS), (fetch, FETCHERS)):
+    threads += [threading.Thread(target=run, args=(target, len(threads) + i)) for i in range(count)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+check('after the traffic')
+
+# The indexes are found again by a new server (the memory engine keeps nothing)
+if not any(option == '--storage-engine=memory' for option in OPTIONS):
+    # Last documents of each keyword found by a search never finalized
+    for w in KEYWORDS:
+        u = os.urandom(16)
+        client.add({w: {u}}, {u: b''})
+        acked[w].add(u)
+        s, _ = client.search_step1(w)
+        s.close()
+    time.sleep(0.2)
+    server.send_signal(signal.SIGINT)
+    server.wait()
+    server = start()
+    check('after a restart')
+server.send_signal(signal.SIGINT)
+server.wait()
+
+if errors:
+    print('STRESS FAIL', len(errors), errors[:5], 'storage:', storage)
+    sys.exit(1)
+print('STRESS OK', UPDATERS * UPDATES, 'updates', SEARCHERS * SEARCHES + ABANDONERS * ABANDONED, 'searches',
+      FETCHERS * FETCHES, 'fetches')
+subprocess.run(['rm', '-rf', storage])